@@ -32,6 +32,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include "opl3.h"
 
@@ -534,6 +535,7 @@ static void OPL3_EnvelopeCalc(opl3_slot *slot)
 static void OPL3_EnvelopeKeyOn(opl3_slot *slot, uint8_t type)
 {
     slot->key |= type;
+    slot->idle = 0;
 }
 
 static void OPL3_EnvelopeKeyOff(opl3_slot *slot, uint8_t type)
@@ -717,10 +719,15 @@ static void OPL3_ChannelUpdateRhythm(opl3_chip *chip, uint8_t data)
     opl3_channel *channel7;
     opl3_channel *channel8;
     uint8_t chnum;
+    uint8_t slotnum;
 
     chip->rhy = data & 0x3f;
     if (chip->rhy & 0x20)
     {
+        for (slotnum = 12; slotnum < 18; slotnum++)
+        {
+            chip->slot[slotnum].idle = 0;
+        }
         channel6 = &chip->channel[6];
         channel7 = &chip->channel[7];
         channel8 = &chip->channel[8];
@@ -1100,12 +1107,45 @@ static int16_t OPL3_ClipSample(int32_t sample)
     return (int16_t)sample;
 }
 
+/*
+    Fast mode: a keyed off slot whose envelope reached maximum attenuation
+    stays silent until the next key on, which resets its phase anyway.
+    Such slots are parked with zero output and skipped. Not bit exact:
+    the noise generator advances only on active slots and the -1 output
+    of the negative sine half is dropped.
+*/
+
+static uint8_t OPL3_SlotCanIdle(opl3_slot *slot)
+{
+    if (slot->key || slot->eg_gen != envelope_gen_num_release || slot->eg_rout != 0x1ff)
+    {
+        return 0;
+    }
+    /* Rhythm slots feed hh/tc phase bits to each other */
+    if ((slot->chip->rhy & 0x20) && slot->slot_num >= 12 && slot->slot_num < 18)
+    {
+        return 0;
+    }
+    return 1;
+}
+
 static void OPL3_ProcessSlot(opl3_slot *slot)
 {
+    if (slot->idle)
+    {
+        return;
+    }
     OPL3_SlotCalcFB(slot);
     OPL3_EnvelopeCalc(slot);
     OPL3_PhaseGenerate(slot);
     OPL3_SlotGenerate(slot);
+    if (slot->chip->fastmode && OPL3_SlotCanIdle(slot))
+    {
+        slot->idle = 1;
+        slot->out = 0;
+        slot->prout = 0;
+        slot->fbmod = 0;
+    }
 }
 
 inline void OPL3_Generate4Ch(opl3_chip *chip, int16_t *buf4)
@@ -1343,6 +1383,7 @@ void OPL3_Reset(opl3_chip *chip, uint32_t samplerate)
     }
     chip->noise = 1;
     chip->rateratio = (samplerate << RSM_FRAC) / 49716;
+    chip->samplerate = samplerate;
     chip->tremoloshift = 4;
     chip->vibshift = 1;
 
@@ -1469,6 +1510,312 @@ void OPL3_WriteReg(opl3_chip *chip, uint16_t reg, uint8_t v)
     }
 }
 
+void OPL3_SetFastMode(opl3_chip *chip, uint8_t enable)
+{
+    uint8_t slotnum;
+
+    chip->fastmode = enable != 0;
+    if (!chip->fastmode)
+    {
+        for (slotnum = 0; slotnum < 36; slotnum++)
+        {
+            chip->slot[slotnum].idle = 0;
+        }
+    }
+}
+
+/*
+ * State snapshot: header, the chip up to the write buffer, offsets of the
+ * modulator, tremolo and output pointers, then the pending buffered writes.
+ * Pointers are rebuilt on restore, so a snapshot can go to another chip.
+ */
+
+#define OPL3_STATE_MAGIC    0x53334c4f /* "OL3S" */
+#define OPL3_STATE_VERSION  1
+#define OPL3_STATE_CHIPSIZE ((uint32_t)offsetof(opl3_chip, writebuf))
+#define OPL3_STATE_POINTERS (36 * 2 + 18 * 4)
+
+typedef struct _opl3_state_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t chipsize;
+    uint32_t pending;
+} opl3_state_header;
+
+typedef struct _opl3_state_write {
+    uint32_t index;
+    opl3_writebuf write;
+} opl3_state_write;
+
+static uint32_t OPL3_StatePointer(const opl3_chip *chip, const void *ptr)
+{
+    return (uint32_t)((const uint8_t*)ptr - (const uint8_t*)chip);
+}
+
+/* offset of chip->zeromod or of a slot field at field_offset in any of the 36 slots */
+static int OPL3_StateIsSlotField(uint32_t offset, uint32_t field_offset)
+{
+    uint32_t base = (uint32_t)offsetof(opl3_chip, slot);
+    if (offset == (uint32_t)offsetof(opl3_chip, zeromod))
+    {
+        return 1;
+    }
+    return offset >= base && offset < base + 36 * sizeof(opl3_slot)
+        && (offset - base) % sizeof(opl3_slot) == field_offset;
+}
+
+/*
+ * Everything the generator uses as a table index, shift amount or pointer
+ * selector must be in the range the register writes can produce, a crafted
+ * snapshot would read outside the tables otherwise.
+ */
+static int OPL3_StateIsValid(const opl3_chip *chip, const uint32_t *pointers)
+{
+    const opl3_slot *slot;
+    const opl3_channel *channel;
+    uint32_t i, j, n;
+
+    if (chip->newm > 1 || chip->nts > 1 || chip->rhy > 0x3f || chip->vibpos > 7 || chip->vibshift > 1
+        || chip->tremoloshift > 4 || chip->tremolopos >= 210 || chip->eg_add > 13 || chip->eg_state > 1
+        || chip->eg_timerrem > 1 || chip->eg_timer > 0xfffffffff || chip->fastmode > 1
+        || chip->rm_hh_bit2 > 1 || chip->rm_hh_bit3 > 1 || chip->rm_hh_bit7 > 1 || chip->rm_hh_bit8 > 1
+        || chip->rm_tc_bit3 > 1 || chip->rm_tc_bit5 > 1 || chip->rsm_ready > 1
+        || chip->samplerate < OPL_RSM_MIN_RATE || chip->samplerate > 0x3fffff
+        || chip->rateratio != (int32_t)((chip->samplerate << RSM_FRAC) / 49716) || chip->rateratio <= 0
+        || chip->samplecnt < 0 || chip->writebuf_cur >= OPL_WRITEBUF_SIZE || chip->writebuf_last >= OPL_WRITEBUF_SIZE)
+    {
+        return 0;
+    }
+#if OPL_ENABLE_STEREOEXT
+    if (chip->stereoext > 1)
+    {
+        return 0;
+    }
+#endif
+
+    n = 0;
+    for (i = 0; i < 36; i++)
+    {
+        slot = &chip->slot[i];
+        if (slot->slot_num != i || slot->reg_vib > 1 || slot->reg_type > 1 || slot->reg_ksr > 1
+            || slot->reg_mult > 0x0f || slot->reg_ksl > 3 || slot->reg_tl > 0x3f || slot->reg_ar > 0x0f
+            || slot->reg_dr > 0x0f || (slot->reg_sl > 0x0f && slot->reg_sl != 0x1f) || slot->reg_rr > 0x0f
+            || slot->reg_wf > 7 || slot->key > (egk_norm | egk_drum) || slot->eg_gen > envelope_gen_num_release
+            || slot->eg_rout > 0x1ff || slot->idle > 1)
+        {
+            return 0;
+        }
+        if (!OPL3_StateIsSlotField(pointers[n], (uint32_t)offsetof(opl3_slot, out))
+            && !OPL3_StateIsSlotField(pointers[n], (uint32_t)offsetof(opl3_slot, fbmod)))
+        {
+            return 0;
+        }
+        n++;
+        if (pointers[n] != (uint32_t)offsetof(opl3_chip, tremolo) && pointers[n] != (uint32_t)offsetof(opl3_chip, zeromod))
+        {
+            return 0;
+        }
+        n++;
+    }
+    for (i = 0; i < 18; i++)
+    {
+        channel = &chip->channel[i];
+        if (channel->ch_num != i || channel->f_num > 0x3ff || channel->block > 7 || channel->fb > 7
+            || channel->con > 1 || channel->alg > 0x08 || channel->ksv > 0x0f)
+        {
+            return 0;
+        }
+        /* 4-op and drum setups dereference the channel pair or assume the rhythm channels */
+        switch (channel->chtype)
+        {
+        case ch_2op:
+            break;
+        case ch_4op:
+            if ((i % 9) >= 3)
+            {
+                return 0;
+            }
+            break;
+        case ch_4op2:
+            if ((i % 9) < 3 || (i % 9) >= 6)
+            {
+                return 0;
+            }
+            break;
+        case ch_drum:
+            if (i < 6 || i > 8)
+            {
+                return 0;
+            }
+            break;
+        default:
+            return 0;
+        }
+        if ((channel->alg & 0x0c) && (i % 9) >= 6)
+        {
+            return 0;
+        }
+        for (j = 0; j < 4; j++)
+        {
+            if (!OPL3_StateIsSlotField(pointers[n++], (uint32_t)offsetof(opl3_slot, out)))
+            {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+uint32_t OPL3_SaveState(const opl3_chip *chip, uint8_t *buf, uint32_t size)
+{
+    opl3_state_header header;
+    uint32_t pointers[OPL3_STATE_POINTERS];
+    uint32_t total;
+    uint32_t i, j, n;
+    opl3_state_write write;
+
+    header.magic = OPL3_STATE_MAGIC;
+    header.version = OPL3_STATE_VERSION;
+    header.chipsize = OPL3_STATE_CHIPSIZE;
+    header.pending = 0;
+    for (i = 0; i < OPL_WRITEBUF_SIZE; i++)
+    {
+        if (chip->writebuf[i].reg & 0x200)
+        {
+            header.pending++;
+        }
+    }
+    total = sizeof(header) + OPL3_STATE_CHIPSIZE + sizeof(pointers) + header.pending * sizeof(opl3_state_write);
+    if (!buf || size < total)
+    {
+        return total;
+    }
+
+    n = 0;
+    for (i = 0; i < 36; i++)
+    {
+        pointers[n++] = OPL3_StatePointer(chip, chip->slot[i].mod);
+        pointers[n++] = OPL3_StatePointer(chip, chip->slot[i].trem);
+    }
+    for (i = 0; i < 18; i++)
+    {
+        for (j = 0; j < 4; j++)
+        {
+            pointers[n++] = OPL3_StatePointer(chip, chip->channel[i].out[j]);
+        }
+    }
+
+    memcpy(buf, &header, sizeof(header));
+    buf += sizeof(header);
+    memcpy(buf, chip, OPL3_STATE_CHIPSIZE);
+    buf += OPL3_STATE_CHIPSIZE;
+    memcpy(buf, pointers, sizeof(pointers));
+    buf += sizeof(pointers);
+    for (i = 0; i < OPL_WRITEBUF_SIZE; i++)
+    {
+        if (chip->writebuf[i].reg & 0x200)
+        {
+            memset(&write, 0, sizeof(write));
+            write.index = i;
+            write.write = chip->writebuf[i];
+            memcpy(buf, &write, sizeof(write));
+            buf += sizeof(write);
+        }
+    }
+    return total;
+}
+
+int OPL3_RestoreState(opl3_chip *chip, const uint8_t *buf, uint32_t size)
+{
+    opl3_state_header header;
+    uint32_t pointers[OPL3_STATE_POINTERS];
+    opl3_chip *state;
+    int valid;
+    opl3_state_write write;
+    opl3_slot *slot;
+    opl3_channel *channel;
+    uint8_t local_ch_slot;
+    uint32_t i, j, n;
+
+    if (!buf || size < sizeof(header))
+    {
+        return 0;
+    }
+    memcpy(&header, buf, sizeof(header));
+    if (header.magic != OPL3_STATE_MAGIC || header.version != OPL3_STATE_VERSION
+        || header.chipsize != OPL3_STATE_CHIPSIZE || header.pending > OPL_WRITEBUF_SIZE
+        || size < sizeof(header) + OPL3_STATE_CHIPSIZE + sizeof(pointers) + header.pending * sizeof(opl3_state_write))
+    {
+        return 0;
+    }
+    memcpy(pointers, buf + sizeof(header) + OPL3_STATE_CHIPSIZE, sizeof(pointers));
+    /* validated in an aligned copy, the chip is left as it was on failure */
+    state = (opl3_chip*)malloc(sizeof(opl3_chip));
+    if (!state)
+    {
+        return 0;
+    }
+    memcpy(state, buf + sizeof(header), OPL3_STATE_CHIPSIZE);
+    valid = OPL3_StateIsValid(state, pointers);
+    for (i = 0; valid && i < header.pending; i++)
+    {
+        memcpy(&write, buf + sizeof(header) + OPL3_STATE_CHIPSIZE + sizeof(pointers) + i * sizeof(write), sizeof(write));
+        if (write.index >= OPL_WRITEBUF_SIZE || !(write.write.reg & 0x200))
+        {
+            valid = 0;
+        }
+    }
+    if (valid)
+    {
+        memcpy(chip, state, OPL3_STATE_CHIPSIZE);
+    }
+    free(state);
+    if (!valid)
+    {
+        return 0;
+    }
+
+    memset(chip->writebuf, 0, sizeof(chip->writebuf));
+    for (i = 0; i < header.pending; i++)
+    {
+        memcpy(&write, buf + sizeof(header) + OPL3_STATE_CHIPSIZE + sizeof(pointers) + i * sizeof(write), sizeof(write));
+        chip->writebuf[write.index] = write.write;
+    }
+
+    n = 0;
+    for (i = 0; i < 36; i++)
+    {
+        slot = &chip->slot[i];
+        slot->chip = chip;
+        slot->mod = (int16_t*)((uint8_t*)chip + pointers[n++]);
+        slot->trem = (uint8_t*)chip + pointers[n++];
+    }
+    for (i = 0; i < 18; i++)
+    {
+        channel = &chip->channel[i];
+        local_ch_slot = ch_slot[i];
+        channel->slots[0] = &chip->slot[local_ch_slot];
+        channel->slots[1] = &chip->slot[local_ch_slot + 3];
+        chip->slot[local_ch_slot].channel = channel;
+        chip->slot[local_ch_slot + 3].channel = channel;
+        channel->pair = NULL;
+        if ((i % 9) < 3)
+        {
+            channel->pair = &chip->channel[i + 3];
+        }
+        else if ((i % 9) < 6)
+        {
+            channel->pair = &chip->channel[i - 3];
+        }
+        channel->chip = chip;
+        for (j = 0; j < 4; j++)
+        {
+            channel->out[j] = (int16_t*)((uint8_t*)chip + pointers[n++]);
+        }
+    }
+    return 1;
+}
+
 void OPL3_WriteRegBuffered(opl3_chip *chip, uint16_t reg, uint8_t v)
 {
     uint64_t time1, time2;
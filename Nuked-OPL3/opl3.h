@@ -45,6 +45,8 @@ extern "C" {
 
 #define OPL_WRITEBUF_SIZE   1024
 #define OPL_WRITEBUF_DELAY  2
+#define OPL_RSM_TAPS        32
+#define OPL_RSM_MIN_RATE    49      /* lowest output rate, rateratio is 0 below it */
 
 typedef struct _opl3_slot opl3_slot;
 typedef struct _opl3_channel opl3_channel;
@@ -80,6 +82,7 @@ struct _opl3_slot {
     uint32_t pg_phase;
     uint16_t pg_phase_out;
     uint8_t slot_num;
+    uint8_t idle;
 };
 
 struct _opl3_channel {
@@ -136,6 +139,7 @@ struct _opl3_chip {
     uint8_t rm_hh_bit8;
     uint8_t rm_tc_bit3;
     uint8_t rm_tc_bit5;
+    uint8_t fastmode;
 
 #if OPL_ENABLE_STEREOEXT
     uint8_t stereoext;
@@ -147,6 +151,12 @@ struct _opl3_chip {
     int16_t oldsamples[4];
     int16_t samples[4];
 
+    /* band-limited block resampler of the host, cleared by OPL3_Reset */
+    uint32_t samplerate;
+    uint32_t rsm_frac;
+    uint8_t rsm_ready;
+    int16_t rsm_hist[OPL_RSM_TAPS][4];
+
     uint64_t writebuf_samplecnt;
     uint32_t writebuf_cur;
     uint32_t writebuf_last;
@@ -160,6 +170,9 @@ void OPL3_Reset(opl3_chip *chip, uint32_t samplerate);
 void OPL3_WriteReg(opl3_chip *chip, uint16_t reg, uint8_t v);
 void OPL3_WriteRegBuffered(opl3_chip *chip, uint16_t reg, uint8_t v);
 void OPL3_GenerateStream(opl3_chip *chip, int16_t *sndptr, uint32_t numsamples);
+void OPL3_SetFastMode(opl3_chip *chip, uint8_t enable);
+uint32_t OPL3_SaveState(const opl3_chip *chip, uint8_t *buf, uint32_t size);
+int OPL3_RestoreState(opl3_chip *chip, const uint8_t *buf, uint32_t size);
 
 void OPL3_Generate4Ch(opl3_chip *chip, int16_t *buf4);
 void OPL3_Generate4ChResampled(opl3_chip *chip, int16_t *buf4);
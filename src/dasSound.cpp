@@ -13,16 +13,47 @@
 #define MINIAUDIO_IMPLEMENTATION
 #include <miniaudio.h>
 #include <array>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SOUND_SSE2 1
+#else
+#define SOUND_SSE2 0
+#endif
 
 #ifndef _MSC_VER
 #define stricmp strcasecmp
 #endif
 
 MAKE_TYPE_FACTORY(PlayingSoundHandle, das::sound::PlayingSoundHandle)
+MAKE_TYPE_FACTORY(SoundLoadHandle, das::sound::SoundLoadHandle)
+MAKE_TYPE_FACTORY(FmNoteHandle, das::sound::FmNoteHandle)
+MAKE_TYPE_FACTORY(SoundLoadStats, das::sound::SoundLoadStats)
+MAKE_TYPE_FACTORY(SoundMemoryPoolStats, das::sound::SoundMemoryPoolStats)
+MAKE_TYPE_FACTORY(SoundStreamStats, das::sound::SoundStreamStats)
+MAKE_TYPE_FACTORY(Opl3RegWrite, das::sound::Opl3RegWrite)
 MAKE_TYPE_FACTORY(PcmSound, das::sound::PcmSound)
 
 MAKE_TYPE_FACTORY(Opl3Chip, opl3_chip)
 
+DAS_BIND_ENUM_CAST(das::sound::SampleFormat)
+DAS_BASE_BIND_ENUM(das::sound::SampleFormat, SampleFormat, f32, ima_adpcm, s16, f16)
+
 
 namespace das {
 
@@ -43,6 +74,38 @@ struct cast <sound::PlayingSoundHandle>
   }
 };
 
+template <>
+struct cast <sound::SoundLoadHandle>
+{
+  static __forceinline sound::SoundLoadHandle to(vec4f x)
+  {
+    sound::SoundLoadHandle h;
+    h.handle = cast<uint32_t>::to(x);
+    return h;
+  }
+
+  static __forceinline vec4f from(sound::SoundLoadHandle x)
+  {
+    return cast<uint32_t>::from(x.handle);
+  }
+};
+
+template <>
+struct cast <sound::FmNoteHandle>
+{
+  static __forceinline sound::FmNoteHandle to(vec4f x)
+  {
+    sound::FmNoteHandle h;
+    h.handle = cast<uint32_t>::to(x);
+    return h;
+  }
+
+  static __forceinline vec4f from(sound::FmNoteHandle x)
+  {
+    return cast<uint32_t>::from(x.handle);
+  }
+};
+
 
 
 
@@ -57,6 +120,19 @@ struct cast <sound::PlayingSoundHandle>
 #define ONE_DIV_256 (1.f / 256)
 #define ONE_DIV_512 (1.f / 512)
 
+#define MIX_STEP 256
+#define SOURCE_MAX_ADVANCE (double(SOUND_SOURCE_WINDOW_FRAMES - 2) / MIX_STEP)
+
+#define STREAM_RING_FRAMES 16384 // power of 2
+#define STREAM_CHUNK_FRAMES 2048
+
+#define SAMPLE_MEMORY_ALIGNMENT 64
+#define SAMPLE_POOL_MIN_BLOCK 4096
+#define SAMPLE_POOL_MAX_BLOCK (1 << 20)
+#define SAMPLE_POOL_MAX_CLASSES 17 // MIN_BLOCK * 2^n and 1.5 * MIN_BLOCK * 2^n up to MAX_BLOCK
+#define SAMPLE_POOL_SLAB_BYTES (1 << 20)
+#define SAMPLE_ARENA_REGION_BYTES (8 << 20)
+
 static int current_frame = 0;  // !!!!!!!!!!!!!!!!!
 
 
@@ -102,6 +178,144 @@ template <typename T> inline T lerp(T a, T b, float t)
 }
 
 
+static const int16_t ima_step_table[89] =
+{
+  7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45, 50, 55, 60, 66, 73, 80, 88, 97, 107, 118,
+  130, 143, 157, 173, 190, 209, 230, 253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963, 1060,
+  1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484,
+  7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static const int8_t ima_index_table[16] = { -1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8 };
+
+struct ImaAdpcmState
+{
+  int predictor;
+  int index;
+};
+
+static inline int ima_decode_nibble(ImaAdpcmState & st, int nibble)
+{
+  int step = ima_step_table[st.index];
+  int diff = step >> 3;
+  if (nibble & 1)
+    diff += step >> 2;
+  if (nibble & 2)
+    diff += step >> 1;
+  if (nibble & 4)
+    diff += step;
+  if (nibble & 8)
+    diff = -diff;
+  st.predictor = clamp(st.predictor + diff, -32768, 32767);
+  st.index = clamp(st.index + ima_index_table[nibble], 0, 88);
+  return st.predictor;
+}
+
+static inline int ima_encode_sample(ImaAdpcmState & st, int sample)
+{
+  int step = ima_step_table[st.index];
+  int diff = sample - st.predictor;
+  int nibble = 0;
+  if (diff < 0)
+  {
+    nibble = 8;
+    diff = -diff;
+  }
+  if (diff >= step)
+  {
+    nibble |= 4;
+    diff -= step;
+  }
+  step >>= 1;
+  if (diff >= step)
+  {
+    nibble |= 2;
+    diff -= step;
+  }
+  step >>= 1;
+  if (diff >= step)
+    nibble |= 1;
+
+  ima_decode_nibble(st, nibble); // stay in sync with the decoder
+  return nibble;
+}
+
+// Block layout: for each channel int16 predictor, uint8 step index, uint8 reserved, SOUND_ADPCM_BLOCK_FRAMES nibbles.
+// The header holds the decoder state before the first sample of the block, so blocks decode independently.
+
+// encodes whole blocks starting from the given decoder state, src is read up to frames - 1
+static void encode_ima_adpcm_blocks(const float * src, int frames, int channels, ImaAdpcmState * st, uint8_t * dst)
+{
+  for (int first = 0; first < frames; first += SOUND_ADPCM_BLOCK_FRAMES)
+  {
+    for (int c = 0; c < channels; c++, dst += SOUND_ADPCM_BLOCK_BYTES)
+    {
+      dst[0] = uint8_t(st[c].predictor & 0xFF);
+      dst[1] = uint8_t((st[c].predictor >> 8) & 0xFF);
+      dst[2] = uint8_t(st[c].index);
+      dst[3] = 0;
+
+      uint8_t * nibbles = dst + 4;
+      memset(nibbles, 0, SOUND_ADPCM_BLOCK_FRAMES / 2);
+      for (int k = 0; k < SOUND_ADPCM_BLOCK_FRAMES; k++)
+      {
+        float v = src[min(first + k, frames - 1) * channels + c];
+        int sample = clamp(int(lrintf(v * 32767.0f)), -32768, 32767);
+        nibbles[k >> 1] |= uint8_t(ima_encode_sample(st[c], sample) << ((k & 1) * 4));
+      }
+    }
+  }
+}
+
+static void encode_ima_adpcm(const float * src, int frames, int channels, uint8_t * dst)
+{
+  ImaAdpcmState st[2] = { { 0, 0 }, { 0, 0 } };
+  for (int c = 0; c < channels && frames > 1; c++) // start with a step that fits the first delta to avoid a slow attack
+  {
+    int delta = int(fabsf(src[channels + c] - src[c]) * 32767.0f);
+    while (st[c].index < 88 && ima_step_table[st[c].index] < delta)
+      st[c].index++;
+  }
+
+  encode_ima_adpcm_blocks(src, frames, channels, st, dst);
+}
+
+static inline ImaAdpcmState ima_block_state(const uint8_t * header)
+{
+  ImaAdpcmState st;
+  st.predictor = int16_t(uint16_t(header[0] | (header[1] << 8)));
+  st.index = clamp(int(header[2]), 0, 88);
+  return st;
+}
+
+// decodes one block into interleaved frames, dst has room for SOUND_ADPCM_BLOCK_FRAMES + 1 frames,
+// the extra frame is the first frame of the next block (or a copy of the last one) for interpolation
+static void decode_ima_adpcm_block(const uint8_t * blocks, int block, int block_count, int channels, float * __restrict dst)
+{
+  const uint8_t * src = blocks + size_t(block) * channels * SOUND_ADPCM_BLOCK_BYTES;
+  for (int c = 0; c < channels; c++, src += SOUND_ADPCM_BLOCK_BYTES)
+  {
+    ImaAdpcmState st = ima_block_state(src);
+    const uint8_t * nibbles = src + 4;
+    float * __restrict out = dst + c;
+    for (int k = 0; k < SOUND_ADPCM_BLOCK_FRAMES; k += 2, out += channels * 2)
+    {
+      out[0] = ima_decode_nibble(st, nibbles[k >> 1] & 0xF) * (1.0f / 32768);
+      out[channels] = ima_decode_nibble(st, nibbles[k >> 1] >> 4) * (1.0f / 32768);
+    }
+
+    if (block + 1 < block_count)
+    {
+      const uint8_t * next = src + channels * SOUND_ADPCM_BLOCK_BYTES;
+      ImaAdpcmState nextSt = ima_block_state(next);
+      *out = ima_decode_nibble(nextSt, next[4] & 0xF) * (1.0f / 32768);
+    }
+    else
+      *out = out[-channels];
+  }
+}
+
+
 int playing_sound_count = 0;
 int64_t total_samples_played = 0;
 volatile double total_time_played = 0.0;
@@ -111,921 +325,6518 @@ static volatile bool sound_cs_manual_entered = false;
 
 static float master_volume = 1.0f;
 
-static das_hash_set<float *> sound_data_pointers;
-static das_hash_set<DasboxDebugInfo *> dbg_pointers;
+// Sound data bookkeeping, may be updated from loader threads.
+// One record per sample buffer, records never move between slots, free slots are chained.
+struct SoundRecord
+{
+  SampleBuffer * buffer = nullptr;  // nullptr - free slot
+  const float * data = nullptr;
+  size_t size = 0;
+  int creationFrame = 0;
+  int nextFree = -1;
+  char name[40];
+};
+
+static mutex sound_data_cs;
+static vector<SoundRecord> sound_records;
+static int sound_records_free = -1;
+static int sound_record_count = 0;
 static uint64_t memory_used = 0;
+static uint64_t mapped_memory_used = 0;
 
-int get_total_sound_count()
+static int add_sound_record(SampleBuffer * buffer, const float * data, size_t size) // sound_data_cs must be held
 {
-  return int(sound_data_pointers.size());
+  int index = sound_records_free;
+  if (index >= 0)
+    sound_records_free = sound_records[index].nextFree;
+  else
+  {
+    index = int(sound_records.size());
+    sound_records.emplace_back();
+  }
+
+  SoundRecord & r = sound_records[index];
+  r.buffer = buffer;
+  r.data = data;
+  r.size = size;
+  r.creationFrame = current_frame;
+  r.nextFree = -1;
+  r.name[0] = 0;
+  sound_record_count++;
+  return index;
 }
 
-int get_playing_sound_count()
+static void remove_sound_record(int index) // sound_data_cs must be held
 {
-  return int(playing_sound_count);
+  SoundRecord & r = sound_records[index];
+  r.buffer = nullptr;
+  r.data = nullptr;
+  r.nextFree = sound_records_free;
+  sound_records_free = index;
+  sound_record_count--;
 }
 
+// sources of finished voices, chained through nextRetired and deleted outside of the audio thread by collect_retired_sources(),
+// the list has no capacity limit, so a voice can retire its source however long the collection is delayed
+static SoundSource * retired_sources = nullptr;
 
-void PcmSound::newData(size_t size)
+static void retire_source(SoundSource * source) // sound_cs must be held
 {
-  memoryUsed = unsigned(size);
-  data = new float[(size + 3) / sizeof(float)];
-  sound_data_pointers.insert(data);
-  memory_used += memoryUsed;
+  source->nextRetired = retired_sources;
+  retired_sources = source;
 }
 
-void PcmSound::deleteData()
+// buffers whose last reference was dropped by a voice on the audio thread, chained through nextRetired
+static SampleBuffer * retired_buffers = nullptr;
+static void destroy_retired_buffers(SampleBuffer * list);
+
+static void collect_retired_sources(bool wait)
 {
-  memory_used -= memoryUsed;
+  SoundSource * sources = nullptr;
+  SampleBuffer * buffers = nullptr;
+  {
+    unique_lock<mutex> lock(sound_cs, defer_lock);
+    if (wait)
+      lock.lock();
+    else if (!lock.try_lock())
+      return;
 
-  sound_data_pointers.erase(data);
-  delete[] data;
-  data = nullptr;
+    sources = retired_sources;
+    retired_sources = nullptr;
+    buffers = retired_buffers;
+    retired_buffers = nullptr;
+  }
 
-  dbg_pointers.erase(dbg);
-  delete dbg;
-  dbg = nullptr;
+  while (sources)
+  {
+    SoundSource * next = sources->nextRetired;
+    delete sources;
+    sources = next;
+  }
+  destroy_retired_buffers(buffers);
 }
 
 
-PcmSound::PcmSound()
+void SoundSource::fillWindow(int frames)
 {
-  memoryUsed = 0;
-  frequency = 44100;
-  samples = 0;
-  channels = 1;
-  data = nullptr;
-  dbg = nullptr;
+  frames = min(frames, SOUND_SOURCE_WINDOW_FRAMES);
+  if (windowFrames >= frames)
+    return;
+
+  if (!ended)
+    windowFrames += read(window + windowFrames * channels, frames - windowFrames);
+
+  if (windowFrames < frames)
+  {
+    if (!ended && isFinished())
+    {
+      ended = true;
+      endFrame = windowFrames;
+    }
+    else if (!ended && !isSeeking())
+      underruns++;
+
+    memset(window + windowFrames * channels, 0, (frames - windowFrames) * channels * sizeof(float));
+    windowFrames = frames;
+  }
 }
 
-PcmSound::PcmSound(const PcmSound & b)
+void SoundSource::consumeWindow(int frames)
 {
-  memoryUsed = 0;
-  frequency = b.frequency;
-  samples = b.samples;
-  channels = b.channels;
-  newData(getDataMemorySize());
-  memcpy(data, b.data, getDataMemorySize());
-  dbg = b.dbg ? new DasboxDebugInfo(*b.dbg) : nullptr;
-  if (dbg)
-    dbg->creationFrame = current_frame;
+  if (frames <= 0)
+    return;
+
+  frames = min(frames, windowFrames);
+  memmove(window, window + frames * channels, (windowFrames - frames) * channels * sizeof(float));
+  windowFrames -= frames;
+  if (ended)
+    endFrame -= frames;
 }
 
+void SoundSource::resetWindow()
+{
+  windowFrames = 0;
+  endFrame = 0;
+  ended = false;
+}
 
-struct PlayingSound
+int get_total_sound_count()
 {
-  const PcmSound * sound;
-  double pos;      // in samples
-  double startPos; // in samples
-  double stopPos;  // in samples
-  float pitch;
-  float volume;
-  float pan;
-  float volumeL;
-  float volumeR;
-  float volumeTrendL;
-  float volumeTrendR;
-  double timeToStart; // in seconds
-  int channels;
-  int version;
-  bool loop;
-  bool stopMode;
-  bool waitingStart;
+  lock_guard<mutex> lock(sound_data_cs);
+  return sound_record_count;
+}
 
-  PlayingSound()
+int get_playing_sound_count()
+{
+  return int(playing_sound_count);
+}
+
+
+// Read-only file mapped with copy-on-write pages: the page cache is shared between processes
+// until somebody writes to the sound data.
+struct SoundFileMapping
+{
+  void * base = nullptr;
+  size_t size = 0;
+#ifdef _WIN32
+  HANDLE file = INVALID_HANDLE_VALUE;
+  HANDLE map = NULL;
+#endif
+};
+
+static SoundFileMapping * map_sound_file(const char * file_name)
+{
+  SoundFileMapping * m = new SoundFileMapping();
+#ifdef _WIN32
+  m->file = CreateFileA(file_name, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  LARGE_INTEGER size;
+  if (m->file != INVALID_HANDLE_VALUE && GetFileSizeEx(m->file, &size) && size.QuadPart > 0)
   {
-    memset(this, 0, sizeof(*this));
+    m->size = size_t(size.QuadPart);
+    m->map = CreateFileMappingA(m->file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+    if (m->map)
+      m->base = MapViewOfFile(m->map, FILE_MAP_COPY, 0, 0, 0);
+  }
+  if (!m->base)
+  {
+    if (m->map)
+      CloseHandle(m->map);
+    if (m->file != INVALID_HANDLE_VALUE)
+      CloseHandle(m->file);
+    delete m;
+    return nullptr;
+  }
+#else
+  int fd = open(file_name, O_RDONLY);
+  if (fd < 0)
+  {
+    delete m;
+    return nullptr;
   }
 
-  bool isEmpty()
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size > 0)
   {
-    return !sound && !stopMode && !waitingStart;
+    m->size = size_t(st.st_size);
+    m->base = mmap(nullptr, m->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (m->base == MAP_FAILED)
+      m->base = nullptr;
   }
+  close(fd);
+  if (!m->base)
+  {
+    delete m;
+    return nullptr;
+  }
+#endif
+  return m;
+}
 
-  void setStopMode()
+static void unmap_sound_file(SoundFileMapping * m)
+{
+  if (!m)
+    return;
+#ifdef _WIN32
+  UnmapViewOfFile(m->base);
+  CloseHandle(m->map);
+  CloseHandle(m->file);
+#else
+  munmap(m->base, m->size);
+#endif
+  delete m;
+}
+
+
+// Sample memory allocator: size-class pools of 64-byte aligned blocks for short sounds,
+// first-fit arena regions for long ones. All system memory goes through reserve_system_memory(),
+// which enforces the budget set by set_sound_memory_budget().
+
+struct SampleSlab
+{
+  char * base = nullptr;
+  size_t bytes = 0;
+  int blockCount = 0;
+  int usedCount = 0;
+  void * freeList = nullptr;  // free blocks are linked through their first bytes
+};
+
+struct SamplePool
+{
+  size_t blockSize = 0;
+  vector<SampleSlab *> slabs;
+  int blocksUsed = 0;
+  int64_t bytesUsed = 0;
+  int64_t allocations = 0;
+  int64_t failures = 0;
+};
+
+struct ArenaRegion
+{
+  char * base = nullptr;
+  size_t bytes = 0;
+  size_t used = 0;
+  map<size_t, size_t> freeRanges;  // offset -> size, coalesced
+};
+
+static mutex sample_memory_cs;
+static SamplePool sample_pools[SAMPLE_POOL_MAX_CLASSES];
+static int sample_pool_count = 0;
+static map<char *, SampleSlab *> sample_slabs;
+static map<char *, ArenaRegion *> arena_regions;
+static SamplePool arena_stats;  // blockSize stays 0
+static int64_t sample_memory_reserved = 0;
+static int64_t sample_memory_budget = 0; // 0 - unlimited
+
+static void * aligned_system_alloc(size_t size)
+{
+  char * raw = (char *)malloc(size + SAMPLE_MEMORY_ALIGNMENT);
+  if (!raw)
+    return nullptr;
+  char * p = (char *)((uintptr_t(raw) + SAMPLE_MEMORY_ALIGNMENT) & ~uintptr_t(SAMPLE_MEMORY_ALIGNMENT - 1));
+  ((char **)p)[-1] = raw;
+  return p;
+}
+
+static void aligned_system_free(void * p)
+{
+  if (p)
+    free(((char **)p)[-1]);
+}
+
+static void release_system_memory(char * p, size_t size);
+static void trim_sample_memory();
+
+static char * reserve_system_memory(size_t size) // sample_memory_cs must be held
+{
+  if (sample_memory_budget > 0 && sample_memory_reserved + int64_t(size) > sample_memory_budget)
+    trim_sample_memory();
+  if (sample_memory_budget > 0 && sample_memory_reserved + int64_t(size) > sample_memory_budget)
+    return nullptr;
+
+  char * p = (char *)aligned_system_alloc(size);
+  if (p)
+    sample_memory_reserved += int64_t(size);
+  return p;
+}
+
+static void release_system_memory(char * p, size_t size) // sample_memory_cs must be held
+{
+  aligned_system_free(p);
+  sample_memory_reserved -= int64_t(size);
+}
+
+static void init_sample_pools() // sample_memory_cs must be held
+{
+  if (sample_pool_count)
+    return;
+
+  for (size_t size = SAMPLE_POOL_MIN_BLOCK; size <= SAMPLE_POOL_MAX_BLOCK; size *= 2)
   {
-    if (!sound)
+    sample_pools[sample_pool_count++].blockSize = size;
+    if (size * 3 / 2 < SAMPLE_POOL_MAX_BLOCK)
+      sample_pools[sample_pool_count++].blockSize = size * 3 / 2;
+  }
+}
+
+static SamplePool * find_sample_pool(size_t size)
+{
+  for (int i = 0; i < sample_pool_count; i++)
+    if (sample_pools[i].blockSize >= size)
+      return &sample_pools[i];
+  return nullptr;
+}
+
+static void * alloc_pool_block(SamplePool & pool)
+{
+  SampleSlab * slab = nullptr;
+  for (auto && s : pool.slabs)
+    if (s->freeList)
     {
-      waitingStart = false;
-      return;
+      slab = s;
+      break;
     }
 
-    if (stopMode)
+  if (!slab)
+  {
+    size_t bytes = max(size_t(SAMPLE_POOL_SLAB_BYTES), pool.blockSize * 4);
+    char * base = reserve_system_memory(bytes);
+    if (!base)
+      return nullptr;
+
+    slab = new SampleSlab();
+    slab->base = base;
+    slab->bytes = bytes;
+    slab->blockCount = int(bytes / pool.blockSize);
+    for (int i = slab->blockCount - 1; i >= 0; i--)
     {
-      waitingStart = false;
-      return;
+      void * block = base + i * pool.blockSize;
+      *(void **)block = slab->freeList;
+      slab->freeList = block;
     }
+    pool.slabs.push_back(slab);
+    sample_slabs[base] = slab;
+  }
 
-    version += MAX_PLAYING_SOUNDS;
+  void * block = slab->freeList;
+  slab->freeList = *(void **)block;
+  slab->usedCount++;
+  return block;
+}
 
-    if (waitingStart)
-    {
-      waitingStart = false;
-      sound = nullptr;
-      return;
-    }
+static void free_pool_block(SamplePool & pool, char * p)
+{
+  SampleSlab * slab = prev(sample_slabs.upper_bound(p))->second;
+  *(void **)p = slab->freeList;
+  slab->freeList = p;
+  slab->usedCount--;
 
-    if (channels == 1)
-    {
-      float val = sound->getData()[unsigned(pos)];
-      volumeL *= val;
-      volumeR *= val;
-    }
-    else
-    {
-      volumeL *= sound->getData()[unsigned(pos) * 2];
-      volumeR *= sound->getData()[unsigned(pos) * 2 + 1];
-    }
-    volumeTrendL = sign(volumeL) * -(1.f / 10000);
-    volumeTrendR = sign(volumeR) * -(1.f / 10000);
-    stopMode = true;
-    sound = nullptr;
+  if (slab->usedCount == 0 && pool.slabs.size() > 1) // keep the last slab to avoid churn on create/delete loops
+  {
+    pool.slabs.erase(find(pool.slabs.begin(), pool.slabs.end(), slab));
+    sample_slabs.erase(slab->base);
+    release_system_memory(slab->base, slab->bytes);
+    delete slab;
   }
+}
 
-  void mixTo(float * __restrict mix, int count, int frequency, double inv_frequency, double buffer_time)
+static void * alloc_arena_block(size_t size)
+{
+  for (auto && it : arena_regions)
   {
-    G_UNUSED(frequency);
-    float wishVolumeL = master_volume * volume * min(1.0f + pan, 1.0f);
-    float wishVolumeR = master_volume * volume * min(1.0f - pan, 1.0f);
-    float * __restrict sndData = sound ? sound->getData() : nullptr;
+    ArenaRegion * r = it.second;
+    for (auto range = r->freeRanges.begin(); range != r->freeRanges.end(); ++range)
+      if (range->second >= size)
+      {
+        size_t offset = range->first;
+        size_t rest = range->second - size;
+        r->freeRanges.erase(range);
+        if (rest)
+          r->freeRanges[offset + size] = rest;
+        r->used += size;
+        return r->base + offset;
+      }
+  }
 
-    double advance = sound ? double(sound->frequency) * inv_frequency * pitch : 1.0;
+  size_t bytes = max(size_t(SAMPLE_ARENA_REGION_BYTES), size);
+  char * base = reserve_system_memory(bytes);
+  if (!base)
+    return nullptr;
+
+  ArenaRegion * r = new ArenaRegion();
+  r->base = base;
+  r->bytes = bytes;
+  r->used = size;
+  if (bytes > size)
+    r->freeRanges[size] = bytes - size;
+  arena_regions[base] = r;
+  return base;
+}
 
-    if (!stopMode && !waitingStart && sound && volumeL > 0.0f && volumeR > 0.0f &&
-        wishVolumeL == volumeL && wishVolumeR == volumeR &&
-        pos + advance * count < stopPos &&
-        sndData != nullptr
-       )
+static void free_arena_block(char * p, size_t size)
+{
+  ArenaRegion * r = prev(arena_regions.upper_bound(p))->second;
+  r->used -= size;
+
+  size_t offset = size_t(p - r->base);
+  auto next = r->freeRanges.lower_bound(offset);
+  if (next != r->freeRanges.end() && offset + size == next->first)
+  {
+    size += next->second;
+    next = r->freeRanges.erase(next);
+  }
+  if (next != r->freeRanges.begin())
+  {
+    auto before = prev(next);
+    if (before->first + before->second == offset)
     {
-      if (channels == 1)
-      {
-        for (int i = 0; i < count; i++, mix += 2)
-        {
-          unsigned ip = unsigned(pos);
-          float t = float(pos - ip);
-          float v = lerp(sndData[ip], sndData[ip + 1], t);
-          mix[0] += v * volumeL;
-          mix[1] += v * volumeR;
-          pos += advance;
-        }
-      }
-      else // channels == 2
+      before->second += size;
+      size = 0;
+    }
+  }
+  if (size)
+    r->freeRanges[offset] = size;
+
+  if (r->used == 0 && arena_regions.size() > 1)
+  {
+    arena_regions.erase(r->base);
+    release_system_memory(r->base, r->bytes);
+    delete r;
+  }
+}
+
+// empty slabs and regions are kept for reuse until the budget needs their memory
+static void trim_sample_memory() // sample_memory_cs must be held
+{
+  for (int i = 0; i < sample_pool_count; i++)
+  {
+    vector<SampleSlab *> & slabs = sample_pools[i].slabs;
+    for (size_t j = 0; j < slabs.size();)
+      if (slabs[j]->usedCount == 0)
       {
-        for (int i = 0; i < count; i++, mix += 2)
-        {
-          unsigned ip = unsigned(pos);
-          float t = float(pos - ip);
-          float vl = lerp(sndData[ip * 2], sndData[ip * 2 + 2], t);
-          float vr = lerp(sndData[ip * 2 + 1], sndData[ip * 2 + 2 + 1], t);
-          mix[0] += vl * volumeL;
-          mix[1] += vr * volumeR;
-          pos += advance;
-        }
+        sample_slabs.erase(slabs[j]->base);
+        release_system_memory(slabs[j]->base, slabs[j]->bytes);
+        delete slabs[j];
+        slabs.erase(slabs.begin() + j);
       }
+      else
+        j++;
+  }
 
-      return;
-    }
-
-    if (waitingStart && timeToStart > buffer_time)
+  for (auto it = arena_regions.begin(); it != arena_regions.end();)
+    if (it->second->used == 0)
     {
-      timeToStart -= buffer_time;
-      return;
+      release_system_memory(it->second->base, it->second->bytes);
+      delete it->second;
+      it = arena_regions.erase(it);
     }
+    else
+      ++it;
+}
 
-    if (!sndData && !stopMode)
-      stopMode = true;
+static size_t get_sample_block_size(size_t size) // sample_memory_cs must be held
+{
+  if (SamplePool * pool = find_sample_pool(size))
+    return pool->blockSize;
+  return (size + SAMPLE_MEMORY_ALIGNMENT - 1) & ~size_t(SAMPLE_MEMORY_ALIGNMENT - 1);
+}
 
-    if (channels == 1)
-    {
-      for (int i = 0; i < count; i++, mix += 2)
-      {
-        if (waitingStart)
-        {
-          timeToStart -= inv_frequency;
-          if (timeToStart <= 0.0)
-          {
-            waitingStart = false;
-            pos = startPos;
-          }
-        }
-        else if (!stopMode)
-        {
-          unsigned ip = unsigned(pos);
-          float t = float(pos - ip);
-          float v = lerp(sndData[ip], sndData[ip + 1], t);
+static float * alloc_sample_memory(size_t size)
+{
+  lock_guard<mutex> lock(sample_memory_cs);
+  init_sample_pools();
+
+  size = max(size, size_t(1));
+  SamplePool * pool = find_sample_pool(size);
+  SamplePool & stats = pool ? *pool : arena_stats;
+  size_t blockSize = get_sample_block_size(size);
+  void * p = pool ? alloc_pool_block(*pool) : alloc_arena_block(blockSize);
+  if (!p)
+  {
+    stats.failures++;
+    LOG(LogLevel::error) << "Cannot allocate " << uint64_t(size) << " bytes of sound data, sound memory budget of " <<
+      sample_memory_budget << " bytes is exhausted";
+    return nullptr;
+  }
 
-          mix[0] += v * volumeL;
-          mix[1] += v * volumeR;
+  stats.allocations++;
+  stats.blocksUsed++;
+  stats.bytesUsed += int64_t(blockSize);
+  return (float *)p;
+}
 
-          if (volumeL != wishVolumeL)
-          {
-            if (fabsf(volumeL - wishVolumeL) <= ONE_DIV_512)
-              volumeL = wishVolumeL;
-            else if (volumeL < wishVolumeL)
-              volumeL += ONE_DIV_512;
-            else
-              volumeL -= ONE_DIV_512;
-          }
+static void free_sample_memory(float * p, size_t size)
+{
+  if (!p)
+    return;
 
-          if (volumeR != wishVolumeR)
-          {
-            if (fabsf(volumeR - wishVolumeR) <= ONE_DIV_512)
-              volumeR = wishVolumeR;
-            else if (volumeR < wishVolumeR)
-              volumeR += ONE_DIV_512;
-            else
-              volumeR -= ONE_DIV_512;
-          }
+  lock_guard<mutex> lock(sample_memory_cs);
+  size = max(size, size_t(1));
+  SamplePool * pool = find_sample_pool(size);
+  size_t blockSize = get_sample_block_size(size);
+  SamplePool & stats = pool ? *pool : arena_stats;
+  stats.blocksUsed--;
+  stats.bytesUsed -= int64_t(blockSize);
+  if (pool)
+    free_pool_block(*pool, (char *)p);
+  else
+    free_arena_block((char *)p, blockSize);
+}
 
-          pos += advance;
-          if (pos >= stopPos)
-          {
-            if (loop)
-              pos = startPos;
-            else
-            {
-              pos = stopPos;
-              setStopMode();
-            }
-          }
-        }
-        else // stopMode
-        {
-          if (fabsf(volumeL) <= ONE_DIV_512)
-            volumeL = 0.0f;
-          else
-          {
-            volumeL += volumeTrendL;
-            volumeL *= 0.997f;
-          }
+void set_sound_memory_budget(int64_t bytes)
+{
+  lock_guard<mutex> lock(sample_memory_cs);
+  sample_memory_budget = max(bytes, int64_t(0));
+  if (sample_memory_budget > 0 && sample_memory_reserved > sample_memory_budget)
+    trim_sample_memory();
+}
 
-          if (fabsf(volumeR) <= ONE_DIV_512)
-            volumeR = 0.0f;
-          else
-          {
-            volumeR += volumeTrendR;
-            volumeR *= 0.997f;
-          }
+int64_t get_sound_memory_budget()
+{
+  lock_guard<mutex> lock(sample_memory_cs);
+  return sample_memory_budget;
+}
 
-          if (volumeR == 0.f && volumeL == 0.f)
-          {
-            stopMode = false;
-            break;
-          }
+int64_t get_sound_memory_reserved()
+{
+  lock_guard<mutex> lock(sample_memory_cs);
+  return sample_memory_reserved;
+}
 
-          mix[0] += volumeL;
-          mix[1] += volumeR;
-        }
-      }
+int get_sound_memory_pool_count()
+{
+  lock_guard<mutex> lock(sample_memory_cs);
+  init_sample_pools();
+  return sample_pool_count + 1; // + large block arena
+}
+
+bool get_sound_memory_pool_stats(int index, SoundMemoryPoolStats & stats)
+{
+  lock_guard<mutex> lock(sample_memory_cs);
+  init_sample_pools();
+  stats = SoundMemoryPoolStats();
+  if (index < 0 || index > sample_pool_count)
+    return false;
+
+  const SamplePool & pool = index < sample_pool_count ? sample_pools[index] : arena_stats;
+  stats.blockSize = int(pool.blockSize);
+  stats.blocksUsed = pool.blocksUsed;
+  stats.bytesUsed = pool.bytesUsed;
+  stats.allocations = pool.allocations;
+  stats.failures = pool.failures;
+  if (index < sample_pool_count)
+  {
+    for (auto && slab : pool.slabs)
+    {
+      stats.blocksReserved += slab->blockCount;
+      stats.bytesReserved += int64_t(slab->bytes);
     }
-    else // channels == 2
+  }
+  else
+  {
+    for (auto && it : arena_regions)
     {
-      for (int i = 0; i < count; i++, mix += 2)
-      {
-        if (waitingStart)
-        {
-          timeToStart -= inv_frequency;
-          if (timeToStart <= 0.0)
-          {
-            waitingStart = false;
-            pos = startPos;
-          }
-        }
-        else if (!stopMode)
-        {
-          unsigned ip = unsigned(pos);
-          float t = float(pos - ip);
-          float vl = lerp(sndData[ip * 2], sndData[ip * 2 + 2], t);
-          float vr = lerp(sndData[ip * 2 + 1], sndData[ip * 2 + 2 + 1], t);
+      stats.blocksReserved++;
+      stats.bytesReserved += int64_t(it.second->bytes);
+    }
+  }
+  return true;
+}
+
+
+// Sample storage shared by PcmSound copies. Buffers are immutable while shared,
+// a writer gets its own copy first (PcmSound::makeDataUnique).
+// Playing voices hold references too and are linked into a per-buffer list, so lifetime events
+// touch only the voices of the affected buffer. When the last PcmSound lets go of a buffer its voices
+// fade out, and the buffer is freed after the last of them (off the audio thread, see retired_buffers).
+struct SampleBuffer
+{
+  atomic<int> refCount;        // PcmSound owners + voices
+  atomic<int> soundRefs;       // PcmSound owners
+  atomic<int> voiceCount;
+  int firstVoice;              // index in playing_sounds, 0 - none; guarded by sound_cs
+  SampleBuffer * nextRetired;
+  float * data;
+  size_t size;
+  SoundFileMapping * mapping;  // data points into the mapping instead of the heap
+  int record;                  // slot in sound_records
+};
+
+// copies the debug name of the sound to the record of its buffer
+static void register_debug_info(const PcmSound & sound)
+{
+  SampleBuffer * b = sound.getBuffer();
+  if (!b || !sound.dbg)
+    return;
+
+  lock_guard<mutex> lock(sound_data_cs);
+  SoundRecord & r = sound_records[b->record];
+  memcpy(r.name, sound.dbg->name, sizeof(r.name));
+  r.name[sizeof(r.name) - 1] = 0;
+}
+
+static SampleBuffer * new_sample_buffer(float * data, size_t size, SoundFileMapping * mapping)
+{
+  SampleBuffer * b = new SampleBuffer();
+  b->refCount = 1;
+  b->soundRefs = 1;
+  b->voiceCount = 0;
+  b->firstVoice = 0;
+  b->nextRetired = nullptr;
+  b->data = data;
+  b->size = size;
+  b->mapping = mapping;
+
+  lock_guard<mutex> lock(sound_data_cs);
+  b->record = add_sound_record(b, data, size);
+  if (mapping)
+    mapped_memory_used += mapping->size;
+  else
+    memory_used += size;
+  return b;
+}
+
+static void free_sample_buffer_storage(SampleBuffer * b)
+{
+  if (b->mapping)
+    unmap_sound_file(b->mapping);
+  else
+    free_sample_memory(b->data, b->size);
+  delete b;
+}
+
+static void destroy_sample_buffer(SampleBuffer * b)
+{
+  {
+    lock_guard<mutex> lock(sound_data_cs);
+    remove_sound_record(b->record);
+    if (b->mapping)
+      mapped_memory_used -= b->mapping->size;
+    else
+      memory_used -= b->size;
+  }
+  free_sample_buffer_storage(b);
+}
+
+static void destroy_retired_buffers(SampleBuffer * list)
+{
+  while (list)
+  {
+    SampleBuffer * next = list->nextRetired;
+    destroy_sample_buffer(list);
+    list = next;
+  }
+}
+
+static void stop_buffer_voices(SampleBuffer * b);
+
+static void acquire_sound_buffer(SampleBuffer * b)
+{
+  if (!b)
+    return;
+  b->soundRefs++;
+  b->refCount++;
+}
+
+// drops the reference of a PcmSound, must not be called with sound_cs held
+static void release_sound_buffer(SampleBuffer * b)
+{
+  if (!b)
+    return;
+
+  if (--b->soundRefs == 0 && b->voiceCount > 0)
+    stop_buffer_voices(b);
+
+  if (--b->refCount == 0)
+    destroy_sample_buffer(b);
+}
+
+
+bool PcmSound::newData(size_t size)
+{
+  float * storage = alloc_sample_memory(size);
+  if (!storage)
+    return false;
+
+  SampleBuffer * old = buffer;
+  memoryUsed = unsigned(size);
+  data = storage;
+  buffer = new_sample_buffer(data, size, nullptr);
+  release_sound_buffer(old);
+  register_debug_info(*this);
+  return true;
+}
+
+void PcmSound::deleteData()
+{
+  release_sound_buffer(buffer);
+  buffer = nullptr;
+  data = nullptr;
+
+  delete dbg;
+  dbg = nullptr;
+}
+
+bool PcmSound::isMapped() const
+{
+  return buffer && buffer->mapping;
+}
+
+bool PcmSound::isShared() const
+{
+  return buffer && buffer->soundRefs > 1;
+}
+
+// voices of the shared buffer keep playing the old data
+bool PcmSound::makeDataUnique()
+{
+  if (!buffer || buffer->soundRefs == 1) // a private file mapping is copy-on-write by itself
+    return true;
+
+  size_t size = buffer->size;
+  float * copy = alloc_sample_memory(size);
+  if (!copy)
+    return false;
+  memcpy(copy, data, size);
+  SampleBuffer * shared = buffer;
+  buffer = new_sample_buffer(copy, size, nullptr);
+  data = copy;
+  memoryUsed = unsigned(size);
+  release_sound_buffer(shared);
+  register_debug_info(*this);
+  return true;
+}
+
+
+PcmSound::PcmSound()
+{
+  memoryUsed = 0;
+  frequency = 44100;
+  samples = 0;
+  channels = 1;
+  format = SampleFormat::f32;
+  data = nullptr;
+  buffer = nullptr;
+  dbg = nullptr;
+}
+
+PcmSound::PcmSound(const PcmSound & b)
+{
+  memoryUsed = b.memoryUsed;
+  frequency = b.frequency;
+  samples = b.samples;
+  channels = b.channels;
+  format = b.format;
+  data = b.data;
+  buffer = b.buffer;
+  acquire_sound_buffer(buffer);
+  dbg = b.dbg ? new DasboxDebugInfo(*b.dbg) : nullptr;
+  if (dbg)
+    dbg->creationFrame = current_frame;
+}
+
+
+// sample accessors used by the mixing kernels, ip is a frame index, ip + 1 must be readable
+
+// half float storage, kept distinct from int16_t so the accessors below can overload on it
+struct Half
+{
+  uint16_t bits;
+};
+
+static inline float sample_to_float(float v)
+{
+  return v;
+}
+
+static inline float sample_to_float(int16_t v)
+{
+  return v * (1.0f / 32768.0f);
+}
+
+static inline float sample_to_float(Half v)
+{
+  // re-bias the exponent with a multiply, denormal halves become normal floats for free;
+  // the encoder clamps to the largest finite half, so inf/nan never reach the mixer
+  union { uint32_t u; float f; } x;
+  x.u = uint32_t(v.bits & 0x7fff) << 13;
+  float f = x.f * 5.192296858534828e+33f; // 2^112
+  return (v.bits & 0x8000) ? -f : f;
+}
+
+static inline int16_t float_to_s16(float v)
+{
+  float r = v * 32768.0f;
+  r = r < -32768.0f ? -32768.0f : (r > 32767.0f ? 32767.0f : r);
+  return int16_t(lrintf(r));
+}
+
+static inline Half float_to_half(float v)
+{
+  union { uint32_t u; float f; } x;
+  x.f = fabsf(v) * 1.925929944387236e-34f; // 2^-112, the rounding below happens at the half mantissa width
+  uint32_t bits = (x.u + 0xfff + ((x.u >> 13) & 1)) >> 13;
+  Half h;
+  h.bits = uint16_t((bits > 0x7bff ? 0x7bff : bits) | (v < 0.0f ? 0x8000 : 0));
+  return h;
+}
+
+template <typename T>
+struct PcmFrames
+{
+  const T * __restrict data;
+
+  explicit PcmFrames(const void * data_) : data((const T *)data_) {}
+
+  bool isValid() const
+  {
+    return data != nullptr;
+  }
+
+  float mono(unsigned ip, float t)
+  {
+    return lerp(sample_to_float(data[ip]), sample_to_float(data[ip + 1]), t);
+  }
+
+  void stereo(unsigned ip, float t, float & vl, float & vr)
+  {
+    vl = lerp(sample_to_float(data[ip * 2]), sample_to_float(data[ip * 2 + 2]), t);
+    vr = lerp(sample_to_float(data[ip * 2 + 1]), sample_to_float(data[ip * 2 + 2 + 1]), t);
+  }
+};
+
+typedef PcmFrames<float> FloatFrames;
+
+static void copy_mono_to_stereo(const float * __restrict src, float * __restrict dst, int count)
+{
+  int i = 0;
+#if SOUND_SSE2
+  for (; i + 4 <= count; i += 4)
+  {
+    __m128 v = _mm_loadu_ps(src + i);
+    _mm_storeu_ps(dst + i * 2, _mm_unpacklo_ps(v, v));
+    _mm_storeu_ps(dst + i * 2 + 4, _mm_unpackhi_ps(v, v));
+  }
+#endif
+  for (; i < count; i++)
+  {
+    dst[i * 2] = src[i];
+    dst[i * 2 + 1] = src[i];
+  }
+}
+
+static void mix_stereo_to_mono(const float * __restrict src, float * __restrict dst, int count)
+{
+  int i = 0;
+#if SOUND_SSE2
+  __m128 half = _mm_set1_ps(0.5f);
+  for (; i + 4 <= count; i += 4)
+  {
+    __m128 a = _mm_loadu_ps(src + i * 2);
+    __m128 b = _mm_loadu_ps(src + i * 2 + 4);
+    __m128 l = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+    __m128 r = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+    _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_add_ps(l, r), half));
+  }
+#endif
+  for (; i < count; i++)
+    dst[i] = (src[i * 2] + src[i * 2 + 1]) * 0.5f;
+}
+
+static void convert_channels(const float * src, int src_channels, float * dst, int dst_channels, int count)
+{
+  if (src_channels == dst_channels)
+    memcpy(dst, src, size_t(count) * dst_channels * sizeof(float));
+  else if (src_channels == 1)
+    copy_mono_to_stereo(src, dst, count);
+  else
+    mix_stereo_to_mono(src, dst, count);
+}
+
+static void convert_s16_to_float(const int16_t * __restrict src, float * __restrict dst, int count)
+{
+  int i = 0;
+#if SOUND_SSE2
+  __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+  for (; i + 8 <= count; i += 8)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+    __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+    _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+    _mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+  }
+#endif
+  for (; i < count; i++)
+    dst[i] = sample_to_float(src[i]);
+}
+
+struct AdpcmFrames
+{
+  const uint8_t * data;
+  int blockCount;
+  float * __restrict cache;
+  int & cachedBlock;
+
+  AdpcmFrames(const void * data_, int samples, float * cache_, int & cached_block)
+    : data((const uint8_t *)data_), blockCount((samples + 1 + SOUND_ADPCM_BLOCK_FRAMES - 1) / SOUND_ADPCM_BLOCK_FRAMES),
+      cache(cache_), cachedBlock(cached_block) {}
+
+  bool isValid() const
+  {
+    return data != nullptr;
+  }
+
+  const float * frame(unsigned ip, int channels)
+  {
+    int block = int(ip / SOUND_ADPCM_BLOCK_FRAMES);
+    if (block != cachedBlock)
+    {
+      decode_ima_adpcm_block(data, block, blockCount, channels, cache);
+      cachedBlock = block;
+    }
+    return cache + (ip & (SOUND_ADPCM_BLOCK_FRAMES - 1)) * channels;
+  }
+
+  float mono(unsigned ip, float t)
+  {
+    const float * f = frame(ip, 1);
+    return lerp(f[0], f[1], t);
+  }
+
+  void stereo(unsigned ip, float t, float & vl, float & vr)
+  {
+    const float * f = frame(ip, 2);
+    vl = lerp(f[0], f[2], t);
+    vr = lerp(f[1], f[3], t);
+  }
+};
+
+
+struct PlayingSound;
+static void unlink_voice_buffer(PlayingSound * voice);
+
+struct PlayingSound
+{
+  SampleBuffer * buffer;  // referenced while the voice reads sample data
+  const void * data;
+  int sampleRate;
+  int samples;
+  SampleFormat format;
+  int prevVoice;  // list of voices of the same buffer
+  int nextVoice;
+  SoundSource * source;
+  float * blockCache; // for formats decoded by blocks
+  int cachedBlock;
+  double pos;      // in samples
+  double startPos; // in samples
+  double stopPos;  // in samples
+  float pitch;
+  float volume;
+  float pan;
+  float volumeL;
+  float volumeR;
+  float volumeTrendL;
+  float volumeTrendR;
+  double timeToStart; // in seconds
+  int channels;
+  int version;
+  bool loop;
+  bool stopMode;
+  bool waitingStart;
+
+  PlayingSound()
+  {
+    memset(this, 0, sizeof(*this));
+  }
+
+  bool isEmpty()
+  {
+    return !buffer && !source && !stopMode && !waitingStart;
+  }
+
+  void releaseBuffer()
+  {
+    if (buffer)
+      unlink_voice_buffer(this);
+  }
+
+  void releaseSource()
+  {
+    if (source)
+    {
+      retire_source(source);
+      source = nullptr;
+    }
+  }
+
+  void setStopMode()
+  {
+    if (!buffer && !source)
+    {
+      waitingStart = false;
+      return;
+    }
+
+    if (stopMode)
+    {
+      waitingStart = false;
+      return;
+    }
+
+    version += MAX_PLAYING_SOUNDS;
+
+    if (waitingStart)
+    {
+      waitingStart = false;
+      releaseBuffer();
+      releaseSource();
+      return;
+    }
+
+    float vl = 0.0f;
+    float vr = 0.0f;
+    if (source)
+    {
+      vl = source->window[unsigned(pos) * channels];
+      vr = source->window[unsigned(pos) * channels + channels - 1];
+    }
+    else if (format == SampleFormat::ima_adpcm)
+    {
+      AdpcmFrames frames(data, samples, blockCache, cachedBlock);
+      getFrame(frames, vl, vr);
+    }
+    else if (format == SampleFormat::s16)
+    {
+      PcmFrames<int16_t> frames(data);
+      getFrame(frames, vl, vr);
+    }
+    else if (format == SampleFormat::f16)
+    {
+      PcmFrames<Half> frames(data);
+      getFrame(frames, vl, vr);
+    }
+    else
+    {
+      FloatFrames frames(data);
+      getFrame(frames, vl, vr);
+    }
+    volumeL *= vl;
+    volumeR *= vr;
+    volumeTrendL = sign(volumeL) * -(1.f / 10000);
+    volumeTrendR = sign(volumeR) * -(1.f / 10000);
+    stopMode = true;
+    releaseBuffer();
+    releaseSource();
+  }
+
+  template <typename Frames>
+  void getFrame(Frames & frames, float & vl, float & vr)
+  {
+    if (channels == 1)
+      vl = vr = frames.mono(unsigned(pos), 0.0f);
+    else
+      frames.stereo(unsigned(pos), 0.0f, vl, vr);
+  }
+
+  void stepVolume(float wishVolumeL, float wishVolumeR)
+  {
+    if (volumeL != wishVolumeL)
+    {
+      if (fabsf(volumeL - wishVolumeL) <= ONE_DIV_512)
+        volumeL = wishVolumeL;
+      else if (volumeL < wishVolumeL)
+        volumeL += ONE_DIV_512;
+      else
+        volumeL -= ONE_DIV_512;
+    }
+
+    if (volumeR != wishVolumeR)
+    {
+      if (fabsf(volumeR - wishVolumeR) <= ONE_DIV_512)
+        volumeR = wishVolumeR;
+      else if (volumeR < wishVolumeR)
+        volumeR += ONE_DIV_512;
+      else
+        volumeR -= ONE_DIV_512;
+    }
+  }
+
+  // source voices keep pos relative to the start of source->window
+  void mixSourceTo(float * __restrict mix, int count, double inv_frequency)
+  {
+    float wishVolumeL = master_volume * volume * min(1.0f + pan, 1.0f);
+    float wishVolumeR = master_volume * volume * min(1.0f - pan, 1.0f);
+    double rate = source->rateScale(source->windowFrames - pos, count * inv_frequency);
+    double advance = min(double(source->frequency) * inv_frequency * pitch * rate, SOURCE_MAX_ADVANCE);
+
+    source->fillWindow(int(pos + advance * count) + 2);
+    const float * __restrict sndData = source->window;
+
+    if (channels == 1)
+    {
+      for (int i = 0; i < count; i++, mix += 2)
+      {
+        unsigned ip = unsigned(pos);
+        float t = float(pos - ip);
+        float v = lerp(sndData[ip], sndData[ip + 1], t);
+        mix[0] += v * volumeL;
+        mix[1] += v * volumeR;
+        stepVolume(wishVolumeL, wishVolumeR);
+        pos += advance;
+      }
+    }
+    else // channels == 2
+    {
+      for (int i = 0; i < count; i++, mix += 2)
+      {
+        unsigned ip = unsigned(pos);
+        float t = float(pos - ip);
+        float vl = lerp(sndData[ip * 2], sndData[ip * 2 + 2], t);
+        float vr = lerp(sndData[ip * 2 + 1], sndData[ip * 2 + 2 + 1], t);
+        mix[0] += vl * volumeL;
+        mix[1] += vr * volumeR;
+        stepVolume(wishVolumeL, wishVolumeR);
+        pos += advance;
+      }
+    }
+
+    if (source->ended && pos >= source->endFrame)
+    {
+      pos = max(source->endFrame - 1, 0);
+      setStopMode();
+      return;
+    }
+
+    unsigned consumed = unsigned(pos);
+    source->consumeWindow(consumed);
+    pos -= consumed;
+  }
+
+  void mixTo(float * __restrict mix, int count, int frequency, double inv_frequency, double buffer_time)
+  {
+    G_UNUSED(frequency);
+    if (source && !stopMode)
+    {
+      mixSourceTo(mix, count, inv_frequency);
+      return;
+    }
+
+    if (buffer && format == SampleFormat::ima_adpcm)
+    {
+      AdpcmFrames frames(data, samples, blockCache, cachedBlock);
+      mixFramesTo(frames, mix, count, inv_frequency, buffer_time);
+    }
+    else if (buffer && format == SampleFormat::s16)
+    {
+      PcmFrames<int16_t> frames(data);
+      mixFramesTo(frames, mix, count, inv_frequency, buffer_time);
+    }
+    else if (buffer && format == SampleFormat::f16)
+    {
+      PcmFrames<Half> frames(data);
+      mixFramesTo(frames, mix, count, inv_frequency, buffer_time);
+    }
+    else
+    {
+      FloatFrames frames(data);
+      mixFramesTo(frames, mix, count, inv_frequency, buffer_time);
+    }
+  }
+
+  template <typename Frames>
+  void mixFramesTo(Frames & frames, float * __restrict mix, int count, double inv_frequency, double buffer_time)
+  {
+    float wishVolumeL = master_volume * volume * min(1.0f + pan, 1.0f);
+    float wishVolumeR = master_volume * volume * min(1.0f - pan, 1.0f);
+
+    double advance = buffer ? double(sampleRate) * inv_frequency * pitch : 1.0;
+
+    if (!stopMode && !waitingStart && buffer && volumeL > 0.0f && volumeR > 0.0f &&
+        wishVolumeL == volumeL && wishVolumeR == volumeR &&
+        pos + advance * count < stopPos &&
+        frames.isValid()
+       )
+    {
+      if (channels == 1)
+      {
+        for (int i = 0; i < count; i++, mix += 2)
+        {
+          unsigned ip = unsigned(pos);
+          float t = float(pos - ip);
+          float v = frames.mono(ip, t);
+          mix[0] += v * volumeL;
+          mix[1] += v * volumeR;
+          pos += advance;
+        }
+      }
+      else // channels == 2
+      {
+        for (int i = 0; i < count; i++, mix += 2)
+        {
+          unsigned ip = unsigned(pos);
+          float t = float(pos - ip);
+          float vl, vr;
+          frames.stereo(ip, t, vl, vr);
+          mix[0] += vl * volumeL;
+          mix[1] += vr * volumeR;
+          pos += advance;
+        }
+      }
+
+      return;
+    }
+
+    if (waitingStart && timeToStart > buffer_time)
+    {
+      timeToStart -= buffer_time;
+      return;
+    }
+
+    if (!frames.isValid() && !stopMode)
+      stopMode = true;
+
+    if (channels == 1)
+    {
+      for (int i = 0; i < count; i++, mix += 2)
+      {
+        if (waitingStart)
+        {
+          timeToStart -= inv_frequency;
+          if (timeToStart <= 0.0)
+          {
+            waitingStart = false;
+            pos = startPos;
+          }
+        }
+        else if (!stopMode)
+        {
+          unsigned ip = unsigned(pos);
+          float t = float(pos - ip);
+          float v = frames.mono(ip, t);
+
+          mix[0] += v * volumeL;
+          mix[1] += v * volumeR;
+
+          if (volumeL != wishVolumeL)
+          {
+            if (fabsf(volumeL - wishVolumeL) <= ONE_DIV_512)
+              volumeL = wishVolumeL;
+            else if (volumeL < wishVolumeL)
+              volumeL += ONE_DIV_512;
+            else
+              volumeL -= ONE_DIV_512;
+          }
+
+          if (volumeR != wishVolumeR)
+          {
+            if (fabsf(volumeR - wishVolumeR) <= ONE_DIV_512)
+              volumeR = wishVolumeR;
+            else if (volumeR < wishVolumeR)
+              volumeR += ONE_DIV_512;
+            else
+              volumeR -= ONE_DIV_512;
+          }
+
+          pos += advance;
+          if (pos >= stopPos)
+          {
+            if (loop)
+              pos = startPos;
+            else
+            {
+              pos = stopPos;
+              setStopMode();
+            }
+          }
+        }
+        else // stopMode
+        {
+          if (fabsf(volumeL) <= ONE_DIV_512)
+            volumeL = 0.0f;
+          else
+          {
+            volumeL += volumeTrendL;
+            volumeL *= 0.997f;
+          }
+
+          if (fabsf(volumeR) <= ONE_DIV_512)
+            volumeR = 0.0f;
+          else
+          {
+            volumeR += volumeTrendR;
+            volumeR *= 0.997f;
+          }
+
+          if (volumeR == 0.f && volumeL == 0.f)
+          {
+            stopMode = false;
+            break;
+          }
+
+          mix[0] += volumeL;
+          mix[1] += volumeR;
+        }
+      }
+    }
+    else // channels == 2
+    {
+      for (int i = 0; i < count; i++, mix += 2)
+      {
+        if (waitingStart)
+        {
+          timeToStart -= inv_frequency;
+          if (timeToStart <= 0.0)
+          {
+            waitingStart = false;
+            pos = startPos;
+          }
+        }
+        else if (!stopMode)
+        {
+          unsigned ip = unsigned(pos);
+          float t = float(pos - ip);
+          float vl, vr;
+          frames.stereo(ip, t, vl, vr);
+
+          mix[0] += vl * volumeL;
+          mix[1] += vr * volumeR;
+
+          if (volumeL != wishVolumeL)
+          {
+            if (fabsf(volumeL - wishVolumeL) <= ONE_DIV_512)
+              volumeL = wishVolumeL;
+            else if (volumeL < wishVolumeL)
+              volumeL += ONE_DIV_512;
+            else
+              volumeL -= ONE_DIV_512;
+          }
+
+          if (volumeR != wishVolumeR)
+          {
+            if (fabsf(volumeR - wishVolumeR) <= ONE_DIV_512)
+              volumeR = wishVolumeR;
+            else if (volumeR < wishVolumeR)
+              volumeR += ONE_DIV_512;
+            else
+              volumeR -= ONE_DIV_512;
+          }
+
+          pos += advance;
+          if (pos >= stopPos)
+          {
+            if (loop)
+              pos = startPos;
+            else
+            {
+              pos = stopPos;
+              setStopMode();
+            }
+          }
+        }
+        else // stopMode
+        {
+          if (fabsf(volumeL) <= ONE_DIV_512)
+            volumeL = 0.0f;
+          else
+          {
+            volumeL += volumeTrendL;
+            volumeL *= 0.997f;
+          }
+
+          if (fabsf(volumeR) <= ONE_DIV_512)
+            volumeR = 0.0f;
+          else
+          {
+            volumeR += volumeTrendR;
+            volumeR *= 0.997f;
+          }
+
+          if (volumeR == 0.f && volumeL == 0.f)
+          {
+            stopMode = false;
+            break;
+          }
+
+          mix[0] += volumeL;
+          mix[1] += volumeR;
+        }
+      }
+    }
+  }
+};
+
+static array<PlayingSound, MAX_PLAYING_SOUNDS> playing_sounds;
+static float voice_block_cache[MAX_PLAYING_SOUNDS][(SOUND_ADPCM_BLOCK_FRAMES + 1) * 2];
+
+static void link_voice_buffer(int idx, SampleBuffer * b) // sound_cs must be held
+{
+  PlayingSound & v = playing_sounds[idx];
+  v.buffer = b;
+  v.prevVoice = 0;
+  v.nextVoice = b->firstVoice;
+  if (b->firstVoice)
+    playing_sounds[b->firstVoice].prevVoice = idx;
+  b->firstVoice = idx;
+  b->refCount++;
+  b->voiceCount++;
+}
+
+static void unlink_voice_buffer(PlayingSound * voice) // sound_cs must be held
+{
+  SampleBuffer * b = voice->buffer;
+  if (voice->prevVoice)
+    playing_sounds[voice->prevVoice].nextVoice = voice->nextVoice;
+  else
+    b->firstVoice = voice->nextVoice;
+  if (voice->nextVoice)
+    playing_sounds[voice->nextVoice].prevVoice = voice->prevVoice;
+
+  voice->prevVoice = 0;
+  voice->nextVoice = 0;
+  voice->buffer = nullptr;
+  voice->data = nullptr;
+  b->voiceCount--;
+  if (--b->refCount == 0) // usually on the audio thread, the memory is freed by collect_retired_sources()
+  {
+    b->nextRetired = retired_buffers;
+    retired_buffers = b;
+  }
+}
+
+static void stop_buffer_voices(SampleBuffer * b)
+{
+  lock_guard<mutex> lock(sound_cs);
+  for (int idx = b->firstVoice; idx;)
+  {
+    int next = playing_sounds[idx].nextVoice;
+    playing_sounds[idx].setStopMode();
+    idx = next;
+  }
+}
+
+static int allocate_playing_sound()
+{
+  for (int i = 1; i < MAX_PLAYING_SOUNDS; i++)
+    if (playing_sounds[i].isEmpty())
+    {
+      playing_sounds[i].version += MAX_PLAYING_SOUNDS;
+      return i;
+    }
+  return -1;
+}
+
+static bool is_handle_valid(PlayingSoundHandle ps)
+{
+  unsigned idx = ps.handle & PLAYING_SOUNDS_MASK;
+  return (playing_sounds[idx].version == int(ps.handle & (~PLAYING_SOUNDS_MASK))) && idx > 0;
+}
+
+static int handle_to_index(PlayingSoundHandle ps)
+{
+  if (!is_handle_valid(ps))
+    return -1;
+  return ps.handle & PLAYING_SOUNDS_MASK;
+}
+
+
+static float g_limiter_mult = 1.0f;
+
+static void apply_limiter(float * __restrict buf, int count)
+{
+  float limiter_mult = g_limiter_mult;
+  for (int i = 0; i < count; i++, buf++)
+  {
+    float v = *buf * limiter_mult;
+    *buf = v;
+    if (fabsf(v) > 1.0f)
+      limiter_mult *= 0.96f;
+    if (limiter_mult < 1.0f)
+      limiter_mult = min(limiter_mult + (0.5f / 65536), 1.0f);
+  }
+
+  g_limiter_mult = limiter_mult;
+}
+
+
+static void fill_buffer_cb(float * __restrict out_buf, int frequency, int channels, int samples)
+{
+  int cnt = 0;
+  double total_time_played_ = total_time_played;
+  {
+    lock_guard<mutex> lock(sound_cs);
+    float * mixCursor = out_buf;
+    int samplesLeft = samples;
+    memset(out_buf, 0, samples * channels * sizeof(float));
+
+    double invFrequency = 1.0 / frequency;
+    int step = MIX_STEP;
+
+    while (samplesLeft > 0)
+    {
+      cnt = 0;
+      for (auto && s : playing_sounds)
+        if (!s.isEmpty())
+        {
+          cnt++;
+          s.mixTo(mixCursor, min(samplesLeft, step), frequency, invFrequency, min(samplesLeft, step) * invFrequency);
+        }
+
+      samplesLeft -= step;
+      mixCursor += step * channels;
+      total_samples_played += min(samplesLeft, step);
+      total_time_played_ += min(samplesLeft, step) * invFrequency;
+    }
+  }
+  apply_limiter(out_buf, samples * channels);
+  playing_sound_count = cnt;
+
+  total_time_played = total_time_played_;
+}
+
+
+
+static ma_device miniaudio_device;
+static volatile bool device_initialized = false;
+static ma_log ma_log_struct = { 0 };
+static ma_context audio_context = { 0 };
+
+
+void on_error_log(void * user_data, ma_uint32 level, const char * message)
+{
+  G_UNUSED(user_data);
+  G_UNUSED(level);
+  if (level <= 1)
+    LOG(LogLevel::error) << message;
+  else
+    LOG(LogLevel::info) << message;
+}
+
+static void miniaudio_data_callback(ma_device* p_device, void* p_output, const void* p_input, ma_uint32 frame_count)
+{
+  G_UNUSED(p_input);
+
+  if (!device_initialized)
+  {
+    memset(p_output, 0, frame_count * ma_get_bytes_per_frame(p_device->playback.format, p_device->playback.channels));
+    return;
+  }
+
+  fill_buffer_cb((float *)p_output, OUTPUT_SAMPLE_RATE, p_device->playback.channels, frame_count);
+}
+
+void init_sound_lib_internal()
+{
+  if (device_initialized)
+    return;
+
+  ma_log_init(nullptr, &ma_log_struct);
+  ma_log_register_callback(&ma_log_struct, {on_error_log, nullptr});
+
+  ma_context_init(NULL, 0, NULL, &audio_context);
+  audio_context.pLog = &ma_log_struct;
+
+  ma_device_config deviceConfig;
+
+  deviceConfig = ma_device_config_init(ma_device_type_playback);
+  deviceConfig.playback.format = ma_format_f32;
+  deviceConfig.playback.channels = OUTPUT_CHANNELS;
+  deviceConfig.sampleRate = OUTPUT_SAMPLE_RATE;
+  deviceConfig.dataCallback = miniaudio_data_callback;
+  deviceConfig.pUserData = nullptr;
+
+  if (ma_device_init(&audio_context, &deviceConfig, &miniaudio_device) != MA_SUCCESS)
+  {
+    LOG(LogLevel::error) << "SOUND: Failed to open playback device";
+    return;
+  }
+
+  LOG() << "Sound device name: " << miniaudio_device.playback.name;
+
+  if (ma_device_start(&miniaudio_device) != MA_SUCCESS)
+  {
+    LOG(LogLevel::error) << "SOUND: Failed to start playback device";
+    ma_device_uninit(&miniaudio_device);
+    return;
+  }
+
+  device_initialized = true;
+}
+
+static bool has_extension(const char * file_name, const char * ext)
+{
+  const char * p = strrchr(file_name, '.');
+  return p && !stricmp(p, ext);
+}
+
+
+// single producer / single consumer ring of interleaved frames
+struct SampleRing
+{
+  float * data = nullptr;
+  int channels = 1;
+  uint32_t capacity = 0; // in frames, power of 2
+  atomic<uint64_t> writePos;
+  atomic<uint64_t> readPos;
+
+  SampleRing() : writePos(0), readPos(0) {}
+
+  ~SampleRing()
+  {
+    delete[] data;
+  }
+
+  void init(uint32_t frames, int channels_)
+  {
+    channels = channels_;
+    capacity = frames;
+    data = new float[capacity * channels];
+    writePos = 0;
+    readPos = 0;
+  }
+
+  uint32_t available() const
+  {
+    return uint32_t(writePos.load(memory_order_acquire) - readPos.load(memory_order_relaxed));
+  }
+
+  uint32_t space() const
+  {
+    return capacity - uint32_t(writePos.load(memory_order_relaxed) - readPos.load(memory_order_acquire));
+  }
+
+  uint32_t write(const float * src, uint32_t frames)
+  {
+    frames = min(frames, space());
+    uint64_t w = writePos.load(memory_order_relaxed);
+    uint32_t offset = uint32_t(w & (capacity - 1));
+    uint32_t first = min(frames, capacity - offset);
+    memcpy(data + offset * channels, src, first * channels * sizeof(float));
+    memcpy(data, src + first * channels, (frames - first) * channels * sizeof(float));
+    writePos.store(w + frames, memory_order_release);
+    return frames;
+  }
+
+  uint32_t read(float * dst, uint32_t frames)
+  {
+    frames = min(frames, available());
+    uint64_t r = readPos.load(memory_order_relaxed);
+    uint32_t offset = uint32_t(r & (capacity - 1));
+    uint32_t first = min(frames, capacity - offset);
+    memcpy(dst, data + offset * channels, first * channels * sizeof(float));
+    memcpy(dst + first * channels, data, (frames - first) * channels * sizeof(float));
+    readPos.store(r + frames, memory_order_release);
+    return frames;
+  }
+};
+
+
+struct StreamDecoder
+{
+  enum Type
+  {
+    NONE,
+    WAV,
+    MP3,
+    FLAC,
+  };
+
+  Type type = NONE;
+  drwav wav;
+  drmp3 mp3;
+  drflac * flac = nullptr;
+  int channels = 0;
+  int sampleRate = 0;
+  int64_t totalFrames = 0;
+
+  ~StreamDecoder()
+  {
+    close();
+  }
+
+  bool open(const char * file_name)
+  {
+    if (has_extension(file_name, ".wav"))
+    {
+      if (!drwav_init_file(&wav, file_name, nullptr))
+        return false;
+      type = WAV;
+      channels = int(wav.channels);
+      sampleRate = int(wav.sampleRate);
+      totalFrames = int64_t(wav.totalPCMFrameCount);
+    }
+    else if (has_extension(file_name, ".mp3"))
+    {
+      if (!drmp3_init_file(&mp3, file_name, nullptr))
+        return false;
+      type = MP3;
+      channels = int(mp3.channels);
+      sampleRate = int(mp3.sampleRate);
+      totalFrames = int64_t(drmp3_get_pcm_frame_count(&mp3));
+      drmp3_seek_to_pcm_frame(&mp3, 0);
+    }
+    else if (has_extension(file_name, ".flac"))
+    {
+      flac = drflac_open_file(file_name, nullptr);
+      if (!flac)
+        return false;
+      type = FLAC;
+      channels = int(flac->channels);
+      sampleRate = int(flac->sampleRate);
+      totalFrames = int64_t(flac->totalPCMFrameCount);
+    }
+    return type != NONE;
+  }
+
+  void close()
+  {
+    if (type == WAV)
+      drwav_uninit(&wav);
+    else if (type == MP3)
+      drmp3_uninit(&mp3);
+    else if (type == FLAC)
+      drflac_close(flac);
+    type = NONE;
+    flac = nullptr;
+  }
+
+  int read(float * dst, int frames)
+  {
+    if (type == WAV)
+      return int(drwav_read_pcm_frames_f32(&wav, frames, dst));
+    if (type == MP3)
+      return int(drmp3_read_pcm_frames_f32(&mp3, frames, dst));
+    if (type == FLAC)
+      return int(drflac_read_pcm_frames_f32(flac, frames, dst));
+    return 0;
+  }
+
+  bool seek(int64_t frame)
+  {
+    if (type == WAV)
+      return !!drwav_seek_to_pcm_frame(&wav, drwav_uint64(frame));
+    if (type == MP3)
+      return !!drmp3_seek_to_pcm_frame(&mp3, drmp3_uint64(frame));
+    if (type == FLAC)
+      return !!drflac_seek_to_pcm_frame(flac, drflac_uint64(frame));
+    return false;
+  }
+};
+
+
+static mutex streams_cs;
+static condition_variable streams_cv;
+static thread stream_thread;
+static atomic<bool> stream_thread_running(false);
+
+struct FileStreamSource;
+static vector<FileStreamSource *> active_streams;
+
+// Decodes a file ahead of the mixer into a bounded ring.
+// Seeks are served by the decoder thread: the consumer drops everything it had
+// and continues from the ring position published together with the seek serial.
+struct FileStreamSource : SoundSource
+{
+  StreamDecoder decoder;
+  SampleRing ring;
+  bool loop = false;
+  int64_t decodePos = 0;       // decoder thread
+  int handledSeekSerial = 0;   // decoder thread
+  atomic<bool> eof;            // decoder reached the end of a non-looped stream
+  atomic<int64_t> seekTarget;
+  atomic<int> seekSerial;
+  atomic<int> segmentSerial;
+  atomic<uint64_t> segmentStart; // ring position where the data of segmentSerial begins
+  atomic<int64_t> segmentFrame;  // file frame at segmentStart
+  int consumedSerial = 0;      // audio thread
+  int64_t readFrame = 0;       // audio thread, file frame of the next frame returned by read()
+  float chunk[STREAM_CHUNK_FRAMES * 2];
+
+  FileStreamSource() : eof(false), seekTarget(0), seekSerial(0), segmentSerial(0), segmentStart(0), segmentFrame(0) {}
+
+  ~FileStreamSource()
+  {
+    lock_guard<mutex> lock(streams_cs);
+    auto it = find(active_streams.begin(), active_streams.end(), this);
+    if (it != active_streams.end())
+      active_streams.erase(it);
+  }
+
+  bool open(const char * file_name, bool loop_)
+  {
+    if (!decoder.open(file_name))
+      return false;
+
+    if (decoder.channels != 1 && decoder.channels != 2)
+      return false;
+
+    frequency = decoder.sampleRate;
+    channels = decoder.channels;
+    loop = loop_;
+    ring.init(STREAM_RING_FRAMES, channels);
+    return true;
+  }
+
+  void decodeAhead() // decoder thread
+  {
+    int serial = seekSerial.load(memory_order_acquire);
+    if (serial != handledSeekSerial)
+    {
+      int64_t target = seekTarget.load();
+      if (decoder.seek(target))
+      {
+        decodePos = target;
+        eof = false;
+      }
+      else
+      {
+        // the segment is still published below, so the voice stops waiting and ends instead of reading stale data
+        LOG(LogLevel::error) << "Cannot seek sound stream to frame " << target;
+        eof.store(true, memory_order_release);
+      }
+      segmentStart.store(ring.writePos.load(memory_order_relaxed));
+      segmentFrame.store(target);
+      segmentSerial.store(serial, memory_order_release);
+      handledSeekSerial = serial;
+    }
+
+    while (!eof && ring.space() >= STREAM_CHUNK_FRAMES)
+    {
+      int got = decoder.read(chunk, STREAM_CHUNK_FRAMES);
+      decodePos += got;
+      ring.write(chunk, uint32_t(got));
+      if (got < STREAM_CHUNK_FRAMES)
+      {
+        if (loop && decodePos > 0 && decoder.seek(0))
+          decodePos = 0;
+        else
+          eof.store(true, memory_order_release);
+      }
+    }
+  }
+
+  void requestSeek(int64_t frame)
+  {
+    seekTarget = clamp(frame, int64_t(0), max(decoder.totalFrames - 1, int64_t(0)));
+    seekSerial++;
+    streams_cv.notify_one();
+  }
+
+  virtual int read(float * dst, int frames) override
+  {
+    int serial = segmentSerial.load(memory_order_acquire);
+    if (serial != consumedSerial)
+    {
+      ring.readPos.store(segmentStart.load(), memory_order_release);
+      readFrame = segmentFrame.load();
+      consumedSerial = serial;
+    }
+
+    if (isSeeking())
+      return 0;
+
+    int got = int(ring.read(dst, uint32_t(frames)));
+    readFrame += got;
+    if (loop && decoder.totalFrames > 0)
+      readFrame %= decoder.totalFrames;
+    return got;
+  }
+
+  virtual bool isFinished() const override
+  {
+    return !isSeeking() && eof.load(memory_order_acquire) && ring.available() == 0;
+  }
+
+  virtual bool isSeeking() const override
+  {
+    return consumedSerial != seekSerial.load(memory_order_acquire);
+  }
+
+  virtual void seek(int64_t frame) override
+  {
+    requestSeek(frame);
+  }
+
+  virtual double tell(double frames_behind) const override
+  {
+    if (isSeeking())
+      return double(seekTarget.load());
+
+    double p = double(readFrame) - frames_behind;
+    if (p < 0.0)
+      p = (loop && decoder.totalFrames > 0) ? p + double(decoder.totalFrames) : 0.0;
+    return p;
+  }
+};
+
+
+static void stream_thread_proc()
+{
+  while (stream_thread_running)
+  {
+    collect_retired_sources(false);
+
+    unique_lock<mutex> lock(streams_cs);
+    for (auto && s : active_streams)
+      s->decodeAhead();
+    streams_cv.wait_for(lock, chrono::milliseconds(10));
+  }
+}
+
+static void start_stream_thread()
+{
+  if (stream_thread_running)
+    return;
+
+  stream_thread_running = true;
+  stream_thread = thread(stream_thread_proc);
+}
+
+static void stop_stream_thread()
+{
+  if (!stream_thread_running)
+    return;
+
+  {
+    lock_guard<mutex> lock(streams_cs);
+    stream_thread_running = false;
+  }
+  streams_cv.notify_one();
+  stream_thread.join();
+}
+
+
+#define PUSH_STREAM_MIN_FRAMES 1024
+#define PUSH_STREAM_MAX_FRAMES (1 << 20)
+
+#define DRIFT_AVERAGE_SECONDS 0.5     // fill level smoothing
+#define DRIFT_PROPORTIONAL_GAIN 0.005 // correction per relative fill error
+#define DRIFT_INTEGRAL_GAIN 0.002     // correction per relative fill error per second
+#define DRIFT_MAX_CORRECTION 0.005    // 0.5%, well below audible pitch change
+
+static mutex push_streams_cs;
+
+struct PushStreamSource;
+static vector<PushStreamSource *> push_streams;
+
+// Frames pushed by the script into a ring and pulled by the mixer, neither side locks the other.
+// Playback starts once a chunk is buffered so the first pushes do not count as underruns.
+// The producer side is looked up by voice handle under push_streams_cs, which the mixer never takes.
+//
+// With drift control (input streams) the producer runs on its own clock: playback starts at the target
+// fill level, the rate is nudged by a PI controller on the smoothed fill level to hold it there,
+// and an underrun rebuffers up to the target instead of clicking on every short gap.
+struct PushStreamSource : SoundSource
+{
+  SampleRing ring;
+  unsigned handle = 0;        // guarded by push_streams_cs
+  int64_t droppedFrames = 0;  // guarded by push_streams_cs
+  uint32_t startFrames = 0;
+  atomic<bool> closed;        // no more data, the voice ends when the ring is drained
+  bool started = false;       // audio thread
+  int64_t readFrame = 0;      // audio thread
+
+  // drift control, audio thread
+  bool driftControl = false;
+  double targetFrames = 0.0;
+  double fillFrames = 0.0;
+  double averageFill = 0.0;
+  double integral = 0.0;
+  double correction = 0.0;
+  double minCorrection = 0.0;
+  double maxCorrection = 0.0;
+
+  PushStreamSource() : closed(false) {}
+
+  ~PushStreamSource()
+  {
+    lock_guard<mutex> lock(push_streams_cs);
+    auto it = find(push_streams.begin(), push_streams.end(), this);
+    if (it != push_streams.end())
+      push_streams.erase(it);
+  }
+
+  void init(int frequency_, int channels_, float buffer_seconds)
+  {
+    frequency = frequency_;
+    channels = channels_;
+    uint32_t frames = PUSH_STREAM_MIN_FRAMES;
+    while (frames < PUSH_STREAM_MAX_FRAMES && frames < buffer_seconds * frequency)
+      frames *= 2;
+    ring.init(frames, channels);
+    startFrames = min(uint32_t(STREAM_CHUNK_FRAMES), frames / 2);
+  }
+
+  void initDriftControl(float target_latency)
+  {
+    driftControl = true;
+    targetFrames = max(double(target_latency) * frequency, 1.0);
+    averageFill = targetFrames;
+    startFrames = min(uint32_t(targetFrames), ring.capacity / 2);
+  }
+
+  virtual int read(float * dst, int frames) override
+  {
+    if (!started)
+    {
+      if (ring.available() < startFrames && !closed.load(memory_order_acquire))
+        return 0;
+      started = true;
+    }
+
+    int got = int(ring.read(dst, uint32_t(frames)));
+    readFrame += got;
+    if (driftControl && got < frames && !closed.load(memory_order_acquire))
+    {
+      started = false;
+      underruns++;
+    }
+    return got;
+  }
+
+  virtual double rateScale(double window_frames, double seconds) override
+  {
+    fillFrames = double(ring.available()) + window_frames;
+    if (!driftControl || !started)
+      return 1.0;
+
+    averageFill += (fillFrames - averageFill) * min(seconds / DRIFT_AVERAGE_SECONDS, 1.0);
+    double error = (averageFill - targetFrames) / targetFrames;
+    integral = clamp(integral + error * seconds * DRIFT_INTEGRAL_GAIN, -DRIFT_MAX_CORRECTION, DRIFT_MAX_CORRECTION);
+    correction = clamp(error * DRIFT_PROPORTIONAL_GAIN + integral, -DRIFT_MAX_CORRECTION, DRIFT_MAX_CORRECTION);
+    minCorrection = min(minCorrection, correction);
+    maxCorrection = max(maxCorrection, correction);
+    return 1.0 + correction;
+  }
+
+  virtual bool isFinished() const override
+  {
+    return closed.load(memory_order_acquire) && ring.available() == 0;
+  }
+
+  virtual bool isSeeking() const override
+  {
+    return !started; // still prebuffering
+  }
+
+  virtual double tell(double frames_behind) const override
+  {
+    return max(double(readFrame) - frames_behind, 0.0);
+  }
+};
+
+static PushStreamSource * find_push_stream(PlayingSoundHandle handle) // push_streams_cs must be held
+{
+  if (!handle.handle)
+    return nullptr;
+  for (auto && s : push_streams)
+    if (s->handle == handle.handle)
+      return s;
+  return nullptr;
+}
+
+
+#define OPL3_NATIVE_RATE 49716
+#define OPL3_RSM_FRAC 10 // RSM_FRAC of opl3.c, chip->rateratio is (output rate << OPL3_RSM_FRAC) / OPL3_NATIVE_RATE
+#define OPL3_WRITE_QUEUE_SIZE 4096 // power of 2
+
+#define OPL3_WRITE_MIDI 0x8000 // Opl3Write carrying a MIDI message: status in the low byte of reg, data in value and data2
+
+struct Opl3Write
+{
+  int64_t frame;  // voice frame the write takes effect at, < 0 - as soon as possible
+  uint16_t reg;
+  uint8_t value;
+  uint8_t data2;
+};
+
+// same as OPL3_WriteRegBuffered, but at an explicit chip sample instead of the previous write + OPL_WRITEBUF_DELAY
+static void opl3_write_reg_at(opl3_chip * chip, uint64_t time, uint16_t reg, uint8_t v)
+{
+  opl3_writebuf * writebuf = &chip->writebuf[chip->writebuf_last];
+  if (writebuf->reg & 0x200) // ring is full, apply the oldest write now
+  {
+    OPL3_WriteReg(chip, writebuf->reg & 0x1ff, writebuf->data);
+    chip->writebuf_cur = (chip->writebuf_last + 1) % OPL_WRITEBUF_SIZE;
+    chip->writebuf_samplecnt = writebuf->time;
+  }
+
+  time = max(time, max(chip->writebuf_samplecnt, chip->writebuf_lasttime)); // writebuf must stay sorted
+  writebuf->reg = reg | 0x200;
+  writebuf->data = v;
+  writebuf->time = time;
+  chip->writebuf_lasttime = time;
+  chip->writebuf_last = (chip->writebuf_last + 1) % OPL_WRITEBUF_SIZE;
+}
+
+#define OPL3_CHUNK_FRAMES 256
+
+// Band-limited resampling of the native chip output: a block of native frames (all 4 channels) is generated first,
+// then every output frame is a 32-tap Kaiser windowed sinc, its coefficients interpolated between 256 phases.
+// The last OPL_RSM_TAPS native frames stay in the chip (rsm_hist), so snapshots keep them. Output frame j is
+// centered on native sample j * OPL3_NATIVE_RATE / rate, the chip runs OPL3_RESAMPLE_AHEAD native samples ahead.
+
+#define OPL3_RESAMPLE_PHASES 256
+#define OPL3_RESAMPLE_CENTER (OPL_RSM_TAPS / 2 - 1) // tap on the output position at phase 0
+#define OPL3_RESAMPLE_AHEAD (OPL_RSM_TAPS - OPL3_RESAMPLE_CENTER)
+#define OPL3_RESAMPLE_NATIVE_FRAMES 1024            // per block
+#define OPL3_RESAMPLE_MAX_RATES 16
+
+// one output frame must not need more native frames than a block holds
+static_assert(uint64_t(OPL3_RESAMPLE_NATIVE_FRAMES - 1) * OPL_RSM_MIN_RATE >= OPL3_NATIVE_RATE, "OPL3 resample block is too short");
+
+struct Opl3ResampleFilter
+{
+  uint32_t rate = 0;
+  uint64_t step = 0; // native samples per output frame, 32.32 fixed point
+  alignas(16) float coef[OPL3_RESAMPLE_PHASES][OPL_RSM_TAPS];
+  alignas(16) float delta[OPL3_RESAMPLE_PHASES][OPL_RSM_TAPS]; // to the next phase
+};
+
+static mutex opl3_resample_filters_cs;
+static atomic<Opl3ResampleFilter *> opl3_resample_filters[OPL3_RESAMPLE_MAX_RATES]; // one per output rate, never freed
+
+static double bessel_i0(double x)
+{
+  double sum = 1.0, term = 1.0;
+  for (int k = 1; k < 64 && term > sum * 1e-12; k++)
+  {
+    double h = x / (2.0 * k);
+    term *= h * h;
+    sum += term;
+  }
+  return sum;
+}
+
+static Opl3ResampleFilter * build_opl3_resample_filter(uint32_t rate)
+{
+  const double pi = 3.14159265358979323846;
+  const double beta = 8.0; // about 80 dB of stopband
+  // -6 dB point a little below the lower of the two Nyquist frequencies, in cycles per native sample
+  double cutoff = 0.46 * min(double(rate) / OPL3_NATIVE_RATE, 1.0);
+
+  vector<double> rows((OPL3_RESAMPLE_PHASES + 1) * OPL_RSM_TAPS);
+  for (int p = 0; p <= OPL3_RESAMPLE_PHASES; p++)
+  {
+    double * row = &rows[p * OPL_RSM_TAPS];
+    double sum = 0.0;
+    for (int k = 0; k < OPL_RSM_TAPS; k++)
+    {
+      double x = k - OPL3_RESAMPLE_CENTER - double(p) / OPL3_RESAMPLE_PHASES;
+      double w = x / (OPL_RSM_TAPS / 2);
+      double window = fabs(w) < 1.0 ? bessel_i0(beta * sqrt(1.0 - w * w)) / bessel_i0(beta) : 0.0;
+      double arg = pi * 2.0 * cutoff * x;
+      row[k] = (fabs(arg) < 1e-9 ? 1.0 : sin(arg) / arg) * window;
+      sum += row[k];
+    }
+    for (int k = 0; k < OPL_RSM_TAPS; k++)
+      row[k] /= sum; // unity gain at DC for every phase
+  }
+
+  Opl3ResampleFilter * f = new Opl3ResampleFilter();
+  f->rate = rate;
+  f->step = (uint64_t(OPL3_NATIVE_RATE) << 32) / rate;
+  for (int p = 0; p < OPL3_RESAMPLE_PHASES; p++)
+    for (int k = 0; k < OPL_RSM_TAPS; k++)
+    {
+      f->coef[p][k] = float(rows[p * OPL_RSM_TAPS + k]);
+      f->delta[p][k] = float(rows[(p + 1) * OPL_RSM_TAPS + k] - rows[p * OPL_RSM_TAPS + k]);
+    }
+  return f;
+}
+
+// lookup only, safe on the audio thread; nullptr until prepare_opl3_resample_filter built the filter for the rate
+static const Opl3ResampleFilter * find_opl3_resample_filter(uint32_t rate)
+{
+  for (auto && slot : opl3_resample_filters)
+  {
+    const Opl3ResampleFilter * f = slot.load(memory_order_acquire);
+    if (!f)
+      break;
+    if (f->rate == rate)
+      return f;
+  }
+  return nullptr;
+}
+
+// builds the filter of an output rate, called when OPL3 voices are created and by the script side generators,
+// so the mixer never builds one; nullptr below OPL_RSM_MIN_RATE or when there are more output rates than OPL3_RESAMPLE_MAX_RATES
+static const Opl3ResampleFilter * prepare_opl3_resample_filter(uint32_t rate)
+{
+  if (rate < OPL_RSM_MIN_RATE)
+    return nullptr;
+  if (const Opl3ResampleFilter * found = find_opl3_resample_filter(rate))
+    return found;
+
+  lock_guard<mutex> lock(opl3_resample_filters_cs);
+  for (auto && slot : opl3_resample_filters)
+  {
+    Opl3ResampleFilter * f = slot.load(memory_order_relaxed);
+    if (f && f->rate == rate)
+      return f;
+    if (!f)
+    {
+      f = build_opl3_resample_filter(rate);
+      slot.store(f, memory_order_release);
+      return f;
+    }
+  }
+  return nullptr;
+}
+
+// output frames that have to be queued ahead of the rendered ones for timed writes to land on their frame
+static int opl3_resample_lookahead(int frequency)
+{
+  return int(int64_t(OPL3_RESAMPLE_AHEAD) * frequency / OPL3_NATIVE_RATE) + 2;
+}
+
+// writebuf time (native samples) of the output frame frames_ahead after the next one to be rendered
+static uint64_t opl3_output_native_time(const opl3_chip * chip, int64_t frames_ahead)
+{
+  uint64_t step = (uint64_t(OPL3_NATIVE_RATE) << 32) / max(chip->samplerate, 1u);
+  uint64_t pos = (uint64_t(chip->rsm_frac) + uint64_t(max(frames_ahead, int64_t(0))) * step + 0x80000000u) >> 32;
+  return chip->rsm_ready ? chip->writebuf_samplecnt - OPL3_RESAMPLE_AHEAD + pos : pos;
+}
+
+// applies the pending buffered writes right away, in order
+static void opl3_flush_writebuf(opl3_chip * chip)
+{
+  for (;;)
+  {
+    opl3_writebuf * writebuf = &chip->writebuf[chip->writebuf_cur];
+    if (!(writebuf->reg & 0x200))
+      break;
+    writebuf->reg &= 0x1ff;
+    OPL3_WriteReg(chip, writebuf->reg, writebuf->data);
+    chip->writebuf_cur = (chip->writebuf_cur + 1) % OPL_WRITEBUF_SIZE;
+  }
+  chip->writebuf_lasttime = chip->writebuf_samplecnt;
+}
+
+// interleaved, 2 (left, right) or 4 channels at the rate the chip was reset to, linear without a prepared filter,
+// silence below OPL_RSM_MIN_RATE where the chip has no resampling ratio
+static void opl3_resample(opl3_chip * chip, float * dst, int frames, int channels)
+{
+  if (chip->samplerate < OPL_RSM_MIN_RATE)
+  {
+    memset(dst, 0, sizeof(float) * frames * channels);
+    return;
+  }
+  const Opl3ResampleFilter * f = find_opl3_resample_filter(chip->samplerate);
+  if (!f)
+  {
+    int16_t s[4];
+    for (int i = 0; i < frames; i++)
+    {
+      OPL3_Generate4ChResampled(chip, s);
+      for (int c = 0; c < channels; c++)
+        dst[i * channels + c] = sample_to_float(s[c]);
+    }
+    return;
+  }
+
+  if (!chip->rsm_ready) // silence before the first native sample, which is centered on output frame 0
+  {
+    memset(chip->rsm_hist, 0, sizeof(chip->rsm_hist));
+    for (int i = OPL3_RESAMPLE_CENTER; i < OPL_RSM_TAPS; i++)
+      OPL3_Generate4Ch(chip, chip->rsm_hist[i]);
+    chip->rsm_frac = 0;
+    chip->rsm_ready = 1;
+  }
+
+  int16_t raw[(OPL_RSM_TAPS + OPL3_RESAMPLE_NATIVE_FRAMES) * 4];
+  alignas(16) float native[(OPL_RSM_TAPS + OPL3_RESAMPLE_NATIVE_FRAMES) * 4];
+  int block = int((uint64_t(OPL3_RESAMPLE_NATIVE_FRAMES - 1) << 32) / f->step); // >= 1 from OPL_RSM_MIN_RATE up
+  while (frames > 0)
+  {
+    int n = min(frames, block);
+    int advance = int((uint64_t(chip->rsm_frac) + uint64_t(n) * f->step) >> 32);
+    memcpy(raw, chip->rsm_hist, sizeof(chip->rsm_hist));
+    for (int i = 0; i < advance; i++)
+      OPL3_Generate4Ch(chip, raw + (OPL_RSM_TAPS + i) * 4);
+    convert_s16_to_float(raw, native, (OPL_RSM_TAPS + advance) * 4);
+
+    uint64_t pos = chip->rsm_frac;
+    for (int i = 0; i < n; i++, pos += f->step)
+    {
+      const float * x = native + size_t(pos >> 32) * 4;
+      uint32_t phase = uint32_t(pos) >> 24;
+      float t = float(uint32_t(pos) & 0xFFFFFF) * (1.0f / 16777216.0f);
+      const float * coef = f->coef[phase];
+      const float * delta = f->delta[phase];
+#if SOUND_SSE2
+      __m128 acc = _mm_setzero_ps();
+      __m128 tv = _mm_set1_ps(t);
+      for (int k = 0; k < OPL_RSM_TAPS; k += 4)
+      {
+        __m128 c = _mm_add_ps(_mm_load_ps(coef + k), _mm_mul_ps(tv, _mm_load_ps(delta + k)));
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_shuffle_ps(c, c, _MM_SHUFFLE(0, 0, 0, 0)), _mm_load_ps(x + k * 4)));
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_shuffle_ps(c, c, _MM_SHUFFLE(1, 1, 1, 1)), _mm_load_ps(x + k * 4 + 4)));
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_shuffle_ps(c, c, _MM_SHUFFLE(2, 2, 2, 2)), _mm_load_ps(x + k * 4 + 8)));
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 3, 3, 3)), _mm_load_ps(x + k * 4 + 12)));
+      }
+      if (channels == 4)
+        _mm_storeu_ps(dst + i * 4, acc);
+      else
+        _mm_storel_pi((__m64 *)(dst + i * 2), acc);
+#else
+      float acc[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+      for (int k = 0; k < OPL_RSM_TAPS; k++)
+      {
+        float c = coef[k] + t * delta[k];
+        for (int ch = 0; ch < 4; ch++)
+          acc[ch] += c * x[k * 4 + ch];
+      }
+      for (int ch = 0; ch < channels; ch++)
+        dst[i * channels + ch] = acc[ch];
+#endif
+    }
+
+    memcpy(chip->rsm_hist, raw + advance * 4, sizeof(chip->rsm_hist));
+    chip->rsm_frac = uint32_t(pos);
+    dst += n * channels;
+    frames -= n;
+  }
+}
+
+// interleaved stereo at the rate the chip was reset to
+static void opl3_generate_float(opl3_chip * chip, float * dst, int frames)
+{
+  opl3_resample(chip, dst, frames, 2);
+}
+
+
+#define OPL3_GROUP_BLOCK_FRAMES 1024
+
+// Chip group rendering: every chip of a block is rendered into its own float scratch
+// by whichever thread takes it, then the calling thread mixes the scratch buffers in chip order,
+// so the output does not depend on the number of threads.
+struct Opl3GroupJob
+{
+  opl3_chip * const * chips = nullptr;
+  float * scratch = nullptr;
+  int count = 0;
+  int frames = 0;
+  atomic<int> next;
+  int remaining = 0; // chips not rendered yet, opl3_pool_cs
+  int users = 0;     // pool threads inside the job, opl3_pool_cs
+
+  Opl3GroupJob() : next(0) {}
+};
+
+static mutex opl3_group_cs; // one group render at a time
+static mutex opl3_pool_cs;
+static condition_variable opl3_pool_cv;      // new job or shutdown
+static condition_variable opl3_pool_done_cv; // job finished
+static vector<thread> opl3_pool_threads;
+static Opl3GroupJob * opl3_pool_job = nullptr;
+static uint32_t opl3_pool_generation = 0;
+static bool opl3_pool_running = false;
+static int opl3_render_threads = 0; // including the calling thread, 0 - one per core
+
+static int run_opl3_group_job(Opl3GroupJob * job)
+{
+  int done = 0;
+  for (;;)
+  {
+    int i = job->next.fetch_add(1);
+    if (i >= job->count)
+      break;
+    if (job->chips[i])
+      opl3_generate_float(job->chips[i], job->scratch + size_t(i) * job->frames * 2, job->frames);
+    done++;
+  }
+  return done;
+}
+
+static void opl3_pool_thread_proc()
+{
+  uint32_t generation = 0;
+  unique_lock<mutex> lock(opl3_pool_cs);
+  for (;;)
+  {
+    opl3_pool_cv.wait(lock, [&] { return !opl3_pool_running || opl3_pool_generation != generation; });
+    if (!opl3_pool_running)
+      return;
+    generation = opl3_pool_generation;
+    Opl3GroupJob * job = opl3_pool_job;
+    if (!job)
+      continue;
+
+    job->users++;
+    lock.unlock();
+    int done = run_opl3_group_job(job);
+    lock.lock();
+    job->users--;
+    job->remaining -= done;
+    if (job->remaining == 0 && job->users == 0)
+      opl3_pool_done_cv.notify_all();
+  }
+}
+
+static void start_opl3_pool() // opl3_pool_cs must be held
+{
+  if (opl3_pool_running)
+    return;
+
+  int count = opl3_render_threads > 0 ? opl3_render_threads - 1 : int(thread::hardware_concurrency()) - 1;
+  if (count <= 0)
+    return;
+  opl3_pool_running = true;
+  for (int i = 0; i < count; i++)
+    opl3_pool_threads.push_back(thread(opl3_pool_thread_proc));
+}
+
+static void stop_opl3_pool()
+{
+  {
+    lock_guard<mutex> lock(opl3_pool_cs);
+    if (!opl3_pool_running)
+      return;
+    opl3_pool_running = false;
+  }
+  opl3_pool_cv.notify_all();
+
+  for (auto && t : opl3_pool_threads)
+    t.join();
+  opl3_pool_threads.clear();
+}
+
+static void render_opl3_group_block(Opl3GroupJob & job) // opl3_group_cs must be held
+{
+  job.next = 0;
+  job.remaining = job.count;
+  job.users = 0;
+
+  unique_lock<mutex> lock(opl3_pool_cs);
+  if (job.count > 1)
+    start_opl3_pool();
+  if (!opl3_pool_running || job.count <= 1)
+  {
+    lock.unlock();
+    run_opl3_group_job(&job);
+    return;
+  }
+
+  opl3_pool_job = &job;
+  opl3_pool_generation++;
+  lock.unlock();
+  opl3_pool_cv.notify_all();
+
+  int done = run_opl3_group_job(&job);
+
+  lock.lock();
+  job.remaining -= done;
+  opl3_pool_done_cv.wait(lock, [&] { return job.remaining == 0 && job.users == 0; });
+  opl3_pool_job = nullptr;
+}
+
+// interleaved stereo, sum of the chips scaled by gains (nullptr - 1.0)
+static void opl3_generate_group_float(opl3_chip * const * chips, const float * gains, int count, float * dst, int frames)
+{
+  lock_guard<mutex> lock(opl3_group_cs);
+  vector<float> scratch(size_t(count) * min(frames, OPL3_GROUP_BLOCK_FRAMES) * 2);
+
+  while (frames > 0)
+  {
+    Opl3GroupJob job;
+    job.chips = chips;
+    job.scratch = scratch.data();
+    job.count = count;
+    job.frames = min(frames, OPL3_GROUP_BLOCK_FRAMES);
+    render_opl3_group_block(job);
+
+    int samples = job.frames * 2;
+    memset(dst, 0, sizeof(float) * samples);
+    for (int i = 0; i < count; i++)
+    {
+      if (!chips[i])
+        continue;
+      const float * src = job.scratch + size_t(i) * samples;
+      float gain = gains ? gains[i] : 1.0f;
+      for (int k = 0; k < samples; k++)
+        dst[k] += src[k] * gain;
+    }
+    dst += samples;
+    frames -= job.frames;
+  }
+}
+
+// General MIDI on an OPL3: 18 two-operator channels, instruments from an OP2 (DMX GENMIDI), IBK or SBI bank.
+// Double voice instruments of OP2 banks take two channels, the second one detuned.
+
+#define OPL_MIDI_VOICES 18
+#define OPL_MIDI_PERCUSSION_CHANNEL 9
+
+struct OplOperator
+{
+  uint8_t reg20 = 0; // tremolo, vibrato, sustain, ksr, multiplier
+  uint8_t reg40 = 0; // key scale level, total level
+  uint8_t reg60 = 0; // attack, decay
+  uint8_t reg80 = 0; // sustain level, release
+  uint8_t regE0 = 0; // waveform
+};
+
+struct OplInstrumentVoice
+{
+  OplOperator mod;
+  OplOperator car;
+  uint8_t regC0 = 0;       // feedback, connection
+  int16_t noteOffset = 0;
+};
+
+struct OplInstrument
+{
+  OplInstrumentVoice voice[2];
+  bool valid = false;
+  bool doubleVoice = false;
+  bool fixedNote = false;
+  uint8_t note = 0;      // played instead of the MIDI note when fixedNote
+  float detune = 0.0f;   // semitones, second voice
+};
+
+// programs 0..127 are melodic, 128 + note is the percussion instrument of the note
+struct OplMidiBank
+{
+  OplInstrument instruments[256];
+};
+
+static mutex opl_midi_bank_cs;
+static OplMidiBank * opl_midi_bank = nullptr; // guarded by opl_midi_bank_cs, created with the default instruments
+
+static void set_default_opl_midi_bank(OplMidiBank & bank)
+{
+  OplInstrument melodic;
+  melodic.valid = true;
+  melodic.voice[0].mod = { 0x01, 0x10, 0xF2, 0x54, 0x00 };
+  melodic.voice[0].car = { 0x01, 0x00, 0xF2, 0x56, 0x00 };
+  melodic.voice[0].regC0 = 0x06;
+
+  OplInstrument percussion;
+  percussion.valid = true;
+  percussion.voice[0].mod = { 0x00, 0x00, 0xF8, 0xF8, 0x00 };
+  percussion.voice[0].car = { 0x00, 0x00, 0xF7, 0xF8, 0x00 };
+  percussion.voice[0].regC0 = 0x0E;
+
+  for (int i = 0; i < 256; i++)
+    bank.instruments[i] = i < 128 ? melodic : percussion;
+}
+
+static void get_opl_midi_bank(OplMidiBank & bank)
+{
+  lock_guard<mutex> lock(opl_midi_bank_cs);
+  if (opl_midi_bank)
+    bank = *opl_midi_bank;
+  else
+    set_default_opl_midi_bank(bank);
+}
+
+// block << 10 | f-number of a (fractional) MIDI note
+static uint16_t opl_note_frequency(double note)
+{
+  double hz = 440.0 * pow(2.0, (note - 69.0) / 12.0);
+  for (int block = 0; block < 8; block++)
+  {
+    double fnum = hz * double(1 << (20 - block)) / 49716.0;
+    if (fnum < 1023.5)
+      return uint16_t((block << 10) | int(fnum + 0.5));
+  }
+  return uint16_t((7 << 10) | 1023);
+}
+
+struct OplMidiChannel
+{
+  uint8_t program = 0;
+  uint8_t volume = 100;
+  uint8_t expression = 127;
+  uint8_t pan = 64;
+  bool sustain = false;
+  int bend = 0;              // -8192..8191
+  float bendRange = 2.0f;    // semitones, RPN 0
+  uint8_t rpnMsb = 127;
+  uint8_t rpnLsb = 127;
+};
+
+struct OplMidiVoice
+{
+  int channel = -1;
+  uint8_t note = 0;
+  uint8_t velocity = 0;
+  const OplInstrument * instrument = nullptr;
+  int layer = 0;
+  bool keyOn = false;
+  bool held = false;         // released while the sustain pedal is down
+  uint32_t serial = 0;       // last note on or release, the smallest is reused first
+  uint16_t frequency = 0;
+};
+
+struct OplMidiSynth
+{
+  OplMidiBank bank;
+  OplMidiChannel channels[16];
+  OplMidiVoice voices[OPL_MIDI_VOICES];
+  uint32_t serial = 0;
+  opl3_chip * chip = nullptr;
+  bool started = false;
+  bool timed = false; // writes go through the chip writebuf at time (chip samples) instead of right away
+  uint64_t time = 0;
+
+  void init(opl3_chip * chip_, bool timed_) // takes the current bank
+  {
+    get_opl_midi_bank(bank);
+    chip = chip_;
+    timed = timed_;
+  }
+
+  void write(uint16_t reg, uint8_t v)
+  {
+    if (timed)
+      opl3_write_reg_at(chip, time, reg, v);
+    else
+      OPL3_WriteReg(chip, reg, v);
+  }
+
+  void start()
+  {
+    started = true;
+    write(0x105, 0x01); // OPL3 mode, 18 channels
+    write(0x104, 0x00); // no 4-op pairs
+    write(0x0BD, 0x00); // no rhythm mode
+    reset();
+  }
+
+  void reset()
+  {
+    for (int v = 0; v < OPL_MIDI_VOICES; v++)
+      if (voices[v].keyOn)
+        release(v);
+    for (auto && ch : channels)
+      ch = OplMidiChannel();
+  }
+
+  static uint16_t slotOffset(int v)
+  {
+    int ch = v % 9;
+    return uint16_t((v >= 9 ? 0x100 : 0) | (ch % 3 + ch / 3 * 8));
+  }
+
+  static uint16_t channelOffset(int v)
+  {
+    return uint16_t((v >= 9 ? 0x100 : 0) | (v % 9));
+  }
+
+  const OplInstrumentVoice & instrumentVoice(int v) const
+  {
+    return voices[v].instrument->voice[voices[v].layer];
+  }
+
+  void writePitch(int v)
+  {
+    OplMidiVoice & voice = voices[v];
+    const OplMidiChannel & ch = channels[voice.channel];
+    double note = double(voice.instrument->fixedNote ? voice.instrument->note : voice.note);
+    note += instrumentVoice(v).noteOffset + double(ch.bend) / 8192.0 * ch.bendRange;
+    if (voice.layer)
+      note += voice.instrument->detune;
+    voice.frequency = opl_note_frequency(note);
+    write(0xA0 + channelOffset(v), uint8_t(voice.frequency & 0xFF));
+    write(0xB0 + channelOffset(v), uint8_t((voice.keyOn ? 0x20 : 0) | (voice.frequency >> 8)));
+  }
+
+  void writeLevel(int v)
+  {
+    const OplMidiVoice & voice = voices[v];
+    const OplMidiChannel & ch = channels[voice.channel];
+    const OplInstrumentVoice & iv = instrumentVoice(v);
+    // General MIDI curve: 40 log10 of each factor, in the 0.75 dB steps of the total level
+    double gain = double(voice.velocity) * ch.volume * ch.expression / (127.0 * 127.0 * 127.0);
+    int atten = gain > 0.0 ? int(min(-40.0 * log10(gain) / 0.75 + 0.5, 63.0)) : 63;
+    auto scaled = [atten](uint8_t reg40) { return uint8_t((reg40 & 0xC0) | min((reg40 & 0x3F) + atten, 0x3F)); };
+    uint16_t op = slotOffset(v);
+    write(0x40 + op, (iv.regC0 & 0x01) ? scaled(iv.mod.reg40) : iv.mod.reg40); // additive: both operators are heard
+    write(0x43 + op, scaled(iv.car.reg40));
+  }
+
+  void writePan(int v)
+  {
+    uint8_t pan = channels[voices[v].channel].pan;
+    uint8_t bits = pan < 32 ? 0x10 : (pan > 96 ? 0x20 : 0x30);
+    write(0xC0 + channelOffset(v), uint8_t((instrumentVoice(v).regC0 & 0x0F) | bits));
+  }
+
+  void writeInstrument(int v)
+  {
+    const OplInstrumentVoice & iv = instrumentVoice(v);
+    uint16_t op = slotOffset(v);
+    write(0x20 + op, iv.mod.reg20);
+    write(0x60 + op, iv.mod.reg60);
+    write(0x80 + op, iv.mod.reg80);
+    write(0xE0 + op, iv.mod.regE0);
+    write(0x23 + op, iv.car.reg20);
+    write(0x63 + op, iv.car.reg60);
+    write(0x83 + op, iv.car.reg80);
+    write(0xE3 + op, iv.car.regE0);
+  }
+
+  void release(int v)
+  {
+    OplMidiVoice & voice = voices[v];
+    voice.keyOn = false;
+    voice.held = false;
+    voice.serial = ++serial;
+    write(0xB0 + channelOffset(v), uint8_t(voice.frequency >> 8));
+  }
+
+  // a released voice first (released the longest ago), then one held by the pedal, then the oldest note
+  int allocate()
+  {
+    int best = -1;
+    for (int pass = 0; pass < 3 && best < 0; pass++)
+      for (int v = 0; v < OPL_MIDI_VOICES; v++)
+      {
+        const OplMidiVoice & voice = voices[v];
+        bool candidate = pass == 0 ? !voice.keyOn : (pass == 1 ? voice.held : true);
+        if (candidate && (best < 0 || voice.serial < voices[best].serial))
+          best = v;
+      }
+    if (voices[best].keyOn)
+      release(best);
+    return best;
+  }
+
+  void noteOff(int channel, uint8_t note)
+  {
+    for (int v = 0; v < OPL_MIDI_VOICES; v++)
+    {
+      OplMidiVoice & voice = voices[v];
+      if (voice.keyOn && !voice.held && voice.channel == channel && voice.note == note)
+      {
+        if (channels[channel].sustain)
+          voice.held = true;
+        else
+          release(v);
+      }
+    }
+  }
+
+  void noteOn(int channel, uint8_t note, uint8_t velocity)
+  {
+    const OplInstrument & instrument = channel == OPL_MIDI_PERCUSSION_CHANNEL ?
+      bank.instruments[128 + note] : bank.instruments[channels[channel].program];
+    if (!instrument.valid)
+      return;
+
+    for (int v = 0; v < OPL_MIDI_VOICES; v++) // retrigger
+      if (voices[v].keyOn && voices[v].channel == channel && voices[v].note == note)
+        release(v);
+
+    for (int layer = 0; layer < (instrument.doubleVoice ? 2 : 1); layer++)
+    {
+      int v = allocate();
+      OplMidiVoice & voice = voices[v];
+      voice.channel = channel;
+      voice.note = note;
+      voice.velocity = velocity;
+      voice.instrument = &instrument;
+      voice.layer = layer;
+      voice.keyOn = true;
+      voice.held = false;
+      voice.serial = ++serial;
+      writeInstrument(v);
+      writeLevel(v);
+      writePan(v);
+      writePitch(v);
+    }
+  }
+
+  void controlChange(int channel, uint8_t control, uint8_t value)
+  {
+    OplMidiChannel & ch = channels[channel];
+    switch (control)
+    {
+      case 0x06: // data entry
+        if (ch.rpnMsb == 0 && ch.rpnLsb == 0)
+          ch.bendRange = float(value);
+        return;
+      case 0x07:
+        ch.volume = value;
+        break;
+      case 0x0A:
+        ch.pan = value;
+        break;
+      case 0x0B:
+        ch.expression = value;
+        break;
+      case 0x40:
+        ch.sustain = value >= 64;
+        if (!ch.sustain)
+          for (int v = 0; v < OPL_MIDI_VOICES; v++)
+            if (voices[v].held && voices[v].channel == channel)
+              release(v);
+        return;
+      case 0x64:
+        ch.rpnLsb = value;
+        return;
+      case 0x65:
+        ch.rpnMsb = value;
+        return;
+      case 0x78: // all sound off
+      case 0x7B: // all notes off
+        for (int v = 0; v < OPL_MIDI_VOICES; v++)
+          if (voices[v].keyOn && voices[v].channel == channel)
+            release(v);
+        return;
+      case 0x79: // reset controllers
+        ch.volume = 100;
+        ch.expression = 127;
+        ch.bend = 0;
+        ch.sustain = false;
+        break;
+      default:
+        return;
+    }
+    for (int v = 0; v < OPL_MIDI_VOICES; v++)
+      if (voices[v].channel == channel && voices[v].instrument)
+      {
+        writeLevel(v);
+        writePan(v);
+        writePitch(v);
+      }
+  }
+
+  void message(uint8_t status, uint8_t data1, uint8_t data2)
+  {
+    if (!started)
+      start();
+    int channel = status & 0x0F;
+    data1 &= 0x7F;
+    data2 &= 0x7F;
+    switch (status & 0xF0)
+    {
+      case 0x80:
+        noteOff(channel, data1);
+        break;
+      case 0x90:
+        if (data2)
+          noteOn(channel, data1, data2);
+        else
+          noteOff(channel, data1);
+        break;
+      case 0xB0:
+        controlChange(channel, data1, data2);
+        break;
+      case 0xC0:
+        channels[channel].program = data1;
+        break;
+      case 0xE0:
+        channels[channel].bend = ((data2 << 7) | data1) - 8192;
+        for (int v = 0; v < OPL_MIDI_VOICES; v++)
+          if (voices[v].channel == channel && voices[v].instrument)
+            writePitch(v);
+        break;
+      default:
+        break;
+    }
+  }
+};
+
+static mutex opl3_voices_cs;
+
+struct Opl3Source;
+static vector<Opl3Source *> opl3_voices;
+
+// Voice with its own OPL3 chip rendered by the mixer at the voice frequency.
+// The script queues register writes stamped with voice frames (single producer / single consumer),
+// the audio thread moves the writes due in the block it renders into the chip writebuf
+// at the matching chip sample, so OPL3_Generate applies each of them exactly on time.
+struct Opl3Source : SoundSource
+{
+  opl3_chip chip;
+  Opl3Write queue[OPL3_WRITE_QUEUE_SIZE];
+  atomic<uint32_t> queueWrite;
+  atomic<uint32_t> queueRead;
+  atomic<int64_t> renderFrame;  // frames generated so far
+  atomic<bool> fastMode;        // OPL3_SetFastMode, applied by the audio thread
+  OplMidiSynth * synth = nullptr; // created by the first MIDI message, used by the audio thread
+  unsigned handle = 0;          // guarded by opl3_voices_cs
+
+  Opl3Source() : queueWrite(0), queueRead(0), renderFrame(0), fastMode(false) {}
+
+  ~Opl3Source()
+  {
+    {
+      lock_guard<mutex> lock(opl3_voices_cs);
+      auto it = find(opl3_voices.begin(), opl3_voices.end(), this);
+      if (it != opl3_voices.end())
+        opl3_voices.erase(it);
+    }
+    delete synth;
+  }
+
+  void init(int frequency_)
+  {
+    frequency = frequency_;
+    channels = 2;
+    OPL3_Reset(&chip, uint32_t(frequency));
+    prepare_opl3_resample_filter(uint32_t(frequency));
+  }
+
+  bool queueRegWrite(int64_t frame, uint16_t reg, uint8_t value, uint8_t data2 = 0) // producer
+  {
+    uint32_t w = queueWrite.load(memory_order_relaxed);
+    if (w - queueRead.load(memory_order_acquire) >= OPL3_WRITE_QUEUE_SIZE)
+      return false;
+    Opl3Write & q = queue[w & (OPL3_WRITE_QUEUE_SIZE - 1)];
+    q.frame = frame;
+    q.reg = reg;
+    q.value = value;
+    q.data2 = data2;
+    queueWrite.store(w + 1, memory_order_release);
+    return true;
+  }
+
+  bool queueMidi(int64_t frame, uint8_t status, uint8_t data1, uint8_t data2) // producer, opl3_voices_cs must be held
+  {
+    if (!synth)
+    {
+      synth = new OplMidiSynth();
+      synth->init(&chip, true);
+    }
+    return queueRegWrite(frame, uint16_t(OPL3_WRITE_MIDI | status), data1, data2);
+  }
+
+  void flushWrites(int64_t end_frame) // audio thread
+  {
+    uint32_t r = queueRead.load(memory_order_relaxed);
+    uint32_t w = queueWrite.load(memory_order_acquire);
+    for (; r != w; r++)
+    {
+      const Opl3Write & q = queue[r & (OPL3_WRITE_QUEUE_SIZE - 1)];
+      if (q.frame >= end_frame)
+        break;
+      uint64_t time = q.frame > 0 ? uint64_t(q.frame) * OPL3_NATIVE_RATE / uint64_t(frequency) : 0;
+      if (q.reg & OPL3_WRITE_MIDI)
+      {
+        synth->time = time;
+        synth->message(uint8_t(q.reg), q.value, q.data2);
+      }
+      else
+        opl3_write_reg_at(&chip, time, q.reg, q.value);
+    }
+    queueRead.store(r, memory_order_release);
+  }
+
+  virtual int read(float * dst, int frames) override
+  {
+    int64_t frame = renderFrame.load(memory_order_relaxed);
+    flushWrites(frame + frames + opl3_resample_lookahead(frequency)); // the resampler renders a bit ahead
+
+    uint8_t fast = fastMode.load(memory_order_relaxed) ? 1 : 0;
+    if (chip.fastmode != fast)
+      OPL3_SetFastMode(&chip, fast);
+
+    opl3_generate_float(&chip, dst, frames);
+
+    renderFrame.store(frame + frames, memory_order_release);
+    return frames;
+  }
+
+  virtual bool isFinished() const override
+  {
+    return false; // plays until stopped
+  }
+
+  virtual double tell(double frames_behind) const override
+  {
+    return max(double(renderFrame.load(memory_order_relaxed)) - frames_behind, 0.0);
+  }
+};
+
+static Opl3Source * find_opl3_voice(PlayingSoundHandle handle) // opl3_voices_cs must be held
+{
+  if (!handle.handle)
+    return nullptr;
+  for (auto && s : opl3_voices)
+    if (s->handle == handle.handle)
+      return s;
+  return nullptr;
+}
+
+
+// OPL register dump music: IMF (id Software), DRO v1 / v2 (DOSBox raw OPL) and VGM (YM3812 / YMF262 commands),
+// and standard MIDI files played by OplMidiSynth. The file stays mapped while it plays, events are decoded as the chip renders.
+
+#define OPL_MUSIC_IMF_RATE 560.0 // .wlf files (Wolfenstein 3D) use 700
+#define OPL_MUSIC_WLF_RATE 700.0
+#define OPL_MUSIC_DRO_RATE 1000.0
+#define OPL_MUSIC_VGM_RATE 44100.0
+#define OPL_MUSIC_MIDI_RATE 1000000.0 // MIDI delays are converted to microseconds with the tempo map
+#define OPL_MUSIC_MIDI_TEMPO 500000   // microseconds per quarter note until the first tempo event
+#define OPL_MUSIC_KEYFRAME_SECONDS 1.0 // seek_opl_music renders at most this much from a keyframe
+#define OPL_MUSIC_MAX_KEYFRAMES 3600
+#define OPL_MUSIC_SEEK_BUILD_SECONDS 10.0 // song a seek_opl_music call renders at most to take new keyframes
+#define OPL_MUSIC_SEEK_BLOCK_FRAMES 512
+
+enum class OplMusicFormat
+{
+  imf,
+  dro1,
+  dro2,
+  vgm,
+  midi
+};
+
+enum class OplMusicEvent
+{
+  write,
+  delay,
+  midi,
+  end
+};
+
+struct OplMusicMessage
+{
+  uint16_t reg = 0;    // write, bank in bit 8
+  uint8_t value = 0;
+  uint32_t delay = 0;  // ticks
+  uint8_t midi[3];     // status, data1, data2
+};
+
+struct OplMidiTrack
+{
+  size_t start = 0;
+  size_t end = 0;
+};
+
+struct OplMidiTrackCursor
+{
+  size_t pos = 0;
+  uint64_t tick = 0;   // of the next event
+  uint8_t status = 0;  // running status
+  bool done = false;
+};
+
+struct OplMusic
+{
+  SoundFileMapping * mapping = nullptr;
+  const uint8_t * file = nullptr;
+  size_t dataStart = 0;
+  size_t dataEnd = 0;
+  size_t loopStart = 0;
+  OplMusicFormat format = OplMusicFormat::imf;
+  double tickRate = 0.0; // delay units per second
+  uint8_t droShortDelay = 0;
+  uint8_t droLongDelay = 0;
+  int droCodemapSize = 0;
+  uint8_t droCodemap[128];
+  vector<OplMidiTrack> midiTracks;
+  uint32_t midiDivision = 0;   // ticks per quarter note, or per second for SMPTE timing
+  bool midiSmpte = false;
+
+  ~OplMusic()
+  {
+    unmap_sound_file(mapping);
+  }
+};
+
+struct OplMusicCursor
+{
+  size_t pos = 0;
+  uint16_t bank = 0;         // DRO v1 0x02 / 0x03 commands
+  uint32_t pendingDelay = 0; // IMF delay that follows the last write
+  vector<OplMidiTrackCursor> midiTracks;
+  uint64_t midiTick = 0;
+  uint64_t midiTime = 0;     // sum of ticks * tempo, microseconds * midiDivision
+  uint64_t midiUsec = 0;     // microseconds already returned as delays
+  uint32_t midiTempo = OPL_MUSIC_MIDI_TEMPO;
+};
+
+static uint32_t read_le(const uint8_t * p, int bytes)
+{
+  uint32_t v = 0;
+  for (int i = bytes - 1; i >= 0; i--)
+    v = (v << 8) | p[i];
+  return v;
+}
+
+static uint32_t read_be(const uint8_t * p, int bytes)
+{
+  uint32_t v = 0;
+  for (int i = 0; i < bytes; i++)
+    v = (v << 8) | p[i];
+  return v;
+}
+
+static bool read_midi_vlq(const uint8_t * file, size_t & pos, size_t end, uint32_t & value)
+{
+  value = 0;
+  for (int i = 0; i < 4 && pos < end; i++)
+  {
+    uint8_t b = file[pos++];
+    value = (value << 7) | (b & 0x7F);
+    if (!(b & 0x80))
+      return true;
+  }
+  return false;
+}
+
+static void start_opl_music_cursor(const OplMusic & music, OplMusicCursor & cursor, size_t pos)
+{
+  cursor = OplMusicCursor();
+  cursor.pos = pos;
+  for (auto && track : music.midiTracks)
+  {
+    OplMidiTrackCursor t;
+    t.pos = track.start;
+    uint32_t delta = 0;
+    t.done = !read_midi_vlq(music.file, t.pos, track.end, delta);
+    t.tick = delta;
+    cursor.midiTracks.push_back(t);
+  }
+}
+
+static bool open_opl_music(const char * file_name, OplMusic & music)
+{
+  music.mapping = map_sound_file(file_name);
+  if (!music.mapping)
+  {
+    LOG(LogLevel::error) << "Cannot open OPL music '" << file_name << "'";
+    return false;
+  }
+
+  const uint8_t * p = (const uint8_t *)music.mapping->base;
+  size_t size = music.mapping->size;
+  music.file = p;
+
+  if (size >= 14 && !memcmp(p, "MThd", 4))
+  {
+    uint32_t division = read_be(p + 12, 2);
+    music.format = OplMusicFormat::midi;
+    music.tickRate = OPL_MUSIC_MIDI_RATE;
+    music.midiSmpte = (division & 0x8000) != 0;
+    music.midiDivision = music.midiSmpte ? uint32_t(-int8_t(division >> 8)) * (division & 0xFF) : division;
+    for (size_t pos = 8 + size_t(read_be(p + 4, 4)); pos + 8 <= size; pos += 8 + size_t(read_be(p + pos + 4, 4)))
+      if (!memcmp(p + pos, "MTrk", 4))
+      {
+        OplMidiTrack track;
+        track.start = pos + 8;
+        track.end = min(track.start + size_t(read_be(p + pos + 4, 4)), size);
+        music.midiTracks.push_back(track);
+      }
+    if (music.midiTracks.empty() || !music.midiDivision)
+    {
+      LOG(LogLevel::error) << "Cannot open OPL music '" << file_name << "', MIDI file without tracks";
+      return false;
+    }
+    music.dataStart = music.midiTracks[0].start;
+    music.dataEnd = size;
+    music.loopStart = music.dataStart;
+  }
+  else if (size >= 0x40 && !memcmp(p, "Vgm ", 4))
+  {
+    uint32_t version = read_le(p + 0x08, 4);
+    uint32_t dataOffset = version >= 0x150 ? read_le(p + 0x34, 4) : 0;
+    uint32_t loopOffset = read_le(p + 0x1C, 4);
+    music.format = OplMusicFormat::vgm;
+    music.tickRate = OPL_MUSIC_VGM_RATE;
+    music.dataStart = dataOffset ? size_t(dataOffset) + 0x34 : 0x40;
+    music.dataEnd = min(size_t(read_le(p + 0x04, 4)) + 0x04, size);
+    music.loopStart = loopOffset ? size_t(loopOffset) + 0x1C : music.dataStart;
+  }
+  else if (size >= 24 && !memcmp(p, "DBRAWOPL", 8))
+  {
+    uint32_t major = read_le(p + 8, 2);
+    uint32_t minor = read_le(p + 10, 2);
+    music.tickRate = OPL_MUSIC_DRO_RATE;
+    if (major == 0 && minor == 1)
+    {
+      // the hardware type was one byte in early files and four bytes later
+      music.format = OplMusicFormat::dro1;
+      music.dataStart = (p[21] && p[22] && p[23]) ? 21 : 24;
+      music.dataEnd = min(music.dataStart + read_le(p + 16, 4), size);
+    }
+    else if (major == 2 && minor == 0 && size >= 26 && p[21] == 0 && p[22] == 0)
+    {
+      // interleaved and uncompressed is the only layout DOSBox writes
+      music.format = OplMusicFormat::dro2;
+      music.droShortDelay = p[23];
+      music.droLongDelay = p[24];
+      music.droCodemapSize = min(int(p[25]), 128);
+      music.dataStart = 26 + size_t(p[25]);
+      music.dataEnd = min(music.dataStart + size_t(read_le(p + 12, 4)) * 2, size);
+      if (music.dataStart <= size)
+        memcpy(music.droCodemap, p + 26, music.droCodemapSize);
+    }
+    else
+    {
+      LOG(LogLevel::error) << "Cannot open OPL music '" << file_name << "', unsupported DRO version " << major << "." << minor;
+      return false;
+    }
+    music.loopStart = music.dataStart;
+  }
+  else if (size >= 4)
+  {
+    // type 1 starts with the byte length of the data, type 0 is raw data (and starts with a zero write)
+    uint32_t length = read_le(p, 2);
+    music.format = OplMusicFormat::imf;
+    music.tickRate = has_extension(file_name, ".wlf") ? OPL_MUSIC_WLF_RATE : OPL_MUSIC_IMF_RATE;
+    music.dataStart = (length && length + 2 <= size) ? 2 : 0;
+    music.dataEnd = music.dataStart ? length + 2 : size;
+    music.loopStart = music.dataStart;
+  }
+
+  if (music.dataStart >= music.dataEnd)
+  {
+    LOG(LogLevel::error) << "Cannot open OPL music '" << file_name << "', expected IMF, DRO, VGM or MIDI data";
+    return false;
+  }
+  return true;
+}
+
+// merges the tracks in tick order, tempo events change the length of the following ticks
+static OplMusicEvent read_midi_event(const OplMusic & music, OplMusicCursor & cursor, OplMusicMessage & m)
+{
+  for (;;)
+  {
+    int next = -1;
+    for (int i = 0; i < int(cursor.midiTracks.size()); i++)
+      if (!cursor.midiTracks[i].done && (next < 0 || cursor.midiTracks[i].tick < cursor.midiTracks[next].tick))
+        next = i;
+    if (next < 0)
+      return OplMusicEvent::end;
+
+    OplMidiTrackCursor & t = cursor.midiTracks[next];
+    if (t.tick > cursor.midiTick)
+    {
+      cursor.midiTime += (t.tick - cursor.midiTick) * (music.midiSmpte ? uint64_t(1000000) : uint64_t(cursor.midiTempo));
+      cursor.midiTick = t.tick;
+      uint64_t usec = cursor.midiTime / music.midiDivision;
+      m.delay = uint32_t(usec - cursor.midiUsec);
+      cursor.midiUsec = usec;
+      if (m.delay)
+        return OplMusicEvent::delay;
+    }
+
+    const uint8_t * p = music.file;
+    size_t end = music.midiTracks[next].end;
+    bool channelMessage = false;
+    uint8_t status = t.pos < end ? p[t.pos] : 0;
+    if (status & 0x80)
+      t.pos++;
+    else
+      status = t.status;
+
+    if (status == 0xFF)
+    {
+      uint8_t type = t.pos < end ? p[t.pos++] : 0x2F;
+      uint32_t length = 0;
+      if (!read_midi_vlq(p, t.pos, end, length) || type == 0x2F)
+        t.done = true;
+      else if (type == 0x51 && length >= 3 && t.pos + 3 <= end)
+        cursor.midiTempo = max(read_be(p + t.pos, 3), 1u);
+      t.pos += length;
+    }
+    else if (status == 0xF0 || status == 0xF7)
+    {
+      uint32_t length = 0;
+      if (!read_midi_vlq(p, t.pos, end, length))
+        t.done = true;
+      t.pos += length;
+    }
+    else if (status >= 0x80)
+    {
+      int bytes = ((status & 0xF0) == 0xC0 || (status & 0xF0) == 0xD0) ? 1 : 2;
+      if (t.pos + bytes > end)
+        t.done = true;
+      else
+      {
+        t.status = status;
+        m.midi[0] = status;
+        m.midi[1] = p[t.pos];
+        m.midi[2] = bytes == 2 ? p[t.pos + 1] : 0;
+        t.pos += bytes;
+        channelMessage = true;
+      }
+    }
+    else
+      t.done = true; // data byte without running status
+
+    uint32_t delta = 0;
+    if (!t.done && (t.pos >= end || !read_midi_vlq(p, t.pos, end, delta)))
+      t.done = true;
+    t.tick += delta;
+
+    if (channelMessage)
+      return OplMusicEvent::midi;
+  }
+}
+
+// decodes the next event at the cursor
+static OplMusicEvent read_opl_music_event(const OplMusic & music, OplMusicCursor & cursor, OplMusicMessage & m)
+{
+  if (music.format == OplMusicFormat::midi)
+    return read_midi_event(music, cursor, m);
+
+  uint16_t & reg = m.reg;
+  uint8_t & value = m.value;
+  uint32_t & delay = m.delay;
+  const uint8_t * p = music.file + cursor.pos;
+  size_t left = cursor.pos < music.dataEnd ? music.dataEnd - cursor.pos : 0;
+
+  switch (music.format)
+  {
+    case OplMusicFormat::imf:
+      // reg, value, delay after the write; the delay is returned by the next call
+      if (cursor.pendingDelay)
+      {
+        delay = cursor.pendingDelay;
+        cursor.pendingDelay = 0;
+        return OplMusicEvent::delay;
+      }
+      if (left < 4)
+        return OplMusicEvent::end;
+      reg = p[0];
+      value = p[1];
+      cursor.pendingDelay = read_le(p + 2, 2);
+      cursor.pos += 4;
+      return OplMusicEvent::write;
+
+    case OplMusicFormat::dro1:
+      if (left < 2)
+        return OplMusicEvent::end;
+      switch (p[0])
+      {
+        case 0x00:
+          delay = uint32_t(p[1]) + 1;
+          cursor.pos += 2;
+          return OplMusicEvent::delay;
+        case 0x01:
+          if (left < 3)
+            return OplMusicEvent::end;
+          delay = read_le(p + 1, 2) + 1;
+          cursor.pos += 3;
+          return OplMusicEvent::delay;
+        case 0x02:
+        case 0x03:
+          cursor.bank = p[0] == 0x03 ? 0x100 : 0;
+          cursor.pos += 1;
+          delay = 0;
+          return OplMusicEvent::delay;
+        case 0x04:
+          if (left < 3)
+            return OplMusicEvent::end;
+          reg = uint16_t(cursor.bank | p[1]);
+          value = p[2];
+          cursor.pos += 3;
+          return OplMusicEvent::write;
+        default:
+          reg = uint16_t(cursor.bank | p[0]);
+          value = p[1];
+          cursor.pos += 2;
+          return OplMusicEvent::write;
+      }
+
+    case OplMusicFormat::dro2:
+      if (left < 2)
+        return OplMusicEvent::end;
+      cursor.pos += 2;
+      if (p[0] == music.droShortDelay)
+      {
+        delay = uint32_t(p[1]) + 1;
+        return OplMusicEvent::delay;
+      }
+      if (p[0] == music.droLongDelay)
+      {
+        delay = (uint32_t(p[1]) + 1) << 8;
+        return OplMusicEvent::delay;
+      }
+      if ((p[0] & 0x7f) >= music.droCodemapSize)
+      {
+        delay = 0;
+        return OplMusicEvent::delay;
+      }
+      reg = uint16_t(((p[0] & 0x80) << 1) | music.droCodemap[p[0] & 0x7f]);
+      value = p[1];
+      return OplMusicEvent::write;
+
+    case OplMusicFormat::vgm:
+    {
+      if (left < 1)
+        return OplMusicEvent::end;
+      uint8_t cmd = p[0];
+      size_t length = 1;
+      delay = 0;
+      if (cmd == 0x5A || cmd == 0x5B || cmd == 0x5C || cmd == 0x5E || cmd == 0x5F) // YM3812, YM3526, Y8950, YMF262 ports
+      {
+        if (left < 3)
+          return OplMusicEvent::end;
+        reg = uint16_t((cmd == 0x5F ? 0x100 : 0) | p[1]);
+        value = p[2];
+        cursor.pos += 3;
+        return OplMusicEvent::write;
+      }
+      else if (cmd == 0x61)
+      {
+        if (left < 3)
+          return OplMusicEvent::end;
+        delay = read_le(p + 1, 2);
+        length = 3;
+      }
+      else if (cmd == 0x62)
+        delay = 735;
+      else if (cmd == 0x63)
+        delay = 882;
+      else if (cmd == 0x66)
+        return OplMusicEvent::end;
+      else if (cmd == 0x67) // data block
+      {
+        if (left < 7)
+          return OplMusicEvent::end;
+        length = 7 + size_t(read_le(p + 3, 4));
+      }
+      else if (cmd >= 0x70 && cmd <= 0x7F)
+        delay = (cmd & 0x0F) + 1;
+      else if (cmd >= 0x80 && cmd <= 0x8F) // YM2612 DAC write and wait
+        delay = cmd & 0x0F;
+      else if (cmd >= 0x30 && cmd <= 0x3F)
+        length = 2;
+      else if (cmd >= 0x40 && cmd <= 0x4E)
+        length = 3;
+      else if (cmd == 0x4F || cmd == 0x50)
+        length = 2;
+      else if (cmd >= 0x51 && cmd <= 0x5F)
+        length = 3;
+      else if (cmd == 0x68)
+        length = 12;
+      else if (cmd >= 0x90 && cmd <= 0x95)
+      {
+        static const uint8_t streamLength[] = { 5, 5, 6, 11, 2, 5 };
+        length = streamLength[cmd - 0x90];
+      }
+      else if (cmd >= 0xA0 && cmd <= 0xBF) // includes 0xAA, the second YM3812 of dual chip files
+        length = 3;
+      else if (cmd >= 0xC0 && cmd <= 0xDF)
+        length = 4;
+      else if (cmd >= 0xE0)
+        length = 5;
+      if (length > left)
+        return OplMusicEvent::end;
+      cursor.pos += length;
+      return OplMusicEvent::delay;
+    }
+
+    case OplMusicFormat::midi:
+      break;
+  }
+  return OplMusicEvent::end;
+}
+
+// Plays the events into a chip at the output rate: the chip renders up to the frame of the next event,
+// the writes of that frame are applied and rendering continues, so every write lands on its exact frame.
+// player state at a song position, taken while rendering so that seeking back does not start from the beginning
+struct OplMusicKeyframe
+{
+  uint64_t ticks = 0; // no event at this position is applied yet
+  int64_t lead = 0;   // frames from the rendered position to the event position
+  uint64_t loopTicks = 0;
+  int loopsLeft = 0;
+  OplMusicCursor cursor;
+  vector<uint8_t> chip; // OPL3_SaveState
+  OplMidiChannel channels[16];
+  OplMidiVoice voices[OPL_MIDI_VOICES];
+  int16_t instruments[OPL_MIDI_VOICES]; // bank index of voices[].instrument, -1 - none, the pointers are rebased on restore
+  uint32_t serial = 0;
+};
+
+struct OplMusicPlayer
+{
+  const OplMusic * music = nullptr; // owned by the voice or the bake
+  OplMusicCursor cursor;
+  opl3_chip chip;
+  OplMidiSynth * synth = nullptr; // MIDI files
+  int frequency = 0;
+  int loopsLeft = 0;       // < 0 - forever
+  double tempo = 1.0;
+  uint64_t ticks = 0;      // ticks from the start to the next event
+  uint64_t loopTicks = 0;  // ticks at the last loop restart
+  double baseTicks = 0.0;  // tick position at baseFrame, moves when the tempo changes
+  int64_t baseFrame = 0;
+  int64_t frame = 0;       // frames rendered
+  int lookahead = 0;       // events are applied this many frames before they are rendered, as timed writes
+  bool immediate = false;  // fast-forward, writes are applied right away
+  bool ending = false;     // the end is applied, it is rendered up to endFrame
+  int64_t endFrame = 0;
+  bool finished = false;
+  vector<OplMusicKeyframe> keyframes;
+  bool keepKeyframes = false; // the keyframe builder of seek_opl_music, never the player the mixer renders
+  bool exact = true;       // false after a fast-forward until a keyframe is restored, no keyframes are taken
+  int loopsPlayed = 0;
+  uint64_t firstLoopTicks = 0;  // ticks where the first and the second loop repetition start
+  uint64_t secondLoopTicks = 0;
+  OplMusicPlayer * nextRetired = nullptr; // OplMusicSource::retired
+
+  // bank - instruments of MIDI files, nullptr - the current bank
+  void open(const OplMusic & music_, int frequency_, int loops, const OplMidiBank * bank)
+  {
+    music = &music_;
+    frequency = frequency_;
+    loopsLeft = loops;
+    lookahead = opl3_resample_lookahead(frequency);
+    start_opl_music_cursor(*music, cursor, music->dataStart);
+    OPL3_Reset(&chip, uint32_t(frequency));
+    if (music->format == OplMusicFormat::midi)
+    {
+      synth = new OplMidiSynth();
+      synth->init(&chip, true);
+      if (bank)
+        synth->bank = *bank;
+      synth->start();
+    }
+  }
+
+  ~OplMusicPlayer()
+  {
+    delete synth;
+  }
+
+  double framesPerTick() const
+  {
+    return double(frequency) / (music->tickRate * tempo);
+  }
+
+  int64_t eventFrame() const
+  {
+    return baseFrame + int64_t(max(double(ticks) - baseTicks, 0.0) * framesPerTick() + 0.5);
+  }
+
+  void setTempo(double tempo_)
+  {
+    baseTicks += double(frame - baseFrame) / framesPerTick();
+    baseFrame = frame;
+    tempo = min(max(tempo_, 0.01), 100.0);
+  }
+
+  bool restartLoop()
+  {
+    if (loopsLeft == 0 || ticks == loopTicks) // a loop without delays would never advance
+      return false;
+    if (loopsLeft > 0)
+      loopsLeft--;
+    start_opl_music_cursor(*music, cursor, music->loopStart);
+    loopTicks = ticks;
+    if (++loopsPlayed == 1)
+      firstLoopTicks = ticks;
+    else if (loopsPlayed == 2)
+      secondLoopTicks = ticks;
+    return true;
+  }
+
+  void step()
+  {
+    uint64_t time = immediate ? 0 : opl3_output_native_time(&chip, eventFrame() - frame);
+    if (synth)
+    {
+      synth->timed = !immediate;
+      synth->time = time;
+    }
+    OplMusicMessage m;
+    switch (read_opl_music_event(*music, cursor, m))
+    {
+      case OplMusicEvent::write:
+        if (immediate)
+          OPL3_WriteReg(&chip, m.reg, m.value);
+        else
+          opl3_write_reg_at(&chip, time, m.reg, m.value);
+        break;
+      case OplMusicEvent::delay:
+        ticks += m.delay;
+        break;
+      case OplMusicEvent::midi:
+        synth->message(m.midi[0], m.midi[1], m.midi[2]);
+        break;
+      case OplMusicEvent::end:
+        if (restartLoop())
+        {
+          if (synth)
+            synth->reset();
+        }
+        else
+        {
+          ending = true;
+          endFrame = eventFrame();
+        }
+        break;
+    }
+  }
+
+  // frame the rendering may go up to before the next event has to be applied
+  int64_t renderLimit() const
+  {
+    return ending ? endFrame : eventFrame() - lookahead;
+  }
+
+  uint64_t keyframeTicks() const
+  {
+    return max(uint64_t(music->tickRate * OPL_MUSIC_KEYFRAME_SECONDS), uint64_t(1));
+  }
+
+  void saveKeyframe()
+  {
+    keyframes.emplace_back();
+    OplMusicKeyframe & k = keyframes.back();
+    k.ticks = ticks;
+    k.lead = eventFrame() - frame;
+    k.loopTicks = loopTicks;
+    k.loopsLeft = loopsLeft;
+    k.cursor = cursor;
+    k.chip.resize(OPL3_SaveState(&chip, nullptr, 0));
+    OPL3_SaveState(&chip, k.chip.data(), uint32_t(k.chip.size()));
+    if (synth)
+    {
+      memcpy(k.channels, synth->channels, sizeof(k.channels));
+      memcpy(k.voices, synth->voices, sizeof(k.voices));
+      for (int v = 0; v < OPL_MIDI_VOICES; v++)
+        k.instruments[v] = synth->voices[v].instrument ? int16_t(synth->voices[v].instrument - synth->bank.instruments) : -1;
+      k.serial = synth->serial;
+    }
+  }
+
+  // shift - ticks added to the keyframe position, a later loop repetition that reuses the keyframes of the first one
+  void restoreKeyframe(const OplMusicKeyframe & k, uint64_t shift)
+  {
+    ticks = k.ticks + shift;
+    loopTicks = k.loopTicks + shift;
+    loopsLeft = k.loopsLeft;
+    cursor = k.cursor;
+    OPL3_RestoreState(&chip, k.chip.data(), uint32_t(k.chip.size()));
+    if (synth)
+    {
+      memcpy(synth->channels, k.channels, sizeof(k.channels));
+      memcpy(synth->voices, k.voices, sizeof(k.voices));
+      for (int v = 0; v < OPL_MIDI_VOICES; v++)
+        synth->voices[v].instrument = k.instruments[v] >= 0 ? &synth->bank.instruments[k.instruments[v]] : nullptr;
+      synth->serial = k.serial;
+    }
+    baseTicks = double(ticks);
+    baseFrame = int64_t(baseTicks * framesPerTick() + 0.5);
+    frame = baseFrame - k.lead;
+    ending = false;
+    finished = false;
+    exact = true;
+  }
+
+  // applies the next event, taking a keyframe first when the last one is far enough behind
+  void stepEvent()
+  {
+    if (keepKeyframes && exact && loopsPlayed < 2 && keyframes.size() < OPL_MUSIC_MAX_KEYFRAMES &&
+        (keyframes.empty() || ticks >= keyframes.back().ticks + keyframeTicks()))
+      saveKeyframe();
+    step();
+  }
+
+  // moves to frame, generate = false replays the register writes only (fast-forward: notes that are held at
+  // the target start from their attack, releases in between are not heard)
+  void advance(int64_t to, bool generate)
+  {
+    float scratch[OPL_MUSIC_SEEK_BLOCK_FRAMES * 2];
+    if (!generate)
+    {
+      opl3_flush_writebuf(&chip);
+      immediate = true;
+    }
+    while (frame < to && !finished)
+    {
+      int64_t limit = renderLimit();
+      if (limit <= frame)
+      {
+        if (ending)
+          finished = true;
+        else
+          stepEvent();
+        continue;
+      }
+      int n = int(min(min(to, limit) - frame, int64_t(OPL_MUSIC_SEEK_BLOCK_FRAMES)));
+      if (generate)
+        opl3_generate_float(&chip, scratch, n);
+      frame += n;
+    }
+    immediate = false;
+  }
+
+  // frames of the whole song with the remaining loops, walks the events without rendering
+  int64_t countFrames()
+  {
+    OplMusicCursor saveCursor = cursor;
+    uint64_t saveTicks = ticks, saveLoopTicks = loopTicks;
+    int saveLoops = loopsLeft;
+    OplMusicMessage m;
+    for (;;)
+    {
+      OplMusicEvent e = read_opl_music_event(*music, cursor, m);
+      if (e == OplMusicEvent::delay)
+        ticks += m.delay;
+      else if (e == OplMusicEvent::end && !restartLoop())
+        break;
+    }
+    int64_t frames = eventFrame();
+    cursor = saveCursor;
+    ticks = saveTicks;
+    loopTicks = saveLoopTicks;
+    loopsLeft = saveLoops;
+    return frames;
+  }
+
+  // interleaved stereo, returns fewer frames than requested at the end of the song
+  int render(float * dst, int frames)
+  {
+    int done = 0;
+    while (done < frames && !finished)
+    {
+      int64_t limit = renderLimit();
+      if (limit <= frame)
+      {
+        if (ending)
+          finished = true;
+        else
+          stepEvent();
+        continue;
+      }
+      int n = int(min(int64_t(frames - done), limit - frame));
+      opl3_generate_float(&chip, dst + done * 2, n);
+      done += n;
+      frame += n;
+    }
+    return done;
+  }
+};
+
+static mutex opl_music_voices_cs;
+
+struct OplMusicSource;
+static vector<OplMusicSource *> opl_music_voices;
+
+// The mixer renders player. seek_opl_music and set_sound_play_pos prepare a new player on the calling thread
+// from the keyframes of builder, which plays the song from the start, and hand it over through pending;
+// the replaced one comes back through retired.
+struct OplMusicSource : SoundSource
+{
+  OplMusic music;
+  OplMidiBank bank;          // MIDI files, taken at the start so that every player uses the same instruments
+  int loops = 0;
+  OplMusicPlayer * player = nullptr;                 // audio thread
+  atomic<OplMusicPlayer *> pending;                  // seek result, taken by the audio thread
+  atomic<OplMusicPlayer *> retired;                  // players replaced by the audio thread, chained through nextRetired
+  OplMusicPlayer * builder = nullptr;                // seek_opl_music, opl_music_voices_cs
+  atomic<float> tempo;       // set_opl_music_tempo, applied by the audio thread
+  float appliedTempo = 1.0f; // audio thread
+  unsigned handle = 0;       // guarded by opl_music_voices_cs
+
+  OplMusicSource() : pending(nullptr), retired(nullptr), tempo(1.0f) {}
+
+  ~OplMusicSource()
+  {
+    {
+      lock_guard<mutex> lock(opl_music_voices_cs);
+      auto it = find(opl_music_voices.begin(), opl_music_voices.end(), this);
+      if (it != opl_music_voices.end())
+        opl_music_voices.erase(it);
+    }
+    deleteRetired();
+    delete player;
+    delete pending.load();
+    delete builder;
+  }
+
+  bool open(const char * file_name, int frequency_, int loops_)
+  {
+    if (!open_opl_music(file_name, music))
+      return false;
+    frequency = frequency_;
+    channels = 2;
+    loops = loops_;
+    prepare_opl3_resample_filter(uint32_t(frequency));
+    if (music.format == OplMusicFormat::midi)
+      get_opl_midi_bank(bank);
+    player = new OplMusicPlayer();
+    player->open(music, frequency, loops, &bank);
+    return true;
+  }
+
+  void deleteRetired() // not the audio thread
+  {
+    OplMusicPlayer * p = retired.exchange(nullptr, memory_order_acquire);
+    while (p)
+    {
+      OplMusicPlayer * next = p->nextRetired;
+      delete p;
+      p = next;
+    }
+  }
+
+  // song position in seconds at tempo 1 (loops add up); restores the closest keyframe before it and renders the rest,
+  // the keyframes grow by at most OPL_MUSIC_SEEK_BUILD_SECONDS of song per call and further targets are fast-forwarded to
+  OplMusicPlayer * prepareSeek(double seconds) // calling thread, opl_music_voices_cs must be held
+  {
+    deleteRetired();
+    if (!builder)
+    {
+      builder = new OplMusicPlayer();
+      builder->open(music, frequency, loops, &bank);
+      builder->keepKeyframes = true;
+    }
+
+    uint64_t target = uint64_t(seconds * music.tickRate + 0.5);
+    uint64_t shift = 0;
+    if (builder->loopsPlayed >= 2 && target >= builder->secondLoopTicks)
+    {
+      uint64_t length = builder->secondLoopTicks - builder->firstLoopTicks;
+      uint64_t folded = builder->firstLoopTicks + (target - builder->firstLoopTicks) % length;
+      shift = target - folded;
+      target = folded;
+    }
+    if (builder->loopsPlayed < 2 && !builder->finished)
+    {
+      int64_t to = int64_t(double(target) * builder->framesPerTick() + 0.5); // the builder keeps tempo 1
+      builder->advance(min(to, builder->frame + int64_t(OPL_MUSIC_SEEK_BUILD_SECONDS * frequency)), true);
+    }
+
+    OplMusicPlayer * p = new OplMusicPlayer();
+    p->open(music, frequency, loops, &bank);
+    p->tempo = min(max(double(tempo.load(memory_order_relaxed)), 0.01), 100.0);
+    const vector<OplMusicKeyframe> & keyframes = builder->keyframes;
+    auto it = upper_bound(keyframes.begin(), keyframes.end(), target,
+      [](uint64_t t, const OplMusicKeyframe & k) { return t < k.ticks; });
+    uint64_t from = 0;
+    if (it != keyframes.begin())
+    {
+      const OplMusicKeyframe & k = *(it - 1);
+      p->restoreKeyframe(k, shift);
+      from = k.ticks;
+    }
+    bool generate = it != keyframes.end() || target - from <= p->keyframeTicks();
+    p->exact = generate;
+    p->advance(p->baseFrame + int64_t(double(target - from) * p->framesPerTick() + 0.5), generate);
+    return p;
+  }
+
+  virtual int read(float * dst, int frames) override
+  {
+    OplMusicPlayer * p = pending.exchange(nullptr, memory_order_acquire);
+    if (p)
+    {
+      player->nextRetired = retired.load(memory_order_relaxed);
+      while (!retired.compare_exchange_weak(player->nextRetired, player, memory_order_release, memory_order_relaxed))
+        ;
+      player = p;
+      appliedTempo = float(p->tempo);
+    }
+    float t = tempo.load(memory_order_relaxed);
+    if (t != appliedTempo)
+    {
+      player->setTempo(t);
+      appliedTempo = t;
+    }
+    return player->render(dst, frames);
+  }
+
+  virtual bool isFinished() const override
+  {
+    return player->finished;
+  }
+
+  virtual double tell(double frames_behind) const override
+  {
+    return max(double(player->frame) - frames_behind, 0.0);
+  }
+};
+
+static OplMusicSource * find_opl_music_voice(PlayingSoundHandle handle) // opl_music_voices_cs must be held
+{
+  if (!handle.handle)
+    return nullptr;
+  for (auto && s : opl_music_voices)
+    if (s->handle == handle.handle)
+      return s;
+  return nullptr;
+}
+
+// FM sound effect notes over a pool of OPL3 chips, 18 two-operator voices each. Chips are added as the notes
+// need them and a chip without notes is not rendered. A full pool takes the quietest released note, or the oldest one.
+
+#define FM_POOL_DEFAULT_CHIPS 4
+#define FM_POOL_MAX_CHIPS 16
+#define FM_POOL_COMMAND_QUEUE_SIZE 1024 // power of 2
+#define FM_POOL_BLOCK_FRAMES OPL3_CHUNK_FRAMES
+
+enum class FmNoteCommandType : uint8_t
+{
+  play,
+  stop,
+  pitch,
+  volume,
+  stopAll,
+};
+
+struct FmNoteCommand
+{
+  FmNoteCommandType type = FmNoteCommandType::play;
+  uint32_t note = 0;
+  float value = 0.0f;    // note number for play and pitch, volume for volume
+  float volume = 1.0f;   // play
+  float duration = 0.0f; // play, seconds, <= 0 - until stop_fm_note
+  OplInstrument instrument;
+};
+
+struct FmPoolVoice
+{
+  uint32_t note = 0;       // 0 - free
+  OplInstrumentVoice instrument;
+  float pitch = 60.0f;     // note number with the instrument offset
+  float volume = 1.0f;
+  bool keyOn = false;
+  int64_t offFrame = -1;   // automatic release
+  uint32_t serial = 0;     // note on order
+  uint16_t frequency = 0;
+};
+
+static mutex fm_pool_create_cs; // taken before sound_cs and fm_pool_cs
+static mutex fm_pool_cs;        // script side only, taken after sound_cs, serializes the command producers
+
+struct FmPoolSource;
+static FmPoolSource * fm_pool = nullptr;                           // fm_pool_cs
+static PlayingSoundHandle fm_pool_voice;                           // fm_pool_cs
+static atomic<int> fm_pool_max_chips(FM_POOL_DEFAULT_CHIPS);       // read by the audio thread
+static uint32_t fm_note_counter = 0;                               // fm_pool_cs
+
+// Everything the audio thread needs is allocated with the pool: the chips and voices up to FM_POOL_MAX_CHIPS,
+// the command ring (single consumer, producers serialized by fm_pool_cs) and the render scratch,
+// so read() neither allocates nor takes a lock. Chips are rendered one after another on the audio thread.
+struct FmPoolSource : SoundSource
+{
+  opl3_chip chips[FM_POOL_MAX_CHIPS];                         // reset by init, chipCount of them in use
+  FmPoolVoice voices[FM_POOL_MAX_CHIPS * OPL_MIDI_VOICES];    // audio thread
+  atomic<uint32_t> voiceNotes[FM_POOL_MAX_CHIPS * OPL_MIDI_VOICES]; // voices[].note after the last read
+  FmNoteCommand commands[FM_POOL_COMMAND_QUEUE_SIZE];
+  atomic<uint32_t> commandWrite;
+  atomic<uint32_t> commandRead;
+  atomic<uint32_t> appliedNote;   // the last play command taken by the audio thread, newer notes are pending
+  atomic<int> activeCount;        // chips rendered by the last read
+  opl3_chip * active[FM_POOL_MAX_CHIPS]; // audio thread, chips rendered by the current read
+  float scratch[FM_POOL_BLOCK_FRAMES * 2];
+  int chipCount = 0;              // audio thread
+  uint32_t serial = 0;
+  int64_t frame = 0;
+
+  FmPoolSource() : commandWrite(0), commandRead(0), appliedNote(0), activeCount(0)
+  {
+    for (auto && note : voiceNotes)
+      note.store(0, memory_order_relaxed);
+  }
+
+  ~FmPoolSource()
+  {
+    lock_guard<mutex> lock(fm_pool_cs);
+    if (fm_pool == this)
+      fm_pool = nullptr;
+  }
+
+  void init(int frequency_)
+  {
+    frequency = frequency_;
+    channels = 2;
+    for (auto && chip : chips)
+    {
+      OPL3_Reset(&chip, uint32_t(frequency));
+      OPL3_SetFastMode(&chip, 1); // most voices of a sound effect pool are idle
+      OPL3_WriteReg(&chip, 0x105, 0x01);
+      OPL3_WriteReg(&chip, 0x104, 0x00);
+      OPL3_WriteReg(&chip, 0x0BD, 0x00);
+    }
+    prepare_opl3_resample_filter(uint32_t(frequency));
+  }
+
+  bool queueCommand(const FmNoteCommand & c) // producer, fm_pool_cs must be held
+  {
+    uint32_t w = commandWrite.load(memory_order_relaxed);
+    if (w - commandRead.load(memory_order_acquire) >= FM_POOL_COMMAND_QUEUE_SIZE)
+      return false;
+    commands[w & (FM_POOL_COMMAND_QUEUE_SIZE - 1)] = c;
+    commandWrite.store(w + 1, memory_order_release);
+    return true;
+  }
+
+  // a play command still in the ring or a voice the last read left the note on, fm_pool_cs must be held
+  bool isPlaying(uint32_t note) const
+  {
+    if (int32_t(note - appliedNote.load(memory_order_acquire)) > 0)
+      return true;
+    for (auto && v : voiceNotes)
+      if (v.load(memory_order_relaxed) == note)
+        return true;
+    return false;
+  }
+
+  opl3_chip * voiceChip(int v)
+  {
+    return &chips[v / OPL_MIDI_VOICES];
+  }
+
+  const opl3_chip * voiceChip(int v) const
+  {
+    return &chips[v / OPL_MIDI_VOICES];
+  }
+
+  void writePitch(int v)
+  {
+    FmPoolVoice & voice = voices[v];
+    voice.frequency = opl_note_frequency(voice.pitch);
+    uint16_t ch = OplMidiSynth::channelOffset(v % OPL_MIDI_VOICES);
+    OPL3_WriteReg(voiceChip(v), 0xA0 + ch, uint8_t(voice.frequency & 0xFF));
+    OPL3_WriteReg(voiceChip(v), 0xB0 + ch, uint8_t((voice.keyOn ? 0x20 : 0) | (voice.frequency >> 8)));
+  }
+
+  void writeLevel(int v)
+  {
+    const FmPoolVoice & voice = voices[v];
+    const OplInstrumentVoice & iv = voice.instrument;
+    int atten = voice.volume > 0.0f ? int(min(-20.0 * log10(min(double(voice.volume), 1.0)) / 0.75 + 0.5, 63.0)) : 63;
+    auto scaled = [atten](uint8_t reg40) { return uint8_t((reg40 & 0xC0) | min((reg40 & 0x3F) + atten, 0x3F)); };
+    uint16_t op = OplMidiSynth::slotOffset(v % OPL_MIDI_VOICES);
+    OPL3_WriteReg(voiceChip(v), 0x40 + op, (iv.regC0 & 0x01) ? scaled(iv.mod.reg40) : iv.mod.reg40);
+    OPL3_WriteReg(voiceChip(v), 0x43 + op, scaled(iv.car.reg40));
+  }
+
+  void writeInstrument(int v)
+  {
+    const OplInstrumentVoice & iv = voices[v].instrument;
+    opl3_chip * chip = voiceChip(v);
+    uint16_t op = OplMidiSynth::slotOffset(v % OPL_MIDI_VOICES);
+    OPL3_WriteReg(chip, 0x20 + op, iv.mod.reg20);
+    OPL3_WriteReg(chip, 0x60 + op, iv.mod.reg60);
+    OPL3_WriteReg(chip, 0x80 + op, iv.mod.reg80);
+    OPL3_WriteReg(chip, 0xE0 + op, iv.mod.regE0);
+    OPL3_WriteReg(chip, 0x23 + op, iv.car.reg20);
+    OPL3_WriteReg(chip, 0x63 + op, iv.car.reg60);
+    OPL3_WriteReg(chip, 0x83 + op, iv.car.reg80);
+    OPL3_WriteReg(chip, 0xE3 + op, iv.car.regE0);
+    OPL3_WriteReg(chip, 0xC0 + OplMidiSynth::channelOffset(v % OPL_MIDI_VOICES), uint8_t((iv.regC0 & 0x0F) | 0x30));
+  }
+
+  void release(int v)
+  {
+    FmPoolVoice & voice = voices[v];
+    voice.keyOn = false;
+    voice.offFrame = -1;
+    OPL3_WriteReg(voiceChip(v), 0xB0 + OplMidiSynth::channelOffset(v % OPL_MIDI_VOICES), uint8_t(voice.frequency >> 8));
+  }
+
+  // envelope attenuation of what is heard from the voice, 0x1ff and more - silent
+  int voiceAttenuation(int v) const
+  {
+    const opl3_channel & ch = voiceChip(v)->channel[v % OPL_MIDI_VOICES];
+    int att = ch.slots[1]->eg_out;
+    if (voices[v].instrument.regC0 & 0x01)
+      att = min(att, int(ch.slots[0]->eg_out));
+    return att;
+  }
+
+  bool voiceSilent(int v) const
+  {
+    const opl3_channel & ch = voiceChip(v)->channel[v % OPL_MIDI_VOICES];
+    bool silent = ch.slots[1]->eg_rout >= 0x1ff;
+    if (voices[v].instrument.regC0 & 0x01)
+      silent = silent && ch.slots[0]->eg_rout >= 0x1ff;
+    return silent;
+  }
+
+  // a free voice on a chip that is rendered anyway, then one on an idle chip, then a new chip,
+  // then the quietest released note, then the oldest note
+  int allocate() // chips past fm_pool_max_chips take no new notes and go idle once their notes end
+  {
+    int maxChips = fm_pool_max_chips.load(memory_order_relaxed);
+    int usable = min(chipCount, maxChips);
+    int best = -1;
+    for (int pass = 0; pass < 2 && best < 0; pass++)
+      for (int c = 0; c < usable && best < 0; c++)
+      {
+        bool busy = false;
+        int free = -1;
+        for (int i = 0; i < OPL_MIDI_VOICES; i++)
+        {
+          if (voices[c * OPL_MIDI_VOICES + i].note)
+            busy = true;
+          else if (free < 0)
+            free = c * OPL_MIDI_VOICES + i;
+        }
+        if (free >= 0 && (busy || pass == 1))
+          best = free;
+      }
+    if (best >= 0)
+      return best;
+
+    if (chipCount < maxChips)
+      return chipCount++ * OPL_MIDI_VOICES; // init has reset the chip
+
+    int last = usable * OPL_MIDI_VOICES;
+    for (int v = 0; v < last; v++)
+      if (!voices[v].keyOn && (best < 0 || voiceAttenuation(v) > voiceAttenuation(best)))
+        best = v;
+    if (best < 0)
+      for (int v = 0; v < last; v++)
+        if (best < 0 || voices[v].serial < voices[best].serial)
+          best = v;
+    if (best >= 0 && voices[best].keyOn)
+      release(best);
+    return best;
+  }
+
+  int findVoice(uint32_t note) const
+  {
+    for (int v = 0; v < chipCount * OPL_MIDI_VOICES; v++)
+      if (voices[v].note == note)
+        return v;
+    return -1;
+  }
+
+  void apply(const FmNoteCommand & c) // audio thread
+  {
+    if (c.type == FmNoteCommandType::play)
+    {
+      int v = allocate();
+      if (v < 0)
+        return;
+      FmPoolVoice & voice = voices[v];
+      voice.note = c.note;
+      voice.instrument = c.instrument.voice[0];
+      voice.pitch = (c.instrument.fixedNote ? float(c.instrument.note) : c.value) + voice.instrument.noteOffset;
+      voice.volume = c.volume;
+      voice.keyOn = true;
+      voice.offFrame = c.duration > 0.0f ? frame + int64_t(double(c.duration) * frequency) : -1;
+      voice.serial = ++serial;
+      writeInstrument(v);
+      writeLevel(v);
+      writePitch(v);
+      return;
+    }
+    if (c.type == FmNoteCommandType::stopAll)
+    {
+      for (int v = 0; v < chipCount * OPL_MIDI_VOICES; v++)
+        if (voices[v].keyOn)
+          release(v);
+      return;
+    }
+
+    int v = findVoice(c.note);
+    if (v < 0)
+      return;
+    FmPoolVoice & voice = voices[v];
+    switch (c.type)
+    {
+      case FmNoteCommandType::stop:
+        if (voice.keyOn)
+          release(v);
+        break;
+      case FmNoteCommandType::pitch:
+        voice.pitch = c.value + voice.instrument.noteOffset;
+        writePitch(v);
+        break;
+      case FmNoteCommandType::volume:
+        voice.volume = c.value;
+        writeLevel(v);
+        break;
+      default:
+        break;
+    }
+  }
+
+  void applyCommands() // audio thread
+  {
+    uint32_t r = commandRead.load(memory_order_relaxed);
+    uint32_t w = commandWrite.load(memory_order_acquire);
+    uint32_t lastPlay = appliedNote.load(memory_order_relaxed);
+    for (; r != w; r++)
+    {
+      const FmNoteCommand & c = commands[r & (FM_POOL_COMMAND_QUEUE_SIZE - 1)];
+      apply(c);
+      if (c.type == FmNoteCommandType::play)
+        lastPlay = c.note;
+    }
+    commandRead.store(r, memory_order_release);
+
+    for (int v = 0; v < chipCount * OPL_MIDI_VOICES; v++)
+    {
+      FmPoolVoice & voice = voices[v];
+      if (!voice.note)
+        continue;
+      if (voice.keyOn && voice.offFrame >= 0 && voice.offFrame <= frame)
+        release(v);
+      else if (!voice.keyOn && voiceSilent(v))
+        voice.note = 0;
+    }
+    for (int v = 0; v < chipCount * OPL_MIDI_VOICES; v++)
+      voiceNotes[v].store(voices[v].note, memory_order_relaxed);
+    appliedNote.store(lastPlay, memory_order_release); // after voiceNotes, so a taken note is never missed
+  }
+
+  virtual int read(float * dst, int frames) override
+  {
+    applyCommands();
+
+    int count = 0;
+    for (int c = 0; c < chipCount; c++)
+      for (int i = 0; i < OPL_MIDI_VOICES; i++)
+        if (voices[c * OPL_MIDI_VOICES + i].note)
+        {
+          active[count++] = &chips[c];
+          break;
+        }
+    activeCount.store(count, memory_order_relaxed);
+
+    memset(dst, 0, sizeof(float) * frames * 2);
+    for (int done = 0; done < frames && count; )
+    {
+      int n = min(frames - done, FM_POOL_BLOCK_FRAMES);
+      float * out = dst + done * 2;
+      for (int i = 0; i < count; i++)
+      {
+        opl3_generate_float(active[i], scratch, n);
+        for (int j = 0; j < n * 2; j++)
+          out[j] += scratch[j];
+      }
+      done += n;
+    }
+    frame += frames;
+    return frames;
+  }
+
+  virtual bool isFinished() const override
+  {
+    return false; // plays until finalize
+  }
+
+  virtual double tell(double frames_behind) const override
+  {
+    return max(double(frame) - frames_behind, 0.0);
+  }
+};
+
+
+void print_debug_infos(int from_frame)
+{
+  lock_guard<mutex> lock(sound_data_cs);
+  for (auto && r : sound_records)
+    if (r.buffer && r.creationFrame >= from_frame)
+      LOG() << "  sound: " << r.name << " (" << uint64_t(r.size) << " bytes)";
+}
+
+static void stop_loader_threads();
+static void stop_opl3_pool();
+
+void initialize()
+{
+  memset(&playing_sounds[0], 0, sizeof(playing_sounds[0]) * playing_sounds.size());
+}
+
+void finalize()
+{
+  device_initialized = false;
+  {
+    lock_guard<mutex> lock(sound_cs);
+    ma_device_uninit(&miniaudio_device);
+
+    for (auto && s : playing_sounds)
+    {
+      if (s.source)
+        s.releaseSource();
+      if (s.buffer)
+        s.releaseBuffer();
+      s.stopMode = false;
+      s.waitingStart = false;
+    }
+  }
+
+  stop_stream_thread();
+  collect_retired_sources(true);
+  stop_loader_threads();
+  stop_opl3_pool();
+}
+
+
+PcmSound create_sound(int frequency, const TArray<float> & data)
+{
+  if (!device_initialized)
+    init_sound_lib_internal();
+
+  if (frequency < 1 || !data.size)
+    return PcmSound();
+
+  PcmSound s;
+  s.frequency = frequency;
+  s.channels = 1;
+  s.samples = data.size;
+  if (!s.newData(s.getDataMemorySize()))
+    return PcmSound();
+  memcpy(s.getData(), data.data, data.size * sizeof(float));
+  s.getData()[data.size] = s.getData()[0];
+
+  s.dbg = new DasboxDebugInfo();
+  snprintf(s.dbg->name, sizeof(s.dbg->name) - 1, "mono %d smpl @%d", s.samples, s.frequency);
+  register_debug_info(s);
+
+  return s;
+}
+
+PcmSound create_sound_stereo(int frequency, const TArray<float2> & data)
+{
+  if (!device_initialized)
+    init_sound_lib_internal();
+
+  if (frequency < 1 || !data.size)
+    return PcmSound();
+
+  PcmSound s;
+  s.frequency = frequency;
+  s.channels = 2;
+  s.samples = data.size;
+  if (!s.newData(s.getDataMemorySize()))
+    return PcmSound();
+  memcpy(s.getData(), data.data, data.size * sizeof(float2));
+  s.getData()[s.samples * 2] = s.getData()[0];
+  s.getData()[s.samples * 2 + 1] = s.getData()[1];
+
+  s.dbg = new DasboxDebugInfo();
+  snprintf(s.dbg->name, sizeof(s.dbg->name) - 1, "stereo %d smpl @%d", s.samples, s.frequency);
+  register_debug_info(s);
+
+  return s;
+}
+
+// contents are undefined until written, e.g. with with_sound_data
+PcmSound create_sound_uninitialized(int frequency, int frames, int channels)
+{
+  if (!device_initialized)
+    init_sound_lib_internal();
+
+  if (frequency < 1 || frames < 1 || (channels != 1 && channels != 2))
+    return PcmSound();
+
+  PcmSound s;
+  s.frequency = frequency;
+  s.channels = channels;
+  s.samples = frames;
+  if (!s.newData(s.getDataMemorySize()))
+    return PcmSound();
+
+  s.dbg = new DasboxDebugInfo();
+  snprintf(s.dbg->name, sizeof(s.dbg->name) - 1, "%s %d smpl @%d", channels == 2 ? "stereo" : "mono", s.samples,
+    s.frequency);
+  register_debug_info(s);
+
+  return s;
+}
+
+
+enum class SoundFileType
+{
+  unknown,
+  wav,
+  mp3,
+  flac,
+};
+
+#define SOUND_FILE_MAGIC_BYTES 12
+
+// container signature wins over the name, hint may be a file name, an extension or a bare "wav"/"mp3"/"flac"
+static SoundFileType detect_sound_file_type(const uint8_t * head, size_t size, const char * hint)
+{
+  if (size >= 12 && (!memcmp(head, "RIFF", 4) || !memcmp(head, "RIFX", 4) || !memcmp(head, "RF64", 4)) &&
+      !memcmp(head + 8, "WAVE", 4))
+    return SoundFileType::wav;
+  if (size >= 4 && !memcmp(head, "riff", 4)) // Wave64
+    return SoundFileType::wav;
+  if (size >= 4 && !memcmp(head, "fLaC", 4))
+    return SoundFileType::flac;
+  if (size >= 3 && !memcmp(head, "ID3", 3))
+    return SoundFileType::mp3;
+  // MPEG frame sync, layer bits 00 are reserved (and are what a raw FLAC frame header looks like)
+  if (size >= 2 && head[0] == 0xFF && (head[1] & 0xE0) == 0xE0 && (head[1] & 0x06) != 0)
+    return SoundFileType::mp3;
+
+  if (hint && hint[0])
+  {
+    const char * p = strrchr(hint, '.');
+    p = p ? p + 1 : hint;
+    if (!stricmp(p, "wav"))
+      return SoundFileType::wav;
+    if (!stricmp(p, "mp3"))
+      return SoundFileType::mp3;
+    if (!stricmp(p, "flac"))
+      return SoundFileType::flac;
+  }
+
+  return SoundFileType::unknown;
+}
+
+// takes ownership of pSampleData
+static PcmSound make_decoded_sound(float * pSampleData, unsigned int channels, unsigned int sampleRate,
+  uint64_t totalPCMFrameCount, const char * name)
+{
+  if (!pSampleData)
+  {
+    LOG(LogLevel::error) << "Cannot create sound from '" << name << "'";
+    return PcmSound();
+  }
+
+  if (channels != 1 && channels != 2)
+  {
+    LOG(LogLevel::error) << "Cannot create sound from '" << name << "', invalid channels count =" << int(channels);
+    drwav_free(pSampleData, NULL);
+    return PcmSound();
+  }
+
+  PcmSound s;
+  s.channels = int(channels);
+  s.frequency = int(sampleRate);
+  s.samples = int(totalPCMFrameCount);
+  if (!s.newData(s.getDataMemorySize()))
+  {
+    drwav_free(pSampleData, NULL);
+    return PcmSound();
+  }
+  memcpy(s.getData(), pSampleData, channels * s.samples * sizeof(float));
+  if (s.channels == 2)
+  {
+    s.getData()[s.samples * 2] = s.getData()[0];
+    s.getData()[s.samples * 2 + 1] = s.getData()[1];
+  }
+  else
+  {
+    s.getData()[s.samples] = s.getData()[0];
+  }
+
+  drwav_free(pSampleData, NULL);
+
+  s.dbg = new DasboxDebugInfo();
+  snprintf(s.dbg->name, sizeof(s.dbg->name) - 1, "%s", name);
+  register_debug_info(s);
+
+  return s;
+}
+
+// thread safe, used by both synchronous and background loading
+static PcmSound decode_sound_file(const char * file_name)
+{
+  if (!file_name || !file_name[0])
+  {
+    LOG(LogLevel::error) << "Cannot create sound. File name is empty. '" << file_name << "'";
+    return PcmSound();
+  }
+
+/*
+  if (!fs::is_path_string_valid(file_name))
+  {
+    LOG(LogLevel::error) << "Cannot open sound '" << file_name << "'. Absolute paths or access to the parent directory is prohibited.";
+    return PcmSound();
+  }
+  */
+
+  uint8_t head[SOUND_FILE_MAGIC_BYTES];
+  size_t headSize = 0;
+  FILE * f = fopen(file_name, "rb");
+  if (f)
+  {
+    headSize = fread(head, 1, sizeof(head), f);
+    fclose(f);
+  }
+
+  unsigned int channels = 0;
+  unsigned int sampleRate = 0;
+  drwav_uint64 totalPCMFrameCount = 0;
+  float * pSampleData = nullptr;
+
+  switch (detect_sound_file_type(head, headSize, file_name))
+  {
+    case SoundFileType::wav:
+      pSampleData = drwav_open_file_and_read_pcm_frames_f32(file_name, &channels, &sampleRate, &totalPCMFrameCount, nullptr);
+      break;
+    case SoundFileType::mp3:
+    {
+      drmp3_config config = { 0 };
+      pSampleData = drmp3_open_file_and_read_pcm_frames_f32(file_name, &config, &totalPCMFrameCount, nullptr);
+      channels = config.channels;
+      sampleRate = config.sampleRate;
+      break;
+    }
+    case SoundFileType::flac:
+      pSampleData = drflac_open_file_and_read_pcm_frames_f32(file_name, &channels, &sampleRate, &totalPCMFrameCount, nullptr);
+      break;
+    default:
+      LOG(LogLevel::error) << "Cannot create sound from '" << file_name << "', unrecognized file format. Expected .wav, .flac or .mp3";
+      return PcmSound();
+  }
+
+  return make_decoded_sound(pSampleData, channels, sampleRate, totalPCMFrameCount, file_name);
+}
+
+
+PcmSound create_sound_from_file(const char * file_name)
+{
+  if (!device_initialized)
+    init_sound_lib_internal();
+
+  return decode_sound_file(file_name);
+}
+
+
+static void format_memory_sound_name(char * name, size_t size, const char * format_hint)
+{
+  snprintf(name, size, "<memory%s%s>", format_hint && format_hint[0] ? " " : "", format_hint ? format_hint : "");
+}
+
+PcmSound create_sound_from_memory(const void * data, size_t size, const char * format_hint)
+{
+  if (!device_initialized)
+    init_sound_lib_internal();
+
+  char name[64];
+  format_memory_sound_name(name, sizeof(name), format_hint);
+
+  if (!data || !size)
+  {
+    LOG(LogLevel::error) << "Cannot create sound from " << name << ", buffer is empty";
+    return PcmSound();
+  }
+
+  unsigned int channels = 0;
+  unsigned int sampleRate = 0;
+  drwav_uint64 totalPCMFrameCount = 0;
+  float * pSampleData = nullptr;
+
+  switch (detect_sound_file_type((const uint8_t *)data, size, format_hint))
+  {
+    case SoundFileType::wav:
+      pSampleData = drwav_open_memory_and_read_pcm_frames_f32(data, size, &channels, &sampleRate, &totalPCMFrameCount, nullptr);
+      break;
+    case SoundFileType::mp3:
+    {
+      drmp3_config config = { 0 };
+      pSampleData = drmp3_open_memory_and_read_pcm_frames_f32(data, size, &config, &totalPCMFrameCount, nullptr);
+      channels = config.channels;
+      sampleRate = config.sampleRate;
+      break;
+    }
+    case SoundFileType::flac:
+      pSampleData = drflac_open_memory_and_read_pcm_frames_f32(data, size, &channels, &sampleRate, &totalPCMFrameCount, nullptr);
+      break;
+    default:
+      LOG(LogLevel::error) << "Cannot create sound from " << name << ", unrecognized format. Expected wav, flac or mp3";
+      return PcmSound();
+  }
+
+  return make_decoded_sound(pSampleData, channels, sampleRate, totalPCMFrameCount, name);
+}
+
+PcmSound create_sound_from_memory_array(const TArray<uint8_t> & bytes, const char * format_hint)
+{
+  return create_sound_from_memory(bytes.data, bytes.size, format_hint);
+}
+
+
+// adapts a positional reader to the sequential read/seek callbacks of dr_libs
+struct SoundReaderStream
+{
+  SoundReadCallback read = nullptr;
+  void * user = nullptr;
+  int64_t position = 0;
+};
+
+static size_t sound_reader_read(void * user, void * dst, size_t bytes)
+{
+  SoundReaderStream * stream = (SoundReaderStream *)user;
+  int64_t got = stream->read(stream->user, stream->position, dst, int64_t(bytes));
+  if (got <= 0)
+    return 0;
+  got = min(got, int64_t(bytes));
+  stream->position += got;
+  return size_t(got);
+}
+
+// every dr_libs *_seek_origin enum has start = 0, current = 1
+template <typename Origin>
+static uint32_t sound_reader_seek(void * user, int offset, Origin origin)
+{
+  SoundReaderStream * stream = (SoundReaderStream *)user;
+  int64_t pos = origin == Origin(0) ? int64_t(offset) : stream->position + offset;
+  if (pos < 0)
+    return 0;
+  stream->position = pos;
+  return 1;
+}
+
+PcmSound create_sound_from_reader(SoundReadCallback read, void * user, const char * format_hint)
+{
+  if (!device_initialized)
+    init_sound_lib_internal();
+
+  char name[64];
+  format_memory_sound_name(name, sizeof(name), format_hint);
+
+  if (!read)
+  {
+    LOG(LogLevel::error) << "Cannot create sound from " << name << ", reader is null";
+    return PcmSound();
+  }
+
+  SoundReaderStream stream;
+  stream.read = read;
+  stream.user = user;
+
+  uint8_t head[SOUND_FILE_MAGIC_BYTES];
+  int64_t headSize = read(user, 0, head, sizeof(head));
+
+  unsigned int channels = 0;
+  unsigned int sampleRate = 0;
+  drwav_uint64 totalPCMFrameCount = 0;
+  float * pSampleData = nullptr;
+
+  switch (detect_sound_file_type(head, size_t(max(headSize, int64_t(0))), format_hint))
+  {
+    case SoundFileType::wav:
+      pSampleData = drwav_open_and_read_pcm_frames_f32(sound_reader_read, sound_reader_seek<drwav_seek_origin>, &stream,
+        &channels, &sampleRate, &totalPCMFrameCount, nullptr);
+      break;
+    case SoundFileType::mp3:
+    {
+      drmp3_config config = { 0 };
+      pSampleData = drmp3_open_and_read_pcm_frames_f32(sound_reader_read, sound_reader_seek<drmp3_seek_origin>, &stream,
+        &config, &totalPCMFrameCount, nullptr);
+      channels = config.channels;
+      sampleRate = config.sampleRate;
+      break;
+    }
+    case SoundFileType::flac:
+      pSampleData = drflac_open_and_read_pcm_frames_f32(sound_reader_read, sound_reader_seek<drflac_seek_origin>, &stream,
+        &channels, &sampleRate, &totalPCMFrameCount, nullptr);
+      break;
+    default:
+      LOG(LogLevel::error) << "Cannot create sound from " << name << ", unrecognized format. Expected wav, flac or mp3";
+      return PcmSound();
+  }
+
+  return make_decoded_sound(pSampleData, channels, sampleRate, totalPCMFrameCount, name);
+}
+
+
+struct SoundReaderBlock
+{
+  const Block * block;
+  Context * context;
+  LineInfoArg * at;
+};
+
+static int64_t sound_reader_block_read(void * user, int64_t offset, void * dst, int64_t bytes)
+{
+  SoundReaderBlock * reader = (SoundReaderBlock *)user;
+  // script sees the decoder's buffer directly, locked so it can not be resized
+  TArray<uint8_t> view;
+  memset(&view, 0, sizeof(view));
+  view.data = (char *)dst;
+  view.size = uint32_t(bytes);
+  view.capacity = uint32_t(bytes);
+  view.lock = 1;
+  return das_invoke<int64_t>::invoke<int64_t, TArray<uint8_t> &>(reader->context, reader->at, *reader->block, offset, view);
+}
+
+PcmSound create_sound_from_reader_block(const char * format_hint, const TBlock<int64_t, int64_t, TArray<uint8_t>> & block,
+  Context * context, LineInfoArg * at)
+{
+  SoundReaderBlock reader = { &block, context, at };
+  return create_sound_from_reader(sound_reader_block_read, &reader, format_hint);
+}
+
+
+struct SoundLoadBatch
+{
+  int remaining = 0;
+};
+
+struct SoundLoadJob
+{
+  string fileName;
+  PcmSound sound;
+  SampleFormat format = SampleFormat::f32;
+  SoundLoadBatch * batch = nullptr;
+  int64_t sourceBytes = 0;
+  bool done = false;
+};
+
+// Each loader thread owns a queue and takes jobs from its front,
+// idle threads (and threads waiting for a batch) steal from the back of other queues.
+struct LoaderQueue
+{
+  mutex cs;
+  deque<SoundLoadJob *> jobs;
+};
+
+static mutex loader_cs;
+static condition_variable loader_cv;      // new jobs or shutdown
+static condition_variable loader_done_cv; // job finished
+static vector<LoaderQueue *> loader_queues;
+static vector<thread> loader_threads;
+static atomic<int> loader_pending(0);
+static unsigned loader_next_queue = 0;
+static bool loader_running = false;
+static das_hash_map<uint32_t, SoundLoadJob *> load_jobs;
+static uint32_t last_load_handle = 0;
+
+static SoundLoadJob * pop_load_job(int queue_index)
+{
+  int count = int(loader_queues.size());
+  for (int i = 0; i < count; i++)
+  {
+    bool own = (i == 0 && queue_index >= 0);
+    LoaderQueue * q = loader_queues[(max(queue_index, 0) + i) % count];
+    lock_guard<mutex> lock(q->cs);
+    if (q->jobs.empty())
+      continue;
+
+    SoundLoadJob * job = nullptr;
+    if (own)
+    {
+      job = q->jobs.front();
+      q->jobs.pop_front();
+    }
+    else
+    {
+      job = q->jobs.back();
+      q->jobs.pop_back();
+    }
+    loader_pending--;
+    return job;
+  }
+  return nullptr;
+}
+
+static int64_t get_file_size(const char * file_name)
+{
+  FILE * f = fopen(file_name, "rb");
+  if (!f)
+    return 0;
+  fseek(f, 0, SEEK_END);
+  int64_t size = int64_t(ftell(f));
+  fclose(f);
+  return size;
+}
+
+static void run_load_job(SoundLoadJob * job)
+{
+  job->sound = decode_sound_file(job->fileName.c_str());
+  if (job->format != SampleFormat::f32)
+    convert_sound_format(job->sound, job->format);
+  if (job->batch)
+    job->sourceBytes = get_file_size(job->fileName.c_str());
+
+  lock_guard<mutex> lock(loader_cs);
+  job->done = true;
+  if (job->batch)
+    job->batch->remaining--;
+  loader_done_cv.notify_all();
+}
+
+static void loader_thread_proc(int queue_index)
+{
+  for (;;)
+  {
+    SoundLoadJob * job = pop_load_job(queue_index);
+    if (job)
+    {
+      run_load_job(job);
+      continue;
+    }
+
+    unique_lock<mutex> lock(loader_cs);
+    loader_cv.wait(lock, [] { return !loader_running || loader_pending > 0; });
+    if (!loader_running)
+      return;
+  }
+}
+
+static void start_loader_threads() // loader_cs must be held
+{
+  if (loader_running)
+    return;
+
+  loader_running = true;
+  int count = max(int(thread::hardware_concurrency()) - 1, 1);
+  for (int i = 0; i < count; i++)
+    loader_queues.push_back(new LoaderQueue());
+  for (int i = 0; i < count; i++)
+    loader_threads.push_back(thread(loader_thread_proc, i));
+}
+
+static void push_load_job(SoundLoadJob * job, unsigned queue_index) // loader_cs must be held
+{
+  LoaderQueue * q = loader_queues[queue_index % loader_queues.size()];
+  {
+    lock_guard<mutex> lock(q->cs);
+    q->jobs.push_back(job);
+  }
+  loader_pending++;
+}
+
+static void stop_loader_threads()
+{
+  {
+    lock_guard<mutex> lock(loader_cs);
+    loader_running = false;
+  }
+  loader_cv.notify_all();
+
+  for (auto && t : loader_threads)
+    t.join();
+  loader_threads.clear();
+
+  for (auto && q : loader_queues)
+    delete q;
+  loader_queues.clear();
+  loader_pending = 0;
+
+  for (auto && job : load_jobs)
+    delete job.second;
+  load_jobs.clear();
+}
+
+static SoundLoadJob * find_load_job(SoundLoadHandle handle) // loader_cs must be held
+{
+  auto it = load_jobs.find(handle.handle);
+  return it != load_jobs.end() ? it->second : nullptr;
+}
+
+SoundLoadHandle create_sound_async(const char * file_name)
+{
+  return create_sound_async_format(file_name, SampleFormat::f32);
+}
+
+SoundLoadHandle create_sound_async_format(const char * file_name, SampleFormat format)
+{
+  if (!device_initialized)
+    init_sound_lib_internal();
+
+  SoundLoadJob * job = new SoundLoadJob();
+  job->fileName = file_name ? file_name : "";
+  job->format = format;
+
+  lock_guard<mutex> lock(loader_cs);
+  start_loader_threads();
+
+  SoundLoadHandle res;
+  res.handle = ++last_load_handle;
+  if (!res.handle)
+    res.handle = ++last_load_handle;
+
+  load_jobs[res.handle] = job;
+  push_load_job(job, loader_next_queue++);
+  loader_cv.notify_one();
+  return res;
+}
+
+bool is_sound_loaded(SoundLoadHandle handle)
+{
+  lock_guard<mutex> lock(loader_cs);
+  SoundLoadJob * job = find_load_job(handle);
+  return !job || job->done;
+}
+
+void wait_sound_loaded(SoundLoadHandle handle)
+{
+  unique_lock<mutex> lock(loader_cs);
+  SoundLoadJob * job = find_load_job(handle);
+  if (job)
+    loader_done_cv.wait(lock, [job] { return job->done || !loader_running; });
+}
+
+PcmSound take_loaded_sound(SoundLoadHandle handle)
+{
+  SoundLoadJob * job = nullptr;
+  {
+    unique_lock<mutex> lock(loader_cs);
+    job = find_load_job(handle);
+    if (!job)
+      return PcmSound();
+
+    loader_done_cv.wait(lock, [job] { return job->done || !loader_running; });
+    if (!job->done)
+      return PcmSound();
+
+    load_jobs.erase(handle.handle);
+  }
+
+  PcmSound s = std::move(job->sound);
+  delete job;
+  return s;
+}
+
+void create_sounds_bulk(const TArray<char *> & file_names, TArray<PcmSound> & out_sounds, SoundLoadStats & stats)
+{
+  if (!device_initialized)
+    init_sound_lib_internal();
+
+  stats = SoundLoadStats();
+  int count = min(int(file_names.size), int(out_sounds.size));
+  if (!count)
+    return;
+
+  auto startTime = chrono::steady_clock::now();
+
+  vector<SoundLoadJob> jobs(count);
+  SoundLoadBatch batch;
+  batch.remaining = count;
+
+  {
+    lock_guard<mutex> lock(loader_cs);
+    start_loader_threads();
+
+    // contiguous ranges per queue, imbalance is evened out by stealing
+    uint64_t queues = loader_queues.size();
+    for (int i = 0; i < count; i++)
+    {
+      const char * fileName = ((char **)file_names.data)[i];
+      jobs[i].fileName = fileName ? fileName : "";
+      jobs[i].batch = &batch;
+      push_load_job(&jobs[i], unsigned(uint64_t(i) * queues / count));
+    }
+  }
+  loader_cv.notify_all();
+
+  // the calling thread decodes too instead of just waiting
+  while (SoundLoadJob * job = pop_load_job(-1))
+    run_load_job(job);
+
+  {
+    unique_lock<mutex> lock(loader_cs);
+    loader_done_cv.wait(lock, [&batch] { return batch.remaining == 0 || !loader_running; });
+  }
+
+  stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - startTime).count();
+
+  PcmSound * out = (PcmSound *)out_sounds.data;
+  int64_t sourceBytes = 0;
+  int64_t decodedBytes = 0;
+  for (int i = 0; i < count; i++)
+  {
+    if (jobs[i].sound.isValid())
+      decodedBytes += jobs[i].sound.getDataMemorySize();
+    else
+      stats.failed++;
+    sourceBytes += jobs[i].sourceBytes;
+    out[i] = std::move(jobs[i].sound);
+  }
+
+  stats.files = count;
+  stats.sourceMegabytes = sourceBytes / (1024.0 * 1024.0);
+  stats.decodedMegabytes = decodedBytes / (1024.0 * 1024.0);
+  if (stats.seconds > 0.0)
+  {
+    stats.decodedMegabytesPerSecond = stats.decodedMegabytes / stats.seconds;
+    stats.filesPerSecond = count / stats.seconds;
+  }
+}
+
+// interleaved float frames [offset, offset + count) of the sound, decoded into tmp when the storage is not f32
+static const float * get_float_frames_range(const PcmSound & sound, int offset, int count, vector<float> & tmp)
+{
+  int channels = sound.channels;
+  if (sound.format == SampleFormat::f32)
+    return sound.getData() + size_t(offset) * channels;
+
+  if (sound.format == SampleFormat::ima_adpcm)
+  {
+    int first = offset / SOUND_ADPCM_BLOCK_FRAMES;
+    int last = (offset + count - 1) / SOUND_ADPCM_BLOCK_FRAMES;
+    tmp.resize(((last - first + 1) * SOUND_ADPCM_BLOCK_FRAMES + 1) * channels);
+    for (int block = first; block <= last; block++)
+      decode_ima_adpcm_block((const uint8_t *)sound.getData(), block, sound.getAdpcmBlockCount(), channels,
+        tmp.data() + (block - first) * SOUND_ADPCM_BLOCK_FRAMES * channels);
+    return tmp.data() + (offset - first * SOUND_ADPCM_BLOCK_FRAMES) * channels;
+  }
+
+  size_t begin = size_t(offset) * channels;
+  size_t n = size_t(count) * channels;
+  tmp.resize(n);
+  if (sound.format == SampleFormat::s16)
+  {
+    const int16_t * src = (const int16_t *)sound.getData() + begin;
+    for (size_t i = 0; i < n; i++)
+      tmp[i] = sample_to_float(src[i]);
+  }
+  else
+  {
+    const Half * src = (const Half *)sound.getData() + begin;
+    for (size_t i = 0; i < n; i++)
+      tmp[i] = sample_to_float(src[i]);
+  }
+  return tmp.data();
+}
+
+// interleaved float frames of the whole sound including the wrap-around frame
+static const float * get_float_frames(const PcmSound & sound, vector<float> & tmp)
+{
+  return get_float_frames_range(sound, 0, sound.samples + 1, tmp);
+}
+
+bool convert_sound_format(PcmSound & sound, SampleFormat format)
+{
+  if (!sound.getData() || sound.format == format)
+    return sound.format == format;
+
+  vector<float> tmp;
+  const float * frames = get_float_frames(sound, tmp);
+  if (frames != tmp.data())
+    tmp.assign(frames, frames + (sound.samples + 1) * sound.channels);
+
+  SampleFormat oldFormat = sound.format;
+  sound.format = format;
+  if (!sound.newData(sound.getDataMemorySize()))
+  {
+    sound.format = oldFormat;
+    return false;
+  }
+
+  int count = (sound.samples + 1) * sound.channels;
+  if (format == SampleFormat::ima_adpcm)
+    encode_ima_adpcm(tmp.data(), sound.samples + 1, sound.channels, (uint8_t *)sound.getData());
+  else
+  {
+    if (format == SampleFormat::s16)
+    {
+      int16_t * dst = (int16_t *)sound.getData();
+      for (int i = 0; i < count; i++)
+        dst[i] = float_to_s16(tmp[i]);
+    }
+    else if (format == SampleFormat::f16)
+    {
+      Half * dst = (Half *)sound.getData();
+      for (int i = 0; i < count; i++)
+        dst[i] = float_to_half(tmp[i]);
+    }
+    else
+      memcpy(sound.getData(), tmp.data(), count * sizeof(float));
+
+    memset((char *)sound.getData() + count * sound.getBytesPerSample(), 0, 3 * sound.channels * sound.getBytesPerSample());
+  }
+  return true;
+}
+
+PcmSound create_sound_from_file_format(const char * file_name, SampleFormat format)
+{
+  PcmSound s = create_sound_from_file(file_name);
+  convert_sound_format(s, format);
+  return s;
+}
+
+
+// Pre-decoded PCM cache file: a header followed by the sample data exactly as PcmSound stores it
+// (including the wrap-around and guard frames), so the mapping can be used without a copy.
+
+#define SOUND_CACHE_MAGIC "DASPCM\0\1"
+#define SOUND_CACHE_DATA_OFFSET 64 // keeps sample data 64-byte aligned in the page-aligned mapping
+
+struct SoundCacheHeader
+{
+  char magic[8];
+  uint32_t dataOffset;
+  int32_t frequency;
+  int32_t channels;
+  int32_t samples;
+  int32_t format;
+  int32_t guardFrames;  // frames stored past samples: wrap-around frame + interpolation guard
+  uint64_t dataSize;
+  uint64_t sourceSize;  // stale detection: the source file must still have this size and mtime
+  int64_t sourceMtime;
+  uint8_t reserved[8];
+};
+
+static_assert(sizeof(SoundCacheHeader) == SOUND_CACHE_DATA_OFFSET, "unexpected cache header size");
+
+static int get_guard_frames(const PcmSound & sound)
+{
+  if (sound.format == SampleFormat::ima_adpcm)
+    return sound.getAdpcmBlockCount() * SOUND_ADPCM_BLOCK_FRAMES - sound.samples;
+  return 4;
+}
+
+static bool get_source_file_stamp(const char * file_name, uint64_t & size, int64_t & mtime)
+{
+  struct stat st;
+  if (!file_name || stat(file_name, &st) != 0)
+    return false;
+  size = uint64_t(st.st_size);
+  mtime = int64_t(st.st_mtime);
+  return true;
+}
+
+PcmSound open_sound_cache_checked(const char * cache_file_name, const char * source_file_name)
+{
+  if (!cache_file_name)
+    return PcmSound();
+
+  SoundFileMapping * m = map_sound_file(cache_file_name);
+  if (!m)
+    return PcmSound();
+
+  const SoundCacheHeader * h = (const SoundCacheHeader *)m->base;
+  PcmSound s;
+  bool ok = m->size >= sizeof(SoundCacheHeader) && !memcmp(h->magic, SOUND_CACHE_MAGIC, sizeof(h->magic)) &&
+    h->dataOffset == SOUND_CACHE_DATA_OFFSET && (h->channels == 1 || h->channels == 2) && h->samples >= 0 &&
+    h->frequency > 0 && h->format >= int(SampleFormat::f32) && h->format <= int(SampleFormat::f16);
+  if (ok)
+  {
+    s.frequency = h->frequency;
+    s.channels = h->channels;
+    s.samples = h->samples;
+    s.format = SampleFormat(h->format);
+    ok = h->guardFrames == get_guard_frames(s) && h->dataSize == uint64_t(s.getDataMemorySize()) &&
+      m->size >= h->dataOffset + h->dataSize;
+  }
+
+  if (ok && source_file_name)
+  {
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    ok = get_source_file_stamp(source_file_name, size, mtime) && size == h->sourceSize && mtime == h->sourceMtime;
+  }
+
+  if (!ok)
+  {
+    unmap_sound_file(m);
+    return PcmSound();
+  }
+
+  s.data = (float *)((char *)m->base + h->dataOffset);
+  s.buffer = new_sample_buffer(s.data, size_t(h->dataSize), m);
+  s.memoryUsed = 0;
+  s.dbg = new DasboxDebugInfo();
+  snprintf(s.dbg->name, sizeof(s.dbg->name) - 1, "%s", source_file_name ? source_file_name : cache_file_name);
+  register_debug_info(s);
+  return s;
+}
+
+PcmSound open_sound_cache(const char * cache_file_name)
+{
+  return open_sound_cache_checked(cache_file_name, nullptr);
+}
+
+bool save_sound_cache(const PcmSound & sound, const char * cache_file_name, const char * source_file_name)
+{
+  if (!sound.getData() || !cache_file_name)
+    return false;
+
+  SoundCacheHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, SOUND_CACHE_MAGIC, sizeof(h.magic));
+  h.dataOffset = SOUND_CACHE_DATA_OFFSET;
+  h.frequency = sound.frequency;
+  h.channels = sound.channels;
+  h.samples = sound.samples;
+  h.format = int(sound.format);
+  h.guardFrames = get_guard_frames(sound);
+  h.dataSize = uint64_t(sound.getDataMemorySize());
+  get_source_file_stamp(source_file_name, h.sourceSize, h.sourceMtime);
+
+  // write aside and rename, other processes may be mapping the previous version right now
+  char tmpName[1024];
+#ifdef _WIN32
+  snprintf(tmpName, sizeof(tmpName), "%s.%d.tmp", cache_file_name, int(_getpid()));
+#else
+  snprintf(tmpName, sizeof(tmpName), "%s.%d.tmp", cache_file_name, int(getpid()));
+#endif
+
+  FILE * f = fopen(tmpName, "wb");
+  if (!f)
+  {
+    LOG(LogLevel::error) << "Cannot write sound cache '" << cache_file_name << "'";
+    return false;
+  }
+  bool ok = fwrite(&h, sizeof(h), 1, f) == 1 && fwrite(sound.getData(), size_t(h.dataSize), 1, f) == 1;
+  ok = fclose(f) == 0 && ok;
+#ifdef _WIN32
+  ok = ok && MoveFileExA(tmpName, cache_file_name, MOVEFILE_REPLACE_EXISTING);
+#else
+  ok = ok && rename(tmpName, cache_file_name) == 0;
+#endif
+  if (!ok)
+  {
+    remove(tmpName);
+    LOG(LogLevel::error) << "Cannot write sound cache '" << cache_file_name << "'";
+  }
+  return ok;
+}
+
+PcmSound create_sound_cached_format(const char * file_name, const char * cache_file_name, SampleFormat format)
+{
+  if (!device_initialized)
+    init_sound_lib_internal();
+
+  PcmSound s = open_sound_cache_checked(cache_file_name, file_name);
+  if (s.isValid() && s.format == format)
+    return s;
+
+  s = create_sound_from_file_format(file_name, format);
+  if (!s.isValid() || !save_sound_cache(s, cache_file_name, file_name))
+    return s;
+
+  // map the fresh cache so this process shares the page cache with the others too
+  PcmSound mapped = open_sound_cache_checked(cache_file_name, file_name);
+  return mapped.isValid() ? std::move(mapped) : std::move(s);
+}
+
+PcmSound create_sound_cached(const char * file_name, const char * cache_file_name)
+{
+  return create_sound_cached_format(file_name, cache_file_name, SampleFormat::f32);
+}
+
+
+// clips the range to the sound, returns the number of frames left
+static int clip_sound_range(const PcmSound & sound, int & offset, int count)
+{
+  offset = clamp(offset, 0, sound.samples);
+  return clamp(count, 0, sound.samples - offset);
+}
+
+static void read_sound_frames(const PcmSound & sound, int offset, int count, float * dst, int dst_channels)
+{
+  if (!sound.getData())
+    return;
+
+  count = clip_sound_range(sound, offset, count);
+  if (!count)
+    return;
+
+  vector<float> decoded;
+  const float * frames = get_float_frames_range(sound, offset, count, decoded);
+  convert_channels(frames, sound.channels, dst, dst_channels, count);
+}
+
+// re-encodes only the blocks covering the range, starting from the state stored in the first of them
+static void patch_adpcm_frames(PcmSound & sound, int offset, int count, const float * src)
+{
+  int channels = sound.channels;
+  int first = offset / SOUND_ADPCM_BLOCK_FRAMES;
+  int blocks = (offset + count - 1) / SOUND_ADPCM_BLOCK_FRAMES - first + 1;
+  uint8_t * dst = (uint8_t *)sound.getData() + size_t(first) * channels * SOUND_ADPCM_BLOCK_BYTES;
+
+  vector<float> tmp((blocks * SOUND_ADPCM_BLOCK_FRAMES + 1) * channels);
+  for (int block = 0; block < blocks; block++)
+    decode_ima_adpcm_block((const uint8_t *)sound.getData(), first + block, sound.getAdpcmBlockCount(), channels,
+      tmp.data() + block * SOUND_ADPCM_BLOCK_FRAMES * channels);
+  memcpy(tmp.data() + (offset - first * SOUND_ADPCM_BLOCK_FRAMES) * channels, src, size_t(count) * channels * sizeof(float));
+
+  ImaAdpcmState st[2];
+  for (int c = 0; c < channels; c++)
+    st[c] = ima_block_state(dst + c * SOUND_ADPCM_BLOCK_BYTES);
+  encode_ima_adpcm_blocks(tmp.data(), blocks * SOUND_ADPCM_BLOCK_FRAMES, channels, st, dst);
+}
+
+// src holds count interleaved float frames in the channel layout of the sound
+static void store_float_frames(PcmSound & sound, int offset, int count, const float * src)
+{
+  size_t begin = size_t(offset) * sound.channels;
+  size_t n = size_t(count) * sound.channels;
+  if (sound.format == SampleFormat::f32)
+    memcpy(sound.getData() + begin, src, n * sizeof(float));
+  else if (sound.format == SampleFormat::s16)
+  {
+    int16_t * dst = (int16_t *)sound.getData() + begin;
+    for (size_t i = 0; i < n; i++)
+      dst[i] = float_to_s16(src[i]);
+  }
+  else if (sound.format == SampleFormat::f16)
+  {
+    Half * dst = (Half *)sound.getData() + begin;
+    for (size_t i = 0; i < n; i++)
+      dst[i] = float_to_half(src[i]);
+  }
+  else
+    patch_adpcm_frames(sound, offset, count, src);
+}
+
+// the frame after the last one repeats the first frame for interpolation across the loop point
+static void update_wrap_frame(PcmSound & sound)
+{
+  if (sound.format == SampleFormat::ima_adpcm)
+  {
+    float first[2];
+    read_sound_frames(sound, 0, 1, first, sound.channels);
+    patch_adpcm_frames(sound, sound.samples, 1, first);
+    return;
+  }
+
+  size_t frameBytes = size_t(sound.channels) * sound.getBytesPerSample();
+  uint8_t * data = (uint8_t *)sound.getData();
+  memcpy(data + size_t(sound.samples) * frameBytes, data, frameBytes);
+}
+
+static void write_sound_frames(PcmSound & sound, int offset, int count, const float * src, int src_channels)
+{
+  if (!sound.getData())
+    return;
+
+  count = clip_sound_range(sound, offset, count);
+  if (!count)
+    return;
+
+  if (!sound.makeDataUnique())
+    return;
+
+  if (sound.format == SampleFormat::f32)
+    convert_channels(src, src_channels, sound.getData() + size_t(offset) * sound.channels, sound.channels, count);
+  else
+  {
+    vector<float> tmp(size_t(count) * sound.channels);
+    convert_channels(src, src_channels, tmp.data(), sound.channels, count);
+    store_float_frames(sound, offset, count, tmp.data());
+  }
+
+  if (offset == 0)
+    update_wrap_frame(sound);
+}
+
+void get_sound_data(const PcmSound & sound, TArray<float> & out_data)
+{
+  read_sound_frames(sound, 0, int(out_data.size), (float *)out_data.data, 1);
+}
+
+void get_sound_data_stereo(const PcmSound & sound, TArray<float2> & out_data)
+{
+  read_sound_frames(sound, 0, int(out_data.size), (float *)out_data.data, 2);
+}
+
+void get_sound_data_range(const PcmSound & sound, int frame_offset, TArray<float> & out_data)
+{
+  read_sound_frames(sound, frame_offset, int(out_data.size), (float *)out_data.data, 1);
+}
+
+void get_sound_data_range_stereo(const PcmSound & sound, int frame_offset, TArray<float2> & out_data)
+{
+  read_sound_frames(sound, frame_offset, int(out_data.size), (float *)out_data.data, 2);
+}
+
+void set_sound_data(PcmSound & sound, const TArray<float> & in_data)
+{
+  write_sound_frames(sound, 0, int(in_data.size), (const float *)in_data.data, 1);
+}
+
+void set_sound_data_stereo(PcmSound & sound, const TArray<float2> & in_data)
+{
+  write_sound_frames(sound, 0, int(in_data.size), (const float *)in_data.data, 2);
+}
+
+void set_sound_data_range(PcmSound & sound, int frame_offset, const TArray<float> & in_data)
+{
+  write_sound_frames(sound, frame_offset, int(in_data.size), (const float *)in_data.data, 1);
+}
+
+void set_sound_data_range_stereo(PcmSound & sound, int frame_offset, const TArray<float2> & in_data)
+{
+  write_sound_frames(sound, frame_offset, int(in_data.size), (const float *)in_data.data, 2);
+}
+
+// Hands the sample storage to the script as a locked array (T = float or float2, interleaved frames).
+// The view keeps the buffer alive even if the sound is deleted inside the block.
+// Only f32 sounds have a view, others are converted once with convert_sound_format.
+template <typename T>
+static void invoke_sound_data_view(PcmSound & sound, const Block & block, Context * context, LineInfoArg * at)
+{
+  if (!sound.getData())
+    return;
+
+  if (sound.format != SampleFormat::f32)
+  {
+    LOG(LogLevel::error) << "with_sound_data: the view requires an f32 sound, convert it once with convert_sound_format";
+    return;
+  }
+
+  if (!sound.makeDataUnique())
+    return;
+
+  int channels = sound.channels;
+  int samples = sound.samples;
+  float * soundData = sound.getData();
+  SampleBuffer * b = sound.getBuffer();
+  b->refCount++;
+
+  TArray<T> view;
+  memset(&view, 0, sizeof(view));
+  view.data = (char *)soundData;
+  view.size = uint32_t(size_t(samples) * channels * sizeof(float) / sizeof(T));
+  view.capacity = view.size;
+  view.lock = 1;
+  das_invoke<void>::invoke<TArray<T> &>(context, at, block, view);
+
+  if (sound.getBuffer() == b) // the block may have deleted or replaced the data
+    update_wrap_frame(sound);
+
+  if (--b->refCount == 0)
+    destroy_sample_buffer(b);
+}
+
+void with_sound_data(PcmSound & sound, const TBlock<void, TTemporary<TArray<float>>> & block, Context * context,
+  LineInfoArg * at)
+{
+  invoke_sound_data_view<float>(sound, block, context, at);
+}
+
+void with_sound_data_stereo(PcmSound & sound, const TBlock<void, TTemporary<TArray<float2>>> & block, Context * context,
+  LineInfoArg * at)
+{
+  if (sound.getData() && sound.channels != 2)
+  {
+    LOG(LogLevel::error) << "with_sound_data: float2 view requires a stereo sound";
+    return;
+  }
+  invoke_sound_data_view<float2>(sound, block, context, at);
+}
+
+void delete_sound(PcmSound * sound)
+{
+  sound->deleteData();
+  sound->data = nullptr;
+  sound->samples = 0;
+}
+
+void delete_allocated_sounds()
+{
+  lock_guard<mutex> lock(sound_cs);
+
+  for (auto && s : playing_sounds)
+    if (s.buffer)
+      s.setStopMode();
+  retired_buffers = nullptr; // still registered, freed below
+
+  lock_guard<mutex> dataLock(sound_data_cs);
+  for (auto && r : sound_records)
+    if (r.buffer)
+      free_sample_buffer_storage(r.buffer);
+
+  sound_records.clear();
+  sound_records_free = -1;
+  sound_record_count = 0;
+
+  memory_used = 0;
+  mapped_memory_used = 0;
+}
+
+
+PlayingSoundHandle play_sound_internal(const PcmSound & sound, float volume, float pitch, float pan, float start_time, float end_time,
+                                       bool loop, float defer_time_sec)
+{
+  if (!device_initialized)
+    init_sound_lib_internal();
+
+  collect_retired_sources(false);
+
+  lock_guard<mutex> lock(sound_cs);
+
+  int idx = allocate_playing_sound();
+  if (idx < 0 || sound.samples <= 2 || !sound.getBuffer())
+    return PlayingSoundHandle();
+
+  PlayingSound & s = playing_sounds[idx];
+
+  pitch = clamp(pitch, 0.00001f, 1000.0f);
+  pan = clamp(pan, -1.0f, 1.0f);
+  volume = clamp(volume, 0.0f, 100000.0f);
+
+  s.blockCache = voice_block_cache[idx];
+  s.cachedBlock = -1;
+
+  double start = clamp(double(int64_t(start_time * sound.frequency)), 0.0, double(sound.samples - 1));
+  double stop = clamp(double(int64_t(end_time * sound.frequency)), start, double(sound.samples - 1));
+  double pos = start;
+  if (defer_time_sec < 0.0f)
+    pos = min(double(int(-defer_time_sec * sound.frequency)), stop);
+
+  s.channels = sound.channels;
+  s.data = sound.getData();
+  s.sampleRate = sound.frequency;
+  s.samples = sound.samples;
+  s.format = sound.format;
+  link_voice_buffer(idx, sound.getBuffer());
+  s.volume = volume;
+  s.pitch = pitch;
+  s.pan = pan;
+  s.volumeL = master_volume * volume * min(1.0f + pan, 1.0f);
+  s.volumeR = master_volume * volume * min(1.0f - pan, 1.0f);
+
+  s.pos = pos;
+  s.startPos = start;
+  s.stopPos = stop;
+  s.loop = loop;
+  s.stopMode = false;
+  s.timeToStart = max(defer_time_sec, 0.0f);
+  s.waitingStart = (s.timeToStart != 0.0);
+
+  PlayingSoundHandle res;
+  res.handle = idx | s.version;
+
+  return res;
+}
+
+
+PlayingSoundHandle play_sound_1(const PcmSound & sound)
+{
+  return play_sound_internal(sound, 1.0f, 1.0f, 0.0f, 0.0f, VERY_BIG_NUMBER, false, 0.0f);
+}
+
+PlayingSoundHandle play_sound_2(const PcmSound & sound, float volume)
+{
+  return play_sound_internal(sound, volume, 1.0f, 0.0f, 0.0f, VERY_BIG_NUMBER, false, 0.0f);
+}
+
+PlayingSoundHandle play_sound_3(const PcmSound & sound, float volume, float pitch)
+{
+  return play_sound_internal(sound, volume, pitch, 0.0f, 0.0f, VERY_BIG_NUMBER, false, 0.0f);
+}
+
+PlayingSoundHandle play_sound_4(const PcmSound & sound, float volume, float pitch, float pan)
+{
+  return play_sound_internal(sound, volume, pitch, pan, 0.0f, VERY_BIG_NUMBER, false, 0.0f);
+}
+
+PlayingSoundHandle play_sound_5(const PcmSound & sound, float volume, float pitch, float pan, float start_time, float end_time)
+{
+  return play_sound_internal(sound, volume, pitch, pan, start_time, end_time, false, 0.0f);
+}
+
+PlayingSoundHandle play_sound_loop_1(const PcmSound & sound)
+{
+  return play_sound_internal(sound, 1.0f, 1.0f, 0.0f, 0.0f, VERY_BIG_NUMBER, true, 0.0f);
+}
+
+PlayingSoundHandle play_sound_loop_2(const PcmSound & sound, float volume)
+{
+  return play_sound_internal(sound, volume, 1.0f, 0.0f, 0.0f, VERY_BIG_NUMBER, true, 0.0f);
+}
+
+PlayingSoundHandle play_sound_loop_3(const PcmSound & sound, float volume, float pitch)
+{
+  return play_sound_internal(sound, volume, pitch, 0.0f, 0.0f, VERY_BIG_NUMBER, true, 0.0f);
+}
+
+PlayingSoundHandle play_sound_loop_4(const PcmSound & sound, float volume, float pitch, float pan)
+{
+  return play_sound_internal(sound, volume, pitch, pan, 0.0f, VERY_BIG_NUMBER, true, 0.0f);
+}
+
+PlayingSoundHandle play_sound_loop_5(const PcmSound & sound, float volume, float pitch, float pan, float start_time, float end_time)
+{
+  return play_sound_internal(sound, volume, pitch, pan, start_time, end_time, true, 0.0f);
+}
+
+
+PlayingSoundHandle play_sound_deferred_1(const PcmSound & sound, float defer_seconds)
+{
+  return play_sound_internal(sound, 1.0f, 1.0f, 0.0f, 0.0f, VERY_BIG_NUMBER, false, defer_seconds);
+}
+
+PlayingSoundHandle play_sound_deferred_2(const PcmSound & sound, float defer_seconds, float volume)
+{
+  return play_sound_internal(sound, volume, 1.0f, 0.0f, 0.0f, VERY_BIG_NUMBER, false, defer_seconds);
+}
+
+PlayingSoundHandle play_sound_deferred_3(const PcmSound & sound, float defer_seconds, float volume, float pitch)
+{
+  return play_sound_internal(sound, volume, pitch, 0.0f, 0.0f, VERY_BIG_NUMBER, false, defer_seconds);
+}
+
+PlayingSoundHandle play_sound_deferred_4(const PcmSound & sound, float defer_seconds, float volume, float pitch, float pan)
+{
+  return play_sound_internal(sound, volume, pitch, pan, 0.0f, VERY_BIG_NUMBER, false, defer_seconds);
+}
+
+PlayingSoundHandle play_sound_deferred_5(const PcmSound & sound, float defer_seconds, float volume, float pitch, float pan,
+  float start_time, float end_time)
+{
+  return play_sound_internal(sound, volume, pitch, pan, start_time, end_time, false, defer_seconds);
+}
+
+
+// starts a voice playing the source, the voice owns the source from now on
+static PlayingSoundHandle start_source_voice(SoundSource * source, float volume, float pitch, float pan) // sound_cs must be held
+{
+  int idx = allocate_playing_sound();
+  if (idx < 0)
+  {
+    retire_source(source);
+    return PlayingSoundHandle();
+  }
+
+  PlayingSound & s = playing_sounds[idx];
+
+  pitch = clamp(pitch, 0.00001f, 1000.0f);
+  pan = clamp(pan, -1.0f, 1.0f);
+  volume = clamp(volume, 0.0f, 100000.0f);
+
+  s.channels = source->channels;
+  s.source = source;
+  s.volume = volume;
+  s.pitch = pitch;
+  s.pan = pan;
+  s.volumeL = master_volume * volume * min(1.0f + pan, 1.0f);
+  s.volumeR = master_volume * volume * min(1.0f - pan, 1.0f);
+
+  s.pos = 0.0;
+  s.startPos = 0.0;
+  s.stopPos = VERY_BIG_NUMBER;
+  s.loop = false;
+  s.stopMode = false;
+  s.timeToStart = 0.0;
+  s.waitingStart = false;
+
+  PlayingSoundHandle res;
+  res.handle = idx | s.version;
+
+  return res;
+}
+
+PlayingSoundHandle play_sound_stream_internal(const char * file_name, float volume, float pitch, float pan, bool loop)
+{
+  if (!device_initialized)
+    init_sound_lib_internal();
+
+  collect_retired_sources(true);
+
+  if (!file_name || !file_name[0])
+  {
+    LOG(LogLevel::error) << "Cannot play stream. File name is empty.";
+    return PlayingSoundHandle();
+  }
+
+  FileStreamSource * stream = new FileStreamSource();
+  if (!stream->open(file_name, loop))
+  {
+    LOG(LogLevel::error) << "Cannot open stream '" << file_name << "'. Expected .wav, .flac or .mp3 with 1 or 2 channels";
+    delete stream;
+    return PlayingSoundHandle();
+  }
+
+  stream->decodeAhead();
+
+  {
+    lock_guard<mutex> lock(streams_cs);
+    active_streams.push_back(stream);
+  }
+  start_stream_thread();
+
+  lock_guard<mutex> lock(sound_cs);
+  return start_source_voice(stream, volume, pitch, pan);
+}
+
+PlayingSoundHandle play_sound_stream_1(const char * file_name)
+{
+  return play_sound_stream_internal(file_name, 1.0f, 1.0f, 0.0f, false);
+}
+
+PlayingSoundHandle play_sound_stream_2(const char * file_name, float volume)
+{
+  return play_sound_stream_internal(file_name, volume, 1.0f, 0.0f, false);
+}
+
+PlayingSoundHandle play_sound_stream_3(const char * file_name, float volume, float pitch)
+{
+  return play_sound_stream_internal(file_name, volume, pitch, 0.0f, false);
+}
 
-          mix[0] += vl * volumeL;
-          mix[1] += vr * volumeR;
+PlayingSoundHandle play_sound_stream_4(const char * file_name, float volume, float pitch, float pan)
+{
+  return play_sound_stream_internal(file_name, volume, pitch, pan, false);
+}
 
-          if (volumeL != wishVolumeL)
-          {
-            if (fabsf(volumeL - wishVolumeL) <= ONE_DIV_512)
-              volumeL = wishVolumeL;
-            else if (volumeL < wishVolumeL)
-              volumeL += ONE_DIV_512;
-            else
-              volumeL -= ONE_DIV_512;
-          }
+PlayingSoundHandle play_sound_stream_loop_1(const char * file_name)
+{
+  return play_sound_stream_internal(file_name, 1.0f, 1.0f, 0.0f, true);
+}
 
-          if (volumeR != wishVolumeR)
-          {
-            if (fabsf(volumeR - wishVolumeR) <= ONE_DIV_512)
-              volumeR = wishVolumeR;
-            else if (volumeR < wishVolumeR)
-              volumeR += ONE_DIV_512;
-            else
-              volumeR -= ONE_DIV_512;
-          }
+PlayingSoundHandle play_sound_stream_loop_2(const char * file_name, float volume)
+{
+  return play_sound_stream_internal(file_name, volume, 1.0f, 0.0f, true);
+}
 
-          pos += advance;
-          if (pos >= stopPos)
-          {
-            if (loop)
-              pos = startPos;
-            else
-            {
-              pos = stopPos;
-              setStopMode();
-            }
-          }
-        }
-        else // stopMode
-        {
-          if (fabsf(volumeL) <= ONE_DIV_512)
-            volumeL = 0.0f;
-          else
-          {
-            volumeL += volumeTrendL;
-            volumeL *= 0.997f;
-          }
+PlayingSoundHandle play_sound_stream_loop_3(const char * file_name, float volume, float pitch)
+{
+  return play_sound_stream_internal(file_name, volume, pitch, 0.0f, true);
+}
 
-          if (fabsf(volumeR) <= ONE_DIV_512)
-            volumeR = 0.0f;
-          else
-          {
-            volumeR += volumeTrendR;
-            volumeR *= 0.997f;
-          }
+PlayingSoundHandle play_sound_stream_loop_4(const char * file_name, float volume, float pitch, float pan)
+{
+  return play_sound_stream_internal(file_name, volume, pitch, pan, true);
+}
 
-          if (volumeR == 0.f && volumeL == 0.f)
-          {
-            stopMode = false;
-            break;
-          }
 
-          mix[0] += volumeL;
-          mix[1] += volumeR;
-        }
-      }
-    }
+PlayingSoundHandle play_sound_push_stream_internal(int frequency, int channels, float buffer_seconds, float volume,
+  float target_latency)
+{
+  if (!device_initialized)
+    init_sound_lib_internal();
+
+  collect_retired_sources(true);
+
+  if (frequency < 1 || (channels != 1 && channels != 2))
+  {
+    LOG(LogLevel::error) << "Cannot play push stream, invalid frequency " << frequency << " or channels " << channels;
+    return PlayingSoundHandle();
   }
-};
 
-static array<PlayingSound, MAX_PLAYING_SOUNDS> playing_sounds;
+  PushStreamSource * stream = new PushStreamSource();
+  stream->init(frequency, channels, buffer_seconds);
+  if (target_latency > 0.0f)
+    stream->initDriftControl(target_latency);
 
-static int allocate_playing_sound()
+  lock_guard<mutex> lock(sound_cs);
+  PlayingSoundHandle res = start_source_voice(stream, volume, 1.0f, 0.0f);
+  if (res.handle)
+  {
+    lock_guard<mutex> streamsLock(push_streams_cs);
+    stream->handle = res.handle;
+    push_streams.push_back(stream);
+  }
+  return res;
+}
+
+PlayingSoundHandle play_sound_push_stream_2(int frequency, int channels)
 {
-  for (int i = 1; i < MAX_PLAYING_SOUNDS; i++)
-    if (playing_sounds[i].isEmpty())
-    {
-      playing_sounds[i].version += MAX_PLAYING_SOUNDS;
-      return i;
-    }
-  return -1;
+  return play_sound_push_stream_internal(frequency, channels, 0.5f, 1.0f, 0.0f);
 }
 
-static bool is_handle_valid(PlayingSoundHandle ps)
+PlayingSoundHandle play_sound_push_stream_3(int frequency, int channels, float buffer_seconds)
 {
-  unsigned idx = ps.handle & PLAYING_SOUNDS_MASK;
-  return (playing_sounds[idx].version == int(ps.handle & (~PLAYING_SOUNDS_MASK))) && idx > 0;
+  return play_sound_push_stream_internal(frequency, channels, buffer_seconds, 1.0f, 0.0f);
 }
 
-static int handle_to_index(PlayingSoundHandle ps)
+PlayingSoundHandle play_sound_push_stream_4(int frequency, int channels, float buffer_seconds, float volume)
 {
-  if (!is_handle_valid(ps))
-    return -1;
-  return ps.handle & PLAYING_SOUNDS_MASK;
+  return play_sound_push_stream_internal(frequency, channels, buffer_seconds, volume, 0.0f);
 }
 
+// push stream for a producer with its own clock, the ring holds 4x the target latency
+PlayingSoundHandle play_sound_input_stream_3(int frequency, int channels, float target_latency)
+{
+  return play_sound_push_stream_internal(frequency, channels, target_latency * 4.0f, 1.0f, target_latency);
+}
 
-static float g_limiter_mult = 1.0f;
+PlayingSoundHandle play_sound_input_stream_4(int frequency, int channels, float target_latency, float volume)
+{
+  return play_sound_push_stream_internal(frequency, channels, target_latency * 4.0f, volume, target_latency);
+}
 
-static void apply_limiter(float * __restrict buf, int count)
+// returns the number of frames queued, less than pushed when the ring is full
+static int push_stream_frames(PlayingSoundHandle handle, const float * src, int src_channels, int count)
 {
-  float limiter_mult = g_limiter_mult;
-  for (int i = 0; i < count; i++, buf++)
+  lock_guard<mutex> lock(push_streams_cs);
+  PushStreamSource * stream = find_push_stream(handle);
+  if (!stream || stream->closed || count <= 0)
+    return 0;
+
+  int pushed = 0;
+  if (src_channels == stream->channels)
+    pushed = int(stream->ring.write(src, uint32_t(count)));
+  else
   {
-    float v = *buf * limiter_mult;
-    *buf = v;
-    if (fabsf(v) > 1.0f)
-      limiter_mult *= 0.96f;
-    if (limiter_mult < 1.0f)
-      limiter_mult = min(limiter_mult + (0.5f / 65536), 1.0f);
+    float chunk[STREAM_CHUNK_FRAMES * 2];
+    while (pushed < count)
+    {
+      int n = min(min(count - pushed, STREAM_CHUNK_FRAMES), int(stream->ring.space()));
+      if (n <= 0)
+        break;
+      convert_channels(src + pushed * src_channels, src_channels, chunk, stream->channels, n);
+      stream->ring.write(chunk, uint32_t(n));
+      pushed += n;
+    }
   }
+  stream->droppedFrames += count - pushed;
+  return pushed;
+}
 
-  g_limiter_mult = limiter_mult;
+int push_sound_stream(PlayingSoundHandle handle, const TArray<float> & data)
+{
+  return push_stream_frames(handle, (const float *)data.data, 1, int(data.size));
 }
 
+int push_sound_stream_stereo(PlayingSoundHandle handle, const TArray<float2> & data)
+{
+  return push_stream_frames(handle, (const float *)data.data, 2, int(data.size));
+}
 
-static void fill_buffer_cb(float * __restrict out_buf, int frequency, int channels, int samples)
+void finish_sound_stream(PlayingSoundHandle handle)
 {
-  int cnt = 0;
-  double total_time_played_ = total_time_played;
-  {
-    lock_guard<mutex> lock(sound_cs);
-    float * mixCursor = out_buf;
-    int samplesLeft = samples;
-    memset(out_buf, 0, samples * channels * sizeof(float));
+  lock_guard<mutex> lock(push_streams_cs);
+  PushStreamSource * stream = find_push_stream(handle);
+  if (stream)
+    stream->closed.store(true, memory_order_release);
+}
 
-    double invFrequency = 1.0 / frequency;
-    int step = 256;
+// frames pushed but not yet taken by the mixer, in seconds
+float get_sound_stream_latency(PlayingSoundHandle handle)
+{
+  lock_guard<mutex> lock(push_streams_cs);
+  PushStreamSource * stream = find_push_stream(handle);
+  return stream ? float(stream->ring.available()) / stream->frequency : 0.0f;
+}
 
-    while (samplesLeft > 0)
-    {
-      cnt = 0;
-      for (auto && s : playing_sounds)
-        if (!s.isEmpty())
-        {
-          cnt++;
-          s.mixTo(mixCursor, min(samplesLeft, step), frequency, invFrequency, min(samplesLeft, step) * invFrequency);
-        }
+// free space of the ring in frames
+int get_sound_stream_space(PlayingSoundHandle handle)
+{
+  lock_guard<mutex> lock(push_streams_cs);
+  PushStreamSource * stream = find_push_stream(handle);
+  return stream ? int(stream->ring.space()) : 0;
+}
 
-      samplesLeft -= step;
-      mixCursor += step * channels;
-      total_samples_played += min(samplesLeft, step);
-      total_time_played_ += min(samplesLeft, step) * invFrequency;
-    }
+bool get_sound_stream_stats(PlayingSoundHandle handle, SoundStreamStats & stats)
+{
+  stats = SoundStreamStats();
+
+  lock_guard<mutex> lock(sound_cs); // the audio thread updates the drift control under sound_cs
+  lock_guard<mutex> streamsLock(push_streams_cs);
+  PushStreamSource * stream = find_push_stream(handle);
+  if (!stream)
+    return false;
+
+  double frequency = stream->frequency;
+  stats.latency = float((stream->started ? stream->fillFrames : double(stream->ring.available())) / frequency);
+  stats.targetLatency = float(stream->targetFrames / frequency);
+  stats.averageLatency = float((stream->driftControl ? stream->averageFill : stream->fillFrames) / frequency);
+  stats.correction = float(stream->correction);
+  stats.minCorrection = float(stream->minCorrection);
+  stats.maxCorrection = float(stream->maxCorrection);
+  stats.underruns = stream->underruns;
+  stats.droppedFrames = stream->droppedFrames;
+  return true;
+}
+
+// times the mixer ran out of data of a streaming voice (file or push stream)
+int64_t get_sound_stream_underruns(PlayingSoundHandle handle)
+{
+  lock_guard<mutex> lock(sound_cs);
+  int idx = handle_to_index(handle);
+  if (idx < 0 || !playing_sounds[idx].source)
+    return 0;
+  return playing_sounds[idx].source->underruns;
+}
+
+
+PlayingSoundHandle play_sound_opl3_internal(float volume, float pan)
+{
+  if (!device_initialized)
+    init_sound_lib_internal();
+
+  collect_retired_sources(true);
+
+  Opl3Source * opl = new Opl3Source();
+  opl->init(OUTPUT_SAMPLE_RATE);
+
+  lock_guard<mutex> lock(sound_cs);
+  PlayingSoundHandle res = start_source_voice(opl, volume, 1.0f, pan);
+  if (res.handle)
+  {
+    lock_guard<mutex> voicesLock(opl3_voices_cs);
+    opl->handle = res.handle;
+    opl3_voices.push_back(opl);
   }
-  apply_limiter(out_buf, samples * channels);
-  playing_sound_count = cnt;
+  return res;
+}
 
-  total_time_played = total_time_played_;
+PlayingSoundHandle play_sound_opl3_0()
+{
+  return play_sound_opl3_internal(1.0f, 0.0f);
 }
 
+PlayingSoundHandle play_sound_opl3_1(float volume)
+{
+  return play_sound_opl3_internal(volume, 0.0f);
+}
 
+PlayingSoundHandle play_sound_opl3_2(float volume, float pan)
+{
+  return play_sound_opl3_internal(volume, pan);
+}
 
-static ma_device miniaudio_device;
-static volatile bool device_initialized = false;
-static ma_log ma_log_struct = { 0 };
-static ma_context audio_context = { 0 };
+// frame is in voice frames (get_opl3_time), writes must be queued in time order; false when the queue is full
+bool write_opl3_reg_at(PlayingSoundHandle handle, int64_t frame, uint32_t reg, uint8_t value)
+{
+  lock_guard<mutex> lock(opl3_voices_cs);
+  Opl3Source * opl = find_opl3_voice(handle);
+  return opl && opl->queueRegWrite(frame, uint16_t(reg & 0x1ff), value);
+}
 
+bool write_opl3_reg(PlayingSoundHandle handle, uint32_t reg, uint8_t value)
+{
+  return write_opl3_reg_at(handle, -1, reg, value);
+}
 
-void on_error_log(void * user_data, ma_uint32 level, const char * message)
+// frames rendered by the voice so far, timestamps before this are applied immediately
+int64_t get_opl3_time(PlayingSoundHandle handle)
 {
-  G_UNUSED(user_data);
-  G_UNUSED(level);
-  if (level <= 1)
-    LOG(LogLevel::error) << message;
-  else
-    LOG(LogLevel::info) << message;
+  lock_guard<mutex> lock(opl3_voices_cs);
+  Opl3Source * opl = find_opl3_voice(handle);
+  return opl ? opl->renderFrame.load(memory_order_acquire) : 0;
 }
 
-static void miniaudio_data_callback(ma_device* p_device, void* p_output, const void* p_input, ma_uint32 frame_count)
+// skip silent operators of the voice chip (OPL3_SetFastMode), false when there is no such voice
+bool set_opl3_fast_mode(PlayingSoundHandle handle, bool enable)
 {
-  G_UNUSED(p_input);
+  lock_guard<mutex> lock(opl3_voices_cs);
+  Opl3Source * opl = find_opl3_voice(handle);
+  if (!opl)
+    return false;
+  opl->fastMode.store(enable, memory_order_relaxed);
+  return true;
+}
 
-  if (!device_initialized)
+
+void opl3_generate_stereo(opl3_chip & chip, TArray<float2> & data)
+{
+  prepare_opl3_resample_filter(chip.samplerate);
+  opl3_generate_float(&chip, (float *)data.data, int(data.size));
+}
+
+// all four chip outputs (A, B, C, D), z and w are silent unless C0 registers route channels there
+void opl3_generate_4ch(opl3_chip & chip, TArray<float4> & data)
+{
+  prepare_opl3_resample_filter(chip.samplerate);
+  opl3_resample(&chip, (float *)data.data, int(data.size), 4);
+}
+
+// (left + right) / 2
+void opl3_generate_mono(opl3_chip & chip, TArray<float> & data)
+{
+  prepare_opl3_resample_filter(chip.samplerate);
+  float chunk[OPL3_CHUNK_FRAMES * 2];
+  float * dst = (float *)data.data;
+  for (int done = 0; done < int(data.size); done += OPL3_CHUNK_FRAMES)
   {
-    memset(p_output, 0, frame_count * ma_get_bytes_per_frame(p_device->playback.format, p_device->playback.channels));
-    return;
+    int n = min(int(data.size) - done, OPL3_CHUNK_FRAMES);
+    opl3_generate_float(&chip, chunk, n);
+    mix_stereo_to_mono(chunk, dst + done, n);
   }
+}
 
-  fill_buffer_cb((float *)p_output, OUTPUT_SAMPLE_RATE, p_device->playback.channels, frame_count);
+// left channel as raw int16 bits, what medialib/opl3.das used to produce through a temporary stereo array
+void opl3_generate_mono_s16(opl3_chip & chip, TArray<uint16_t> & data)
+{
+  int16_t buf[OPL3_CHUNK_FRAMES * 2];
+  uint16_t * dst = (uint16_t *)data.data;
+  for (int done = 0; done < int(data.size); done += OPL3_CHUNK_FRAMES)
+  {
+    int n = min(int(data.size) - done, OPL3_CHUNK_FRAMES);
+    OPL3_GenerateStream(&chip, buf, uint32_t(n));
+    for (int i = 0; i < n; i++)
+      dst[done + i] = uint16_t(buf[i * 2]);
+  }
 }
 
-void init_sound_lib_internal()
+// renders frames into the sound starting at frame_offset, in any channel count and sample format
+void opl3_generate_sound_range(opl3_chip & chip, PcmSound & sound, int frame_offset, int frames)
 {
-  if (device_initialized)
+  if (!sound.getData())
     return;
 
-  ma_log_init(nullptr, &ma_log_struct);
-  ma_log_register_callback(&ma_log_struct, {on_error_log, nullptr});
+  int count = clip_sound_range(sound, frame_offset, frames);
+  prepare_opl3_resample_filter(chip.samplerate);
+  float chunk[OPL3_CHUNK_FRAMES * 2];
+  for (int done = 0; done < count; done += OPL3_CHUNK_FRAMES)
+  {
+    int n = min(count - done, OPL3_CHUNK_FRAMES);
+    opl3_generate_float(&chip, chunk, n);
+    write_sound_frames(sound, frame_offset + done, n, chunk, 2);
+  }
+}
 
-  ma_context_init(NULL, 0, NULL, &audio_context);
-  audio_context.pLog = &ma_log_struct;
+void opl3_generate_sound(opl3_chip & chip, PcmSound & sound)
+{
+  opl3_generate_sound_range(chip, sound, 0, sound.getSamples());
+}
 
-  ma_device_config deviceConfig;
 
-  deviceConfig = ma_device_config_init(ma_device_type_playback);
-  deviceConfig.playback.format = ma_format_f32;
-  deviceConfig.playback.channels = OUTPUT_CHANNELS;
-  deviceConfig.sampleRate = OUTPUT_SAMPLE_RATE;
-  deviceConfig.dataCallback = miniaudio_data_callback;
-  deviceConfig.pUserData = nullptr;
+// applies the whole batch now, delays are ignored
+void opl3_write_regs(opl3_chip & chip, const TArray<Opl3RegWrite> & writes)
+{
+  for (uint32_t i = 0; i < writes.size; i++)
+    OPL3_WriteReg(&chip, uint16_t(writes[i].reg & 0x1ff), writes[i].value);
+}
 
-  if (ma_device_init(&audio_context, &deviceConfig, &miniaudio_device) != MA_SUCCESS)
+// queues the batch in the chip writebuf, the first delay counts from the last buffered write (or now)
+void opl3_write_regs_buffered(opl3_chip & chip, const TArray<Opl3RegWrite> & writes)
+{
+  uint64_t base = max(chip.writebuf_samplecnt, chip.writebuf_lasttime);
+  int64_t delay = 0;
+  for (uint32_t i = 0; i < writes.size; i++)
   {
-    LOG(LogLevel::error) << "SOUND: Failed to open playback device";
-    return;
+    delay += max(writes[i].delay, 0);
+    uint64_t time = base + (chip.rateratio > 0 ? uint64_t(delay << OPL3_RSM_FRAC) / uint64_t(chip.rateratio) : 0);
+    opl3_write_reg_at(&chip, time, uint16_t(writes[i].reg & 0x1ff), writes[i].value);
   }
+}
 
-  LOG() << "Sound device name: " << miniaudio_device.playback.name;
+// queues the batch for the OPL3 voice starting at frame (< 0 - now), returns the number of writes queued
+int write_opl3_regs_at(PlayingSoundHandle handle, int64_t frame, const TArray<Opl3RegWrite> & writes)
+{
+  lock_guard<mutex> lock(opl3_voices_cs);
+  Opl3Source * opl = find_opl3_voice(handle);
+  if (!opl)
+    return 0;
+
+  if (frame < 0)
+    frame = opl->renderFrame.load(memory_order_acquire);
+  for (uint32_t i = 0; i < writes.size; i++)
+  {
+    frame += max(writes[i].delay, 0);
+    if (!opl->queueRegWrite(frame, uint16_t(writes[i].reg & 0x1ff), writes[i].value))
+      return int(i);
+  }
+  return int(writes.size);
+}
+
+int write_opl3_regs(PlayingSoundHandle handle, const TArray<Opl3RegWrite> & writes)
+{
+  return write_opl3_regs_at(handle, -1, writes);
+}
+
+static void prepare_opl3_group_filters(const TArray<opl3_chip *> & chips)
+{
+  for (uint32_t i = 0; i < chips.size; i++)
+    if (chips[i])
+      prepare_opl3_resample_filter(chips[i]->samplerate);
+}
+
+// renders the chips in parallel and mixes them in chip order, null chips are skipped
+void opl3_generate_group(const TArray<opl3_chip *> & chips, TArray<float2> & data)
+{
+  prepare_opl3_group_filters(chips);
+  opl3_generate_group_float((opl3_chip * const *)chips.data, nullptr, int(chips.size), (float *)data.data, int(data.size));
+}
 
-  if (ma_device_start(&miniaudio_device) != MA_SUCCESS)
+void opl3_generate_group_gains(const TArray<opl3_chip *> & chips, const TArray<float> & gains, TArray<float2> & data)
+{
+  if (gains.size != chips.size)
   {
-    LOG(LogLevel::error) << "SOUND: Failed to start playback device";
-    ma_device_uninit(&miniaudio_device);
+    LOG(LogLevel::error) << "OPL3_GenerateStreamGroup: " << gains.size << " gains for " << chips.size << " chips";
     return;
   }
-
-  device_initialized = true;
+  prepare_opl3_group_filters(chips);
+  opl3_generate_group_float((opl3_chip * const *)chips.data, (const float *)gains.data, int(chips.size), (float *)data.data, int(data.size));
 }
 
-void print_debug_infos(int from_frame)
+// bytes of an OPL3_SaveState snapshot of the chip
+int opl3_state_size(const opl3_chip & chip)
 {
-  for (auto && dbg : dbg_pointers)
-    if (dbg && dbg->creationFrame >= from_frame)
-      LOG() << "  sound: " << dbg->name;
+  return int(OPL3_SaveState(&chip, nullptr, 0));
 }
 
-void initialize()
+// returns the snapshot size, nothing is written when data is smaller than that
+int opl3_save_state(const opl3_chip & chip, TArray<uint8_t> & data)
 {
-  memset(&playing_sounds[0], 0, sizeof(playing_sounds[0]) * playing_sounds.size());
+  return int(OPL3_SaveState(&chip, (uint8_t *)data.data, data.size));
 }
 
-void finalize()
+// false (the chip is left as it was) when data is not a snapshot of this emulator version
+bool opl3_restore_state(opl3_chip & chip, const TArray<uint8_t> & data)
 {
-  device_initialized = false;
-  lock_guard<mutex> lock(sound_cs);
-  ma_device_uninit(&miniaudio_device);
+  return OPL3_RestoreState(&chip, (const uint8_t *)data.data, data.size) != 0;
 }
 
+// threads rendering a chip group, including the calling one (1 - serial, 0 - one per core)
+void set_opl3_render_threads(int count)
+{
+  lock_guard<mutex> lock(opl3_group_cs);
+  stop_opl3_pool();
+  opl3_render_threads = max(count, 0);
+}
 
-PcmSound create_sound(int frequency, const TArray<float> & data)
+PlayingSoundHandle play_sound_opl_music_internal(const char * file_name, float volume, float pitch, float pan, bool loop)
 {
   if (!device_initialized)
     init_sound_lib_internal();
 
-  if (frequency < 1 || !data.size)
-    return PcmSound();
+  collect_retired_sources(true);
 
-  PcmSound s;
-  s.frequency = frequency;
-  s.channels = 1;
-  s.samples = data.size;
-  s.newData(s.getDataMemorySize());
-  memcpy(s.getData(), data.data, s.getDataMemorySize());
-  s.getData()[data.size] = s.getData()[0];
+  if (!file_name || !file_name[0])
+  {
+    LOG(LogLevel::error) << "Cannot play OPL music. File name is empty.";
+    return PlayingSoundHandle();
+  }
 
-  s.dbg = new DasboxDebugInfo();
-  snprintf(s.dbg->name, sizeof(s.dbg->name) - 1, "mono %d smpl @%d", s.samples, s.frequency);
-  dbg_pointers.insert(s.dbg);
+  OplMusicSource * music = new OplMusicSource();
+  if (!music->open(file_name, OUTPUT_SAMPLE_RATE, loop ? -1 : 0))
+  {
+    delete music;
+    return PlayingSoundHandle();
+  }
 
-  return s;
+  lock_guard<mutex> lock(sound_cs);
+  PlayingSoundHandle res = start_source_voice(music, volume, pitch, pan);
+  if (res.handle)
+  {
+    lock_guard<mutex> voicesLock(opl_music_voices_cs);
+    music->handle = res.handle;
+    opl_music_voices.push_back(music);
+  }
+  return res;
 }
 
-PcmSound create_sound_stereo(int frequency, const TArray<float2> & data)
+PlayingSoundHandle play_sound_opl_music_1(const char * file_name)
 {
-  if (!device_initialized)
-    init_sound_lib_internal();
-
-  if (frequency < 1 || !data.size)
-    return PcmSound();
+  return play_sound_opl_music_internal(file_name, 1.0f, 1.0f, 0.0f, false);
+}
 
-  PcmSound s;
-  s.frequency = frequency;
-  s.channels = 2;
-  s.samples = data.size;
-  s.newData(s.getDataMemorySize());
-  memcpy(s.getData(), data.data, s.getDataMemorySize());
-  s.getData()[s.samples * 2] = s.getData()[0];
-  s.getData()[s.samples * 2 + 1] = s.getData()[1];
+PlayingSoundHandle play_sound_opl_music_2(const char * file_name, float volume)
+{
+  return play_sound_opl_music_internal(file_name, volume, 1.0f, 0.0f, false);
+}
 
-  s.dbg = new DasboxDebugInfo();
-  snprintf(s.dbg->name, sizeof(s.dbg->name) - 1, "stereo %d smpl @%d", s.samples, s.frequency);
-  dbg_pointers.insert(s.dbg);
+PlayingSoundHandle play_sound_opl_music_3(const char * file_name, float volume, float pitch)
+{
+  return play_sound_opl_music_internal(file_name, volume, pitch, 0.0f, false);
+}
 
-  return s;
+PlayingSoundHandle play_sound_opl_music_4(const char * file_name, float volume, float pitch, float pan)
+{
+  return play_sound_opl_music_internal(file_name, volume, pitch, pan, false);
 }
 
+PlayingSoundHandle play_sound_opl_music_loop_1(const char * file_name)
+{
+  return play_sound_opl_music_internal(file_name, 1.0f, 1.0f, 0.0f, true);
+}
 
-PcmSound create_sound_from_file(const char * file_name)
+PlayingSoundHandle play_sound_opl_music_loop_2(const char * file_name, float volume)
 {
-  if (!device_initialized)
-    init_sound_lib_internal();
+  return play_sound_opl_music_internal(file_name, volume, 1.0f, 0.0f, true);
+}
 
-  if (!file_name || !file_name[0])
-  {
-    LOG(LogLevel::error) << "Cannot create sound. File name is empty. '" << file_name << "'";
-    return PcmSound();
-  }
+PlayingSoundHandle play_sound_opl_music_loop_3(const char * file_name, float volume, float pitch)
+{
+  return play_sound_opl_music_internal(file_name, volume, pitch, 0.0f, true);
+}
 
-/*
-  if (!fs::is_path_string_valid(file_name))
-  {
-    LOG(LogLevel::error) << "Cannot open sound '" << file_name << "'. Absolute paths or access to the parent directory is prohibited.";
-    return PcmSound();
-  }
-  */
+PlayingSoundHandle play_sound_opl_music_loop_4(const char * file_name, float volume, float pitch, float pan)
+{
+  return play_sound_opl_music_internal(file_name, volume, pitch, pan, true);
+}
 
-  PcmSound s;
+// playback speed of the events (1 - as stored), unlike pitch it does not change the notes; false when there is no such voice
+bool set_opl_music_tempo(PlayingSoundHandle handle, float tempo)
+{
+  lock_guard<mutex> lock(opl_music_voices_cs);
+  OplMusicSource * music = find_opl_music_voice(handle);
+  if (!music)
+    return false;
+  music->tempo.store(tempo > 0.0f ? tempo : 1.0f, memory_order_relaxed);
+  return true;
+}
 
-  unsigned int channels;
-  unsigned int sampleRate;
-  drwav_uint64 totalPCMFrameCount;
-  float * pSampleData = nullptr;
+// jumps to a song position in seconds at tempo 1 (loops count on), false when there is no such voice;
+// the position is rendered on the calling thread, exactly up to the keyframes built so far (each call adds up to
+// OPL_MUSIC_SEEK_BUILD_SECONDS of them), later positions are fast-forwarded to
+bool seek_opl_music(PlayingSoundHandle handle, float seconds)
+{
+  lock_guard<mutex> lock(opl_music_voices_cs);
+  OplMusicSource * music = find_opl_music_voice(handle);
+  if (!music)
+    return false;
+  OplMusicPlayer * player = music->prepareSeek(max(double(seconds), 0.0));
+  delete music->pending.exchange(player, memory_order_acq_rel); // a seek the mixer did not take yet is replaced
+  return true;
+}
 
-  const char * p = strrchr(file_name, '.');
-  if (p && !stricmp(p, ".wav") && !p[4])
-    pSampleData = drwav_open_file_and_read_pcm_frames_f32(file_name, &channels, &sampleRate, &totalPCMFrameCount, nullptr);
-  else if (p && !stricmp(p, ".mp3") && !p[4])
-  {
-    drmp3_config config = { 0 };
-    pSampleData = drmp3_open_file_and_read_pcm_frames_f32(file_name, &config, &totalPCMFrameCount, nullptr);
-    channels = config.channels;
-    sampleRate = config.sampleRate;
-  }
-  else if (p && !stricmp(p, ".flac") && !p[4])
-    pSampleData = drwav_open_file_and_read_pcm_frames_f32(file_name, &channels, &sampleRate, &totalPCMFrameCount, nullptr);
-  else
+// renders the song offline, loops - how many times the loop is repeated after the first pass
+PcmSound bake_opl_music_3(const char * file_name, int loops, float tempo)
+{
+  if (!file_name || !file_name[0])
   {
-    LOG(LogLevel::error) << "Cannot create sound from '" << file_name << "', unrecognized file format. Expected .wav, .flac or .mp3";
+    LOG(LogLevel::error) << "Cannot bake OPL music. File name is empty.";
     return PcmSound();
   }
 
-  if (!pSampleData)
-  {
-    LOG(LogLevel::error) << "Cannot create sound from '" << file_name << "'";
+  OplMusic music;
+  if (!open_opl_music(file_name, music))
     return PcmSound();
-  }
+  prepare_opl3_resample_filter(OUTPUT_SAMPLE_RATE);
+  OplMusicPlayer * player = new OplMusicPlayer();
+  player->open(music, OUTPUT_SAMPLE_RATE, max(loops, 0), nullptr);
+  player->setTempo(tempo > 0.0f ? tempo : 1.0f);
 
-  if (channels != 1 && channels != 2)
+  int64_t frames = player->countFrames();
+  if (frames < 1 || frames > INT32_MAX - 4)
   {
-    LOG(LogLevel::error) << "Cannot create sound from '" << file_name << "', invalid channels count =" << int(channels);
+    LOG(LogLevel::error) << "Cannot bake OPL music '" << file_name << "', " << frames << " frames";
+    delete player;
     return PcmSound();
   }
 
-  s.channels = int(channels);
-  s.frequency = int(sampleRate);
-  s.samples = int(totalPCMFrameCount);
-  s.newData(s.getDataMemorySize());
-  memcpy(s.getData(), pSampleData, channels * s.samples * sizeof(float));
-  if (s.channels == 2)
-  {
-    s.getData()[s.samples * 2] = s.getData()[0];
-    s.getData()[s.samples * 2 + 1] = s.getData()[1];
-  }
-  else
+  PcmSound s = create_sound_uninitialized(OUTPUT_SAMPLE_RATE, int(frames), 2);
+  if (s.getData())
   {
-    s.getData()[s.samples] = s.getData()[0];
+    float * dst = (float *)s.getData();
+    int got = player->render(dst, int(frames));
+    memset(dst + size_t(got) * 2, 0, size_t(frames - got) * 2 * sizeof(float));
+    update_wrap_frame(s);
   }
-
-  drwav_free(pSampleData, NULL);
-
-  s.dbg = new DasboxDebugInfo();
-  snprintf(s.dbg->name, sizeof(s.dbg->name) - 1, "%s", file_name);
-  dbg_pointers.insert(s.dbg);
-
+  delete player;
   return s;
 }
 
-
-void get_sound_data(const PcmSound & sound, TArray<float> & out_data)
+PcmSound bake_opl_music_1(const char * file_name)
 {
-  if (!sound.getData())
-    return;
-
-  int count = sound.samples;
-  if (count > int(out_data.size))
-    count = int(out_data.size);
+  return bake_opl_music_3(file_name, 0, 1.0f);
+}
 
-  if (count)
-  {
-    if (sound.channels == 1)
-      memcpy(out_data.data, sound.getData(), count * sizeof(float));
-    else if (sound.channels == 2)
-    {
-      float * __restrict ptr = (float *)out_data.data;
-      float * __restrict soundData = (float *)sound.getData();
-      for (int i = 0; i < count; i++)
-        ptr[i] = (soundData[i * 2] + soundData[i * 2 + 1]) * 0.5f;
-    }
-  }
+static void read_op2_voice(const uint8_t * p, OplInstrumentVoice & voice)
+{
+  voice.mod = { p[0], uint8_t(p[4] | p[5]), p[1], p[2], p[3] };
+  voice.regC0 = p[6];
+  voice.car = { p[7], uint8_t(p[11] | p[12]), p[8], p[9], p[10] };
+  voice.noteOffset = int16_t(read_le(p + 14, 2));
 }
 
-void get_sound_data_stereo(const PcmSound & sound, TArray<float2> & out_data)
+// the 16 instrument bytes of SBI and IBK files
+static void read_sbi_instrument(const uint8_t * p, OplInstrument & instrument)
 {
-  if (!sound.getData())
-    return;
+  instrument = OplInstrument();
+  instrument.valid = true;
+  instrument.voice[0].mod = { p[0], p[2], p[4], p[6], p[8] };
+  instrument.voice[0].car = { p[1], p[3], p[5], p[7], p[9] };
+  instrument.voice[0].regC0 = p[10];
+}
 
-  int count = sound.samples;
-  if (count > int(out_data.size))
-    count = int(out_data.size);
+// OP2 / GENMIDI (175 instruments, percussion for notes 35..81) or IBK (128 melodic instruments),
+// used by MIDI voices and files started after the call
+bool load_opl_midi_bank(const char * file_name)
+{
+  SoundFileMapping * m = file_name && file_name[0] ? map_sound_file(file_name) : nullptr;
+  if (!m)
+  {
+    LOG(LogLevel::error) << "Cannot open OPL instrument bank '" << (file_name ? file_name : "") << "'";
+    return false;
+  }
 
-  if (count)
+  const uint8_t * p = (const uint8_t *)m->base;
+  OplMidiBank * bank = new OplMidiBank();
+  set_default_opl_midi_bank(*bank);
+  bool ok = true;
+  if (m->size >= 8 + 175 * 36 && !memcmp(p, "#OPL_II#", 8))
   {
-    if (sound.channels == 2)
-      memcpy(out_data.data, sound.getData(), count * sizeof(float) * 2);
-    else if (sound.channels == 1)
+    for (int i = 0; i < 175; i++)
     {
-      float * __restrict ptr = (float *)out_data.data;
-      float * __restrict soundData = (float *)sound.getData();
-      for (int i = 0; i < count; i++)
-      {
-        ptr[i * 2] = soundData[i];
-        ptr[i * 2 + 1] = soundData[i];
-      }
+      const uint8_t * r = p + 8 + i * 36;
+      OplInstrument & instrument = bank->instruments[i < 128 ? i : 128 + 35 + (i - 128)];
+      uint16_t flags = uint16_t(read_le(r, 2));
+      instrument = OplInstrument();
+      instrument.valid = true;
+      instrument.fixedNote = (flags & 0x01) != 0;
+      instrument.doubleVoice = (flags & 0x04) != 0;
+      instrument.detune = (float(r[2] / 2) - 64.0f) / 32.0f;
+      instrument.note = r[3];
+      read_op2_voice(r + 4, instrument.voice[0]);
+      read_op2_voice(r + 20, instrument.voice[1]);
     }
   }
-}
-
-void set_sound_data(PcmSound & sound, const TArray<float> & in_data)
-{
-  if (!sound.getData())
-    return;
-
-  int count = sound.samples;
-  if (count > int(in_data.size))
-    count = int(in_data.size);
-
-  if (!count)
-    return;
-
-  if (sound.channels == 1)
+  else if (m->size >= 4 + 128 * 16 && !memcmp(p, "IBK\x1A", 4))
   {
-    memcpy(sound.getData(), in_data.data, count * sizeof(float));
-    sound.getData()[sound.samples] = sound.getData()[0];
+    for (int i = 0; i < 128; i++)
+      read_sbi_instrument(p + 4 + i * 16, bank->instruments[i]);
   }
-  else if (sound.channels == 2)
+  else
   {
-    float * __restrict ptr = (float *)in_data.data;
-    float * __restrict soundData = (float *)sound.getData();
-    for (int i = 0; i < count; i++)
-    {
-      soundData[i * 2] = ptr[i];
-      soundData[i * 2 + 1] = ptr[i];
-    }
-    soundData[sound.samples * 2] = soundData[0];
-    soundData[sound.samples * 2 + 1] = soundData[1];
+    LOG(LogLevel::error) << "Cannot load OPL instrument bank '" << file_name << "', expected OP2 (GENMIDI) or IBK";
+    ok = false;
+  }
+  unmap_sound_file(m);
+
+  if (ok)
+  {
+    lock_guard<mutex> lock(opl_midi_bank_cs);
+    swap(opl_midi_bank, bank);
   }
+  delete bank;
+  return ok;
 }
 
-void set_sound_data_stereo(PcmSound & sound, const TArray<float2> & in_data)
+// program 0..127 - melodic, 128 + note - percussion
+bool load_opl_midi_instrument(int program, const char * file_name)
 {
-  if (!sound.getData())
-    return;
-
-  int count = sound.samples;
-  if (count > int(in_data.size))
-    count = int(in_data.size);
-
-  if (!count)
-    return;
-
-  if (sound.channels == 1)
+  if (program < 0 || program > 255)
   {
-    float * __restrict ptr = (float *)in_data.data;
-    float * __restrict soundData = (float *)sound.getData();
-    for (int i = 0; i < count; i++)
-      soundData[i] = (ptr[i * 2] + ptr[i * 2 + 1]) * 0.5f;
-
-    sound.getData()[sound.samples] = sound.getData()[0];
+    LOG(LogLevel::error) << "Cannot load OPL instrument '" << (file_name ? file_name : "") << "', program " << program << " is out of range 0..255";
+    return false;
   }
-  else if (sound.channels == 2)
+  SoundFileMapping * m = file_name && file_name[0] ? map_sound_file(file_name) : nullptr;
+  if (!m)
   {
-    memcpy(sound.getData(), in_data.data, 2 * count * sizeof(float));
-    sound.getData()[sound.samples * 2] = sound.getData()[0];
-    sound.getData()[sound.samples * 2 + 1] = sound.getData()[1];
+    LOG(LogLevel::error) << "Cannot open OPL instrument '" << (file_name ? file_name : "") << "'";
+    return false;
   }
-}
-
-void delete_sound(PcmSound * sound)
-{
-  lock_guard<mutex> lock(sound_cs);
-
-  for (auto && s : playing_sounds)
-    if (s.sound == sound)
-      if (!s.isEmpty())
-        s.setStopMode();
 
-  sound->deleteData();
-  sound->data = nullptr;
-  sound->samples = 0;
+  bool ok = m->size >= 36 + 16 && !memcmp(m->base, "SBI\x1A", 4);
+  if (ok)
+  {
+    lock_guard<mutex> lock(opl_midi_bank_cs);
+    if (!opl_midi_bank)
+    {
+      opl_midi_bank = new OplMidiBank();
+      set_default_opl_midi_bank(*opl_midi_bank);
+    }
+    read_sbi_instrument((const uint8_t *)m->base + 36, opl_midi_bank->instruments[program]);
+  }
+  else
+    LOG(LogLevel::error) << "Cannot load OPL instrument '" << file_name << "', expected SBI";
+  unmap_sound_file(m);
+  return ok;
 }
 
-void delete_allocated_sounds()
+void reset_opl_midi_bank()
 {
-  lock_guard<mutex> lock(sound_cs);
-  for (auto && data : sound_data_pointers)
-    delete[] data;
-
-  sound_data_pointers.clear();
-
-  for (auto && dbg : dbg_pointers)
-    delete dbg;
-
-  dbg_pointers.clear();
-
-  memory_used = 0;
+  lock_guard<mutex> lock(opl_midi_bank_cs);
+  delete opl_midi_bank;
+  opl_midi_bank = nullptr;
 }
 
-
-PlayingSoundHandle play_sound_internal(const PcmSound & sound, float volume, float pitch, float pan, float start_time, float end_time,
-                                       bool loop, float defer_time_sec)
+// MIDI message for the General MIDI synth of the OPL3 voice (the synth takes the chip over: OPL3 mode, all 18 channels),
+// frame is in voice frames (get_opl3_time), < 0 - now; false when the queue is full
+bool send_opl3_midi_at(PlayingSoundHandle handle, int64_t frame, uint8_t status, uint8_t data1, uint8_t data2)
 {
-  if (!device_initialized)
-    init_sound_lib_internal();
-
-  lock_guard<mutex> lock(sound_cs);
-
-  int idx = allocate_playing_sound();
-  if (idx < 0 || sound.samples <= 2)
-    return PlayingSoundHandle();
-
-  PlayingSound & s = playing_sounds[idx];
-
-  pitch = clamp(pitch, 0.00001f, 1000.0f);
-  pan = clamp(pan, -1.0f, 1.0f);
-  volume = clamp(volume, 0.0f, 100000.0f);
-
-  double start = clamp(double(int64_t(start_time * sound.frequency)), 0.0, double(sound.samples - 1));
-  double stop = clamp(double(int64_t(end_time * sound.frequency)), start, double(sound.samples - 1));
-  double pos = start;
-  if (defer_time_sec < 0.0f)
-    pos = min(double(int(-defer_time_sec * sound.frequency)), stop);
-
-  s.channels = sound.channels;
-  s.sound = &sound;
-  s.volume = volume;
-  s.pitch = pitch;
-  s.pan = pan;
-  s.volumeL = master_volume * volume * min(1.0f + pan, 1.0f);
-  s.volumeR = master_volume * volume * min(1.0f - pan, 1.0f);
-
-  s.pos = pos;
-  s.startPos = start;
-  s.stopPos = stop;
-  s.loop = loop;
-  s.stopMode = false;
-  s.timeToStart = max(defer_time_sec, 0.0f);
-  s.waitingStart = (s.timeToStart != 0.0);
-
-  PlayingSoundHandle res;
-  res.handle = idx | s.version;
-
-  return res;
+  if (status < 0x80 || status >= 0xF0)
+    return false;
+  lock_guard<mutex> lock(opl3_voices_cs);
+  Opl3Source * opl = find_opl3_voice(handle);
+  return opl && opl->queueMidi(frame, status, data1, data2);
 }
 
-
-PlayingSoundHandle play_sound_1(const PcmSound & sound)
+bool send_opl3_midi(PlayingSoundHandle handle, uint8_t status, uint8_t data1, uint8_t data2)
 {
-  return play_sound_internal(sound, 1.0f, 1.0f, 0.0f, 0.0f, VERY_BIG_NUMBER, false, 0.0f);
+  return send_opl3_midi_at(handle, -1, status, data1, data2);
 }
 
-PlayingSoundHandle play_sound_2(const PcmSound & sound, float volume)
+static void get_opl_midi_instrument(int program, OplInstrument & instrument)
 {
-  return play_sound_internal(sound, volume, 1.0f, 0.0f, 0.0f, VERY_BIG_NUMBER, false, 0.0f);
+  lock_guard<mutex> lock(opl_midi_bank_cs);
+  if (!opl_midi_bank)
+  {
+    opl_midi_bank = new OplMidiBank();
+    set_default_opl_midi_bank(*opl_midi_bank);
+  }
+  instrument = opl_midi_bank->instruments[program];
 }
 
-PlayingSoundHandle play_sound_3(const PcmSound & sound, float volume, float pitch)
+// the pool while its voice plays; a voice stopped by stop_all_sounds or stop_sound leaves the pool
+// to collect_retired_sources and the next note starts a new one
+static FmPoolSource * get_fm_pool() // sound_cs and fm_pool_cs must be held
 {
-  return play_sound_internal(sound, volume, pitch, 0.0f, 0.0f, VERY_BIG_NUMBER, false, 0.0f);
+  int idx = fm_pool ? handle_to_index(fm_pool_voice) : -1;
+  if (idx < 0 || playing_sounds[idx].stopMode)
+    fm_pool = nullptr;
+  return fm_pool;
 }
 
-PlayingSoundHandle play_sound_4(const PcmSound & sound, float volume, float pitch, float pan)
+static bool start_fm_pool()
 {
-  return play_sound_internal(sound, volume, pitch, pan, 0.0f, VERY_BIG_NUMBER, false, 0.0f);
+  lock_guard<mutex> createLock(fm_pool_create_cs);
+  collect_retired_sources(true); // a stopped pool unregisters itself when it is deleted
+  {
+    lock_guard<mutex> lock(sound_cs);
+    lock_guard<mutex> poolLock(fm_pool_cs);
+    if (get_fm_pool())
+      return true;
+  }
+
+  if (!device_initialized)
+    init_sound_lib_internal();
+
+  FmPoolSource * pool = new FmPoolSource();
+  pool->init(OUTPUT_SAMPLE_RATE);
+
+  lock_guard<mutex> lock(sound_cs);
+  PlayingSoundHandle voice = start_source_voice(pool, 1.0f, 1.0f, 0.0f);
+  if (!voice.handle)
+    return false;
+  lock_guard<mutex> poolLock(fm_pool_cs);
+  fm_pool_voice = voice;
+  pool->appliedNote.store(fm_note_counter, memory_order_relaxed); // handles of an earlier pool are not pending here
+  fm_pool = pool;
+  return true;
 }
 
-PlayingSoundHandle play_sound_5(const PcmSound & sound, float volume, float pitch, float pan, float start_time, float end_time)
+static bool queue_fm_note_command(const FmNoteCommand & c)
 {
-  return play_sound_internal(sound, volume, pitch, pan, start_time, end_time, false, 0.0f);
+  lock_guard<mutex> lock(sound_cs);
+  lock_guard<mutex> poolLock(fm_pool_cs);
+  FmPoolSource * pool = get_fm_pool();
+  return pool && pool->queueCommand(c);
 }
 
-PlayingSoundHandle play_sound_loop_1(const PcmSound & sound)
+// program 0..127 - melodic instrument of the OPL MIDI bank, 128 + note - percussion; note is a MIDI note number (69 - 440 Hz),
+// duration in seconds, <= 0 - the note is held until stop_fm_note
+FmNoteHandle play_fm_note_4(int program, float note, float volume, float duration)
 {
-  return play_sound_internal(sound, 1.0f, 1.0f, 0.0f, 0.0f, VERY_BIG_NUMBER, true, 0.0f);
+  if (program < 0 || program > 255)
+  {
+    LOG(LogLevel::error) << "Cannot play FM note, program " << program << " is out of range 0..255";
+    return FmNoteHandle();
+  }
+
+  FmNoteCommand c;
+  c.type = FmNoteCommandType::play;
+  c.value = note;
+  c.volume = max(volume, 0.0f);
+  c.duration = duration;
+  get_opl_midi_instrument(program, c.instrument);
+  if (!c.instrument.valid || !start_fm_pool())
+    return FmNoteHandle();
+
+  lock_guard<mutex> lock(sound_cs);
+  lock_guard<mutex> poolLock(fm_pool_cs);
+  FmPoolSource * pool = get_fm_pool();
+  if (!pool)
+    return FmNoteHandle();
+  uint32_t id = fm_note_counter + 1;
+  c.note = id ? id : 1;
+  if (!pool->queueCommand(c))
+  {
+    LOG(LogLevel::error) << "Cannot play FM note, the command queue is full";
+    return FmNoteHandle();
+  }
+  fm_note_counter = c.note;
+
+  FmNoteHandle res;
+  res.handle = c.note;
+  return res;
 }
 
-PlayingSoundHandle play_sound_loop_2(const PcmSound & sound, float volume)
+FmNoteHandle play_fm_note_2(int program, float note)
 {
-  return play_sound_internal(sound, volume, 1.0f, 0.0f, 0.0f, VERY_BIG_NUMBER, true, 0.0f);
+  return play_fm_note_4(program, note, 1.0f, 0.0f);
 }
 
-PlayingSoundHandle play_sound_loop_3(const PcmSound & sound, float volume, float pitch)
+FmNoteHandle play_fm_note_3(int program, float note, float volume)
 {
-  return play_sound_internal(sound, volume, pitch, 0.0f, 0.0f, VERY_BIG_NUMBER, true, 0.0f);
+  return play_fm_note_4(program, note, volume, 0.0f);
 }
 
-PlayingSoundHandle play_sound_loop_4(const PcmSound & sound, float volume, float pitch, float pan)
+// releases the note, it is playing until the release ends
+bool stop_fm_note(FmNoteHandle handle)
 {
-  return play_sound_internal(sound, volume, pitch, pan, 0.0f, VERY_BIG_NUMBER, true, 0.0f);
+  FmNoteCommand c;
+  c.type = FmNoteCommandType::stop;
+  c.note = handle.handle;
+  return handle.handle && queue_fm_note_command(c);
 }
 
-PlayingSoundHandle play_sound_loop_5(const PcmSound & sound, float volume, float pitch, float pan, float start_time, float end_time)
+void stop_all_fm_notes()
 {
-  return play_sound_internal(sound, volume, pitch, pan, start_time, end_time, true, 0.0f);
+  FmNoteCommand c;
+  c.type = FmNoteCommandType::stopAll;
+  queue_fm_note_command(c);
 }
 
-
-PlayingSoundHandle play_sound_deferred_1(const PcmSound & sound, float defer_seconds)
+// note number, fractional for slides and vibrato
+bool set_fm_note_pitch(FmNoteHandle handle, float note)
 {
-  return play_sound_internal(sound, 1.0f, 1.0f, 0.0f, 0.0f, VERY_BIG_NUMBER, false, defer_seconds);
+  FmNoteCommand c;
+  c.type = FmNoteCommandType::pitch;
+  c.note = handle.handle;
+  c.value = note;
+  return handle.handle && queue_fm_note_command(c);
 }
 
-PlayingSoundHandle play_sound_deferred_2(const PcmSound & sound, float defer_seconds, float volume)
+bool set_fm_note_volume(FmNoteHandle handle, float volume)
 {
-  return play_sound_internal(sound, volume, 1.0f, 0.0f, 0.0f, VERY_BIG_NUMBER, false, defer_seconds);
+  FmNoteCommand c;
+  c.type = FmNoteCommandType::volume;
+  c.note = handle.handle;
+  c.value = max(volume, 0.0f);
+  return handle.handle && queue_fm_note_command(c);
 }
 
-PlayingSoundHandle play_sound_deferred_3(const PcmSound & sound, float defer_seconds, float volume, float pitch)
+// false after the release ended or the note was taken by a newer one
+bool is_fm_note_playing(FmNoteHandle handle)
 {
-  return play_sound_internal(sound, volume, pitch, 0.0f, 0.0f, VERY_BIG_NUMBER, false, defer_seconds);
+  lock_guard<mutex> lock(sound_cs);
+  lock_guard<mutex> poolLock(fm_pool_cs);
+  FmPoolSource * pool = get_fm_pool();
+  return pool && handle.handle && pool->isPlaying(handle.handle);
 }
 
-PlayingSoundHandle play_sound_deferred_4(const PcmSound & sound, float defer_seconds, float volume, float pitch, float pan)
+// chips the pool may use (1..16, 18 notes each), notes that already play on the chips past the limit are kept
+void set_fm_pool_chips(int count)
 {
-  return play_sound_internal(sound, volume, pitch, pan, 0.0f, VERY_BIG_NUMBER, false, defer_seconds);
+  fm_pool_max_chips.store(clamp(count, 1, FM_POOL_MAX_CHIPS), memory_order_relaxed);
 }
 
-PlayingSoundHandle play_sound_deferred_5(const PcmSound & sound, float defer_seconds, float volume, float pitch, float pan,
-  float start_time, float end_time)
+// chips with sounding notes, the ones that were rendered by the last mixer block
+int get_fm_pool_active_chips()
 {
-  return play_sound_internal(sound, volume, pitch, pan, start_time, end_time, false, defer_seconds);
+  lock_guard<mutex> lock(sound_cs);
+  lock_guard<mutex> poolLock(fm_pool_cs);
+  FmPoolSource * pool = get_fm_pool();
+  return pool ? pool->activeCount.load(memory_order_relaxed) : 0;
 }
 
 
@@ -1076,24 +6887,40 @@ float get_sound_play_pos(PlayingSoundHandle handle)
   if (idx < 0)
     return 0.0f;
 
-  if (!playing_sounds[idx].sound || playing_sounds[idx].stopMode || playing_sounds[idx].waitingStart)
+  PlayingSound & s = playing_sounds[idx];
+  if (s.source && !s.stopMode)
+    return float(s.source->tell(s.source->windowFrames - s.pos) / s.source->frequency);
+
+  if (!s.buffer || s.stopMode || s.waitingStart)
     return 0.0f;
 
-  return float(playing_sounds[idx].pos / playing_sounds[idx].sound->frequency);
+  return float(s.pos / s.sampleRate);
 }
 
 void set_sound_play_pos(PlayingSoundHandle handle, float pos_seconds)
 {
+  if (seek_opl_music(handle, pos_seconds)) // rendered on this thread and handed over, the buffered window plays out
+    return;
+
   lock_guard<mutex> lock(sound_cs);
 
   int idx = handle_to_index(handle);
   if (idx < 0)
     return;
 
-  if (!playing_sounds[idx].sound || playing_sounds[idx].stopMode)
+  PlayingSound & s = playing_sounds[idx];
+  if (s.source && !s.stopMode)
+  {
+    s.source->resetWindow();
+    s.source->seek(int64_t(floor(s.source->frequency * double(pos_seconds))));
+    s.pos = 0.0;
+    return;
+  }
+
+  if (!playing_sounds[idx].buffer || playing_sounds[idx].stopMode)
     return;
 
-  double p = floor(playing_sounds[idx].sound->frequency * pos_seconds);
+  double p = floor(playing_sounds[idx].sampleRate * pos_seconds);
   playing_sounds[idx].pos = clamp(p, playing_sounds[idx].startPos, playing_sounds[idx].stopPos);
 }
 
@@ -1105,7 +6932,7 @@ void stop_sound(PlayingSoundHandle handle)
   if (idx < 0)
     return;
 
-  if (!playing_sounds[idx].sound || playing_sounds[idx].stopMode)
+  if ((!playing_sounds[idx].buffer && !playing_sounds[idx].source) || playing_sounds[idx].stopMode)
     return;
 
   playing_sounds[idx].setStopMode();
@@ -1161,28 +6988,32 @@ double get_total_time_played()
 
 double get_memory_used()
 {
+  lock_guard<mutex> lock(sound_data_cs);
   return double(memory_used);
 }
 
-
-PcmSound::PcmSound(PcmSound && b)
+double get_mapped_memory_used()
 {
-  lock_guard<mutex> lock(sound_cs);
+  lock_guard<mutex> lock(sound_data_cs);
+  return double(mapped_memory_used);
+}
 
-  for (auto && s : playing_sounds)
-    if (s.sound == this || s.sound == &b)
-      if (!s.isEmpty())
-        s.setStopMode();
 
+// voices reference the sample buffer, not the PcmSound, so moves need no synchronization with the mixer
+PcmSound::PcmSound(PcmSound && b)
+{
   frequency = b.frequency;
   samples = b.samples;
   channels = b.channels;
+  format = b.format;
   memoryUsed = b.memoryUsed;
   data = b.data;
+  buffer = b.buffer;
   dbg = b.dbg;
 
   b.memoryUsed = 0;
   b.data = nullptr;
+  b.buffer = nullptr;
   b.dbg = nullptr;
 }
 
@@ -1191,19 +7022,15 @@ PcmSound& PcmSound::operator=(const PcmSound & b)
   if (this == &b)
     return *this;
 
-  lock_guard<mutex> lock(sound_cs);
-
-  for (auto && s : playing_sounds)
-    if (s.sound == this)
-      if (!s.isEmpty())
-        s.setStopMode();
-
+  acquire_sound_buffer(b.buffer);
   deleteData();
   frequency = b.frequency;
   samples = b.samples;
   channels = b.channels;
-  newData(getDataMemorySize());
-  memcpy(data, b.data, getDataMemorySize());
+  format = b.format;
+  memoryUsed = b.memoryUsed;
+  data = b.data;
+  buffer = b.buffer;
   dbg = b.dbg ? new DasboxDebugInfo(*b.dbg) : nullptr;
   if (dbg)
     dbg->creationFrame = current_frame;
@@ -1215,21 +7042,18 @@ PcmSound& PcmSound::operator=(PcmSound && b)
   if (this == &b)
     return *this;
 
-  lock_guard<mutex> lock(sound_cs);
-
-  for (auto && s : playing_sounds)
-    if (s.sound == this || s.sound == &b)
-      if (!s.isEmpty())
-        s.setStopMode();
-
+  deleteData();
   frequency = b.frequency;
   samples = b.samples;
   channels = b.channels;
+  format = b.format;
   data = b.data;
+  buffer = b.buffer;
   dbg = b.dbg;
   memoryUsed = b.memoryUsed;
 
   b.data = nullptr;
+  b.buffer = nullptr;
   b.dbg = nullptr;
   b.memoryUsed = 0;
 
@@ -1242,13 +7066,6 @@ PcmSound::~PcmSound()
   if (!data)
     return;
 
-  lock_guard<mutex> lock(sound_cs);
-
-  for (auto && s : playing_sounds)
-    if (s.sound == this)
-      if (!s.isEmpty())
-        s.setStopMode();
-
   deleteData();
   samples = 0;
 }
@@ -1289,7 +7106,10 @@ struct PcmSoundAnnotation : ManagedStructureAnnotation<sound::PcmSound, true, tr
     addProperty<DAS_BIND_MANAGED_PROP(getFrequency)>("frequency");
     addProperty<DAS_BIND_MANAGED_PROP(getSamples)>("samples");
     addProperty<DAS_BIND_MANAGED_PROP(getChannels)>("channels");
+    addProperty<DAS_BIND_MANAGED_PROP(getFormat)>("format");
     addProperty<DAS_BIND_MANAGED_PROP(isValid)>("valid");
+    addProperty<DAS_BIND_MANAGED_PROP(isMapped)>("mapped");
+    addProperty<DAS_BIND_MANAGED_PROP(isShared)>("shared");
   }
 
   bool canCopy() const override { return false; }
@@ -1330,6 +7150,131 @@ struct PlayingSoundHandleAnnotation final: ManagedValueAnnotation<sound::Playing
   virtual bool canBePlacedInContainer() const override { return true; }
 };
 
+struct SoundLoadStatsAnnotation : ManagedStructureAnnotation<sound::SoundLoadStats, true, true>
+{
+  SoundLoadStatsAnnotation(ModuleLibrary & ml) : ManagedStructureAnnotation("SoundLoadStats", ml, "das::sound::SoundLoadStats")
+  {
+    addField<DAS_BIND_MANAGED_FIELD(files)>("files", "files");
+    addField<DAS_BIND_MANAGED_FIELD(failed)>("failed", "failed");
+    addField<DAS_BIND_MANAGED_FIELD(seconds)>("seconds", "seconds");
+    addField<DAS_BIND_MANAGED_FIELD(sourceMegabytes)>("source_mb", "sourceMegabytes");
+    addField<DAS_BIND_MANAGED_FIELD(decodedMegabytes)>("decoded_mb", "decodedMegabytes");
+    addField<DAS_BIND_MANAGED_FIELD(decodedMegabytesPerSecond)>("decoded_mb_per_sec", "decodedMegabytesPerSecond");
+    addField<DAS_BIND_MANAGED_FIELD(filesPerSecond)>("files_per_sec", "filesPerSecond");
+  }
+
+  bool canCopy() const override { return true; }
+  virtual bool hasNonTrivialCtor() const override { return false; }
+  virtual bool isLocal() const override { return true; }
+  virtual bool canClone() const override { return true; }
+  virtual bool canMove() const override { return true; }
+  virtual bool canNew() const override { return true; }
+  virtual bool canBePlacedInContainer() const override { return true; }
+};
+
+struct Opl3RegWriteAnnotation : ManagedStructureAnnotation<sound::Opl3RegWrite, true, true>
+{
+  Opl3RegWriteAnnotation(ModuleLibrary & ml) : ManagedStructureAnnotation("Opl3RegWrite", ml, "das::sound::Opl3RegWrite")
+  {
+    addField<DAS_BIND_MANAGED_FIELD(reg)>("reg", "reg");
+    addField<DAS_BIND_MANAGED_FIELD(value)>("value", "value");
+    addField<DAS_BIND_MANAGED_FIELD(delay)>("delay", "delay");
+  }
+
+  bool canCopy() const override { return true; }
+  virtual bool hasNonTrivialCtor() const override { return false; }
+  virtual bool isLocal() const override { return true; }
+  virtual bool canClone() const override { return true; }
+  virtual bool canMove() const override { return true; }
+  virtual bool canNew() const override { return true; }
+  virtual bool canBePlacedInContainer() const override { return true; }
+};
+
+struct SoundStreamStatsAnnotation : ManagedStructureAnnotation<sound::SoundStreamStats, true, true>
+{
+  SoundStreamStatsAnnotation(ModuleLibrary & ml) : ManagedStructureAnnotation("SoundStreamStats", ml, "das::sound::SoundStreamStats")
+  {
+    addField<DAS_BIND_MANAGED_FIELD(latency)>("latency", "latency");
+    addField<DAS_BIND_MANAGED_FIELD(targetLatency)>("target_latency", "targetLatency");
+    addField<DAS_BIND_MANAGED_FIELD(averageLatency)>("average_latency", "averageLatency");
+    addField<DAS_BIND_MANAGED_FIELD(correction)>("correction", "correction");
+    addField<DAS_BIND_MANAGED_FIELD(minCorrection)>("min_correction", "minCorrection");
+    addField<DAS_BIND_MANAGED_FIELD(maxCorrection)>("max_correction", "maxCorrection");
+    addField<DAS_BIND_MANAGED_FIELD(underruns)>("underruns", "underruns");
+    addField<DAS_BIND_MANAGED_FIELD(droppedFrames)>("dropped_frames", "droppedFrames");
+  }
+
+  bool canCopy() const override { return true; }
+  virtual bool hasNonTrivialCtor() const override { return false; }
+  virtual bool isLocal() const override { return true; }
+  virtual bool canClone() const override { return true; }
+  virtual bool canMove() const override { return true; }
+  virtual bool canNew() const override { return true; }
+  virtual bool canBePlacedInContainer() const override { return true; }
+};
+
+struct SoundMemoryPoolStatsAnnotation : ManagedStructureAnnotation<sound::SoundMemoryPoolStats, true, true>
+{
+  SoundMemoryPoolStatsAnnotation(ModuleLibrary & ml) : ManagedStructureAnnotation("SoundMemoryPoolStats", ml, "das::sound::SoundMemoryPoolStats")
+  {
+    addField<DAS_BIND_MANAGED_FIELD(blockSize)>("block_size", "blockSize");
+    addField<DAS_BIND_MANAGED_FIELD(blocksUsed)>("blocks_used", "blocksUsed");
+    addField<DAS_BIND_MANAGED_FIELD(blocksReserved)>("blocks_reserved", "blocksReserved");
+    addField<DAS_BIND_MANAGED_FIELD(bytesUsed)>("bytes_used", "bytesUsed");
+    addField<DAS_BIND_MANAGED_FIELD(bytesReserved)>("bytes_reserved", "bytesReserved");
+    addField<DAS_BIND_MANAGED_FIELD(allocations)>("allocations", "allocations");
+    addField<DAS_BIND_MANAGED_FIELD(failures)>("failures", "failures");
+  }
+
+  bool canCopy() const override { return true; }
+  virtual bool hasNonTrivialCtor() const override { return false; }
+  virtual bool isLocal() const override { return true; }
+  virtual bool canClone() const override { return true; }
+  virtual bool canMove() const override { return true; }
+  virtual bool canNew() const override { return true; }
+  virtual bool canBePlacedInContainer() const override { return true; }
+};
+
+struct SoundLoadHandleAnnotation final: ManagedValueAnnotation<sound::SoundLoadHandle>
+{
+  SoundLoadHandleAnnotation(ModuleLibrary & mlib) : ManagedValueAnnotation(mlib, "SoundLoadHandle", "das::sound::SoundLoadHandle")
+  {
+  }
+
+  virtual void walk(DataWalker & walker, void * data) override
+  {
+    walker.UInt(((sound::SoundLoadHandle *)data)->handle);
+  }
+
+  virtual bool canCopy() const override { return true; }
+  virtual bool hasNonTrivialCtor() const override { return false; }
+  virtual bool isLocal() const override { return true; }
+  virtual bool canClone() const override { return true; }
+  virtual bool canMove() const override { return true; }
+  virtual bool canNew() const override { return true; }
+  virtual bool canBePlacedInContainer() const override { return true; }
+};
+
+struct FmNoteHandleAnnotation final: ManagedValueAnnotation<sound::FmNoteHandle>
+{
+  FmNoteHandleAnnotation(ModuleLibrary & mlib) : ManagedValueAnnotation(mlib, "FmNoteHandle", "das::sound::FmNoteHandle")
+  {
+  }
+
+  virtual void walk(DataWalker & walker, void * data) override
+  {
+    walker.UInt(((sound::FmNoteHandle *)data)->handle);
+  }
+
+  virtual bool canCopy() const override { return true; }
+  virtual bool hasNonTrivialCtor() const override { return false; }
+  virtual bool isLocal() const override { return true; }
+  virtual bool canClone() const override { return true; }
+  virtual bool canMove() const override { return true; }
+  virtual bool canNew() const override { return true; }
+  virtual bool canBePlacedInContainer() const override { return true; }
+};
+
 struct Opl3ChipAnnotation : ManagedStructureAnnotation<opl3_chip> {
     Opl3ChipAnnotation ( ModuleLibrary & mlib ) : ManagedStructureAnnotation("Opl3Chip", mlib, "opl3_chip") {
     }
@@ -1362,8 +7307,21 @@ public:
             SideEffects::worstDefault, "OPL3_Generate4ChResampled")->args({"chip", "buf"});
         addExtern<DAS_BIND_FUN(OPL3_Generate4ChStream)>(*this, lib, "OPL3_Generate4ChStream",
             SideEffects::worstDefault, "OPL3_Generate4ChStream")->args({"chip", "sndptr1", "sndptr2", "numsamples"});
+        addExtern<DAS_BIND_FUN(OPL3_SetFastMode)>(*this, lib, "OPL3_SetFastMode",
+            SideEffects::worstDefault, "OPL3_SetFastMode")->args({"chip", "enable"});
 
+        addEnumeration(das::make_smart<EnumerationSampleFormat>());
         addAnnotation(das::make_smart<PlayingSoundHandleAnnotation>(lib));
+        addAnnotation(das::make_smart<SoundLoadHandleAnnotation>(lib));
+        addAnnotation(das::make_smart<FmNoteHandleAnnotation>(lib));
+        addAnnotation(das::make_smart<SoundLoadStatsAnnotation>(lib));
+        addCtorAndUsing<sound::SoundLoadStats>(*this, lib, "SoundLoadStats", "sound::SoundLoadStats");
+        addAnnotation(das::make_smart<SoundMemoryPoolStatsAnnotation>(lib));
+        addCtorAndUsing<sound::SoundMemoryPoolStats>(*this, lib, "SoundMemoryPoolStats", "sound::SoundMemoryPoolStats");
+        addAnnotation(das::make_smart<SoundStreamStatsAnnotation>(lib));
+        addCtorAndUsing<sound::SoundStreamStats>(*this, lib, "SoundStreamStats", "sound::SoundStreamStats");
+        addAnnotation(das::make_smart<Opl3RegWriteAnnotation>(lib));
+        addCtorAndUsing<sound::Opl3RegWrite>(*this, lib, "Opl3RegWrite", "sound::Opl3RegWrite");
         addAnnotation(das::make_smart<PcmSoundAnnotation>(lib));
         addCtorAndUsing<sound::PcmSound>(*this, lib, "PcmSound", "sound::PcmSound");
 
@@ -1382,10 +7340,91 @@ public:
           "create_sound", SideEffects::modifyExternal, "sound::create_sound_stereo")
           ->args({"frequency", "data"});
 
+        addExtern<DAS_BIND_FUN(sound::create_sound_uninitialized), SimNode_ExtFuncCallAndCopyOrMove>(*this, lib,
+          "create_sound_uninitialized", SideEffects::modifyExternal, "sound::create_sound_uninitialized")
+          ->args({"frequency", "frames", "channels"});
+
         addExtern<DAS_BIND_FUN(sound::create_sound_from_file), SimNode_ExtFuncCallAndCopyOrMove>(*this, lib,
           "create_sound", SideEffects::modifyExternal, "sound::create_sound_from_file")
           ->args({"file_name"});
 
+        addExtern<DAS_BIND_FUN(sound::create_sound_from_file_format), SimNode_ExtFuncCallAndCopyOrMove>(*this, lib,
+          "create_sound", SideEffects::modifyExternal, "sound::create_sound_from_file_format")
+          ->args({"file_name", "format"});
+
+        addExtern<DAS_BIND_FUN(sound::create_sound_from_memory_array), SimNode_ExtFuncCallAndCopyOrMove>(*this, lib,
+          "create_sound_from_memory", SideEffects::modifyExternal, "sound::create_sound_from_memory_array")
+          ->args({"bytes", "format_hint"});
+
+        addExtern<DAS_BIND_FUN(sound::create_sound_from_reader_block), SimNode_ExtFuncCallAndCopyOrMove>(*this, lib,
+          "create_sound_from_reader", SideEffects::invoke, "sound::create_sound_from_reader_block")
+          ->args({"format_hint", "reader", "context", "at"});
+
+        addExtern<DAS_BIND_FUN(sound::create_sound_cached), SimNode_ExtFuncCallAndCopyOrMove>(*this, lib,
+          "create_sound_cached", SideEffects::modifyExternal, "sound::create_sound_cached")
+          ->args({"file_name", "cache_file_name"});
+
+        addExtern<DAS_BIND_FUN(sound::create_sound_cached_format), SimNode_ExtFuncCallAndCopyOrMove>(*this, lib,
+          "create_sound_cached", SideEffects::modifyExternal, "sound::create_sound_cached_format")
+          ->args({"file_name", "cache_file_name", "format"});
+
+        addExtern<DAS_BIND_FUN(sound::open_sound_cache), SimNode_ExtFuncCallAndCopyOrMove>(*this, lib,
+          "open_sound_cache", SideEffects::modifyExternal, "sound::open_sound_cache")
+          ->args({"cache_file_name"});
+
+        addExtern<DAS_BIND_FUN(sound::open_sound_cache_checked), SimNode_ExtFuncCallAndCopyOrMove>(*this, lib,
+          "open_sound_cache", SideEffects::modifyExternal, "sound::open_sound_cache_checked")
+          ->args({"cache_file_name", "source_file_name"});
+
+        addExtern<DAS_BIND_FUN(sound::save_sound_cache)>(*this, lib,
+          "save_sound_cache", SideEffects::modifyExternal, "sound::save_sound_cache")
+          ->args({"sound", "cache_file_name", "source_file_name"});
+
+        addExtern<DAS_BIND_FUN(sound::set_sound_memory_budget)>(*this, lib,
+          "set_sound_memory_budget", SideEffects::modifyExternal, "sound::set_sound_memory_budget")
+          ->args({"bytes"});
+
+        addExtern<DAS_BIND_FUN(sound::get_sound_memory_budget)>(*this, lib,
+          "get_sound_memory_budget", SideEffects::accessExternal, "sound::get_sound_memory_budget");
+
+        addExtern<DAS_BIND_FUN(sound::get_sound_memory_reserved)>(*this, lib,
+          "get_sound_memory_reserved", SideEffects::accessExternal, "sound::get_sound_memory_reserved");
+
+        addExtern<DAS_BIND_FUN(sound::get_sound_memory_pool_count)>(*this, lib,
+          "get_sound_memory_pool_count", SideEffects::accessExternal, "sound::get_sound_memory_pool_count");
+
+        addExtern<DAS_BIND_FUN(sound::get_sound_memory_pool_stats)>(*this, lib,
+          "get_sound_memory_pool_stats", SideEffects::modifyArgumentAndAccessExternal, "sound::get_sound_memory_pool_stats")
+          ->args({"index", "stats"});
+
+        addExtern<DAS_BIND_FUN(sound::convert_sound_format)>(*this, lib,
+          "convert_sound_format", SideEffects::modifyExternal, "sound::convert_sound_format")
+          ->args({"sound", "format"});
+
+        addExtern<DAS_BIND_FUN(sound::create_sound_async)>(*this, lib,
+          "create_sound_async", SideEffects::modifyExternal, "sound::create_sound_async")
+          ->args({"file_name"});
+
+        addExtern<DAS_BIND_FUN(sound::create_sound_async_format)>(*this, lib,
+          "create_sound_async", SideEffects::modifyExternal, "sound::create_sound_async_format")
+          ->args({"file_name", "format"});
+
+        addExtern<DAS_BIND_FUN(sound::is_sound_loaded)>(*this, lib,
+          "is_sound_loaded", SideEffects::accessExternal, "sound::is_sound_loaded")
+          ->args({"load_handle"});
+
+        addExtern<DAS_BIND_FUN(sound::wait_sound_loaded)>(*this, lib,
+          "wait_sound_loaded", SideEffects::modifyExternal, "sound::wait_sound_loaded")
+          ->args({"load_handle"});
+
+        addExtern<DAS_BIND_FUN(sound::take_loaded_sound), SimNode_ExtFuncCallAndCopyOrMove>(*this, lib,
+          "take_loaded_sound", SideEffects::modifyExternal, "sound::take_loaded_sound")
+          ->args({"load_handle"});
+
+        addExtern<DAS_BIND_FUN(sound::create_sounds_bulk)>(*this, lib,
+          "create_sounds_bulk", SideEffects::modifyArgumentAndExternal, "sound::create_sounds_bulk")
+          ->args({"file_names", "out_sounds", "stats"});
+
         addExtern<DAS_BIND_FUN(sound::get_sound_data)>(*this, lib,
           "get_sound_data", SideEffects::modifyArgumentAndExternal, "sound::get_sound_data")
           ->args({"sound", "out_data"});
@@ -1402,6 +7441,30 @@ public:
           "set_sound_data", SideEffects::modifyExternal, "sound::set_sound_data_stereo")
           ->args({"sound", "in_data"});
 
+        addExtern<DAS_BIND_FUN(sound::get_sound_data_range)>(*this, lib,
+          "get_sound_data", SideEffects::modifyArgumentAndExternal, "sound::get_sound_data_range")
+          ->args({"sound", "frame_offset", "out_data"});
+
+        addExtern<DAS_BIND_FUN(sound::get_sound_data_range_stereo)>(*this, lib,
+          "get_sound_data", SideEffects::modifyArgumentAndExternal, "sound::get_sound_data_range_stereo")
+          ->args({"sound", "frame_offset", "out_data"});
+
+        addExtern<DAS_BIND_FUN(sound::set_sound_data_range)>(*this, lib,
+          "set_sound_data", SideEffects::modifyExternal, "sound::set_sound_data_range")
+          ->args({"sound", "frame_offset", "in_data"});
+
+        addExtern<DAS_BIND_FUN(sound::set_sound_data_range_stereo)>(*this, lib,
+          "set_sound_data", SideEffects::modifyExternal, "sound::set_sound_data_range_stereo")
+          ->args({"sound", "frame_offset", "in_data"});
+
+        addExtern<DAS_BIND_FUN(sound::with_sound_data)>(*this, lib,
+          "with_sound_data", SideEffects::invoke, "sound::with_sound_data")
+          ->args({"sound", "block", "context", "at"});
+
+        addExtern<DAS_BIND_FUN(sound::with_sound_data_stereo)>(*this, lib,
+          "with_sound_data", SideEffects::invoke, "sound::with_sound_data_stereo")
+          ->args({"sound", "block", "context", "at"});
+
         addExtern<DAS_BIND_FUN(sound::play_sound_1)>(*this, lib,
           "play_sound", SideEffects::modifyExternal, "sound::play_sound_1")
           ->args({"sound"});
@@ -1462,6 +7525,288 @@ public:
           "play_sound_deferred", SideEffects::modifyExternal, "sound::play_sound_deferred_5")
           ->args({"sound", "defer_seconds", "volume", "pitch", "pan", "start_time", "stop_time"});
 
+        addExtern<DAS_BIND_FUN(sound::play_sound_stream_1)>(*this, lib,
+          "play_sound_stream", SideEffects::modifyExternal, "sound::play_sound_stream_1")
+          ->args({"file_name"});
+
+        addExtern<DAS_BIND_FUN(sound::play_sound_stream_2)>(*this, lib,
+          "play_sound_stream", SideEffects::modifyExternal, "sound::play_sound_stream_2")
+          ->args({"file_name", "volume"});
+
+        addExtern<DAS_BIND_FUN(sound::play_sound_stream_3)>(*this, lib,
+          "play_sound_stream", SideEffects::modifyExternal, "sound::play_sound_stream_3")
+          ->args({"file_name", "volume", "pitch"});
+
+        addExtern<DAS_BIND_FUN(sound::play_sound_stream_4)>(*this, lib,
+          "play_sound_stream", SideEffects::modifyExternal, "sound::play_sound_stream_4")
+          ->args({"file_name", "volume", "pitch", "pan"});
+
+        addExtern<DAS_BIND_FUN(sound::play_sound_stream_loop_1)>(*this, lib,
+          "play_sound_stream_loop", SideEffects::modifyExternal, "sound::play_sound_stream_loop_1")
+          ->args({"file_name"});
+
+        addExtern<DAS_BIND_FUN(sound::play_sound_stream_loop_2)>(*this, lib,
+          "play_sound_stream_loop", SideEffects::modifyExternal, "sound::play_sound_stream_loop_2")
+          ->args({"file_name", "volume"});
+
+        addExtern<DAS_BIND_FUN(sound::play_sound_stream_loop_3)>(*this, lib,
+          "play_sound_stream_loop", SideEffects::modifyExternal, "sound::play_sound_stream_loop_3")
+          ->args({"file_name", "volume", "pitch"});
+
+        addExtern<DAS_BIND_FUN(sound::play_sound_stream_loop_4)>(*this, lib,
+          "play_sound_stream_loop", SideEffects::modifyExternal, "sound::play_sound_stream_loop_4")
+          ->args({"file_name", "volume", "pitch", "pan"});
+
+        addExtern<DAS_BIND_FUN(sound::play_sound_push_stream_2)>(*this, lib,
+          "play_sound_push_stream", SideEffects::modifyExternal, "sound::play_sound_push_stream_2")
+          ->args({"frequency", "channels"});
+
+        addExtern<DAS_BIND_FUN(sound::play_sound_push_stream_3)>(*this, lib,
+          "play_sound_push_stream", SideEffects::modifyExternal, "sound::play_sound_push_stream_3")
+          ->args({"frequency", "channels", "buffer_seconds"});
+
+        addExtern<DAS_BIND_FUN(sound::play_sound_push_stream_4)>(*this, lib,
+          "play_sound_push_stream", SideEffects::modifyExternal, "sound::play_sound_push_stream_4")
+          ->args({"frequency", "channels", "buffer_seconds", "volume"});
+
+        addExtern<DAS_BIND_FUN(sound::push_sound_stream)>(*this, lib,
+          "push_sound_stream", SideEffects::modifyExternal, "sound::push_sound_stream")
+          ->args({"handle", "data"});
+
+        addExtern<DAS_BIND_FUN(sound::push_sound_stream_stereo)>(*this, lib,
+          "push_sound_stream", SideEffects::modifyExternal, "sound::push_sound_stream_stereo")
+          ->args({"handle", "data"});
+
+        addExtern<DAS_BIND_FUN(sound::finish_sound_stream)>(*this, lib,
+          "finish_sound_stream", SideEffects::modifyExternal, "sound::finish_sound_stream")
+          ->args({"handle"});
+
+        addExtern<DAS_BIND_FUN(sound::get_sound_stream_latency)>(*this, lib,
+          "get_sound_stream_latency", SideEffects::accessExternal, "sound::get_sound_stream_latency")
+          ->args({"handle"});
+
+        addExtern<DAS_BIND_FUN(sound::get_sound_stream_space)>(*this, lib,
+          "get_sound_stream_space", SideEffects::accessExternal, "sound::get_sound_stream_space")
+          ->args({"handle"});
+
+        addExtern<DAS_BIND_FUN(sound::get_sound_stream_underruns)>(*this, lib,
+          "get_sound_stream_underruns", SideEffects::accessExternal, "sound::get_sound_stream_underruns")
+          ->args({"handle"});
+
+        addExtern<DAS_BIND_FUN(sound::play_sound_input_stream_3)>(*this, lib,
+          "play_sound_input_stream", SideEffects::modifyExternal, "sound::play_sound_input_stream_3")
+          ->args({"frequency", "channels", "target_latency"});
+
+        addExtern<DAS_BIND_FUN(sound::play_sound_input_stream_4)>(*this, lib,
+          "play_sound_input_stream", SideEffects::modifyExternal, "sound::play_sound_input_stream_4")
+          ->args({"frequency", "channels", "target_latency", "volume"});
+
+        addExtern<DAS_BIND_FUN(sound::get_sound_stream_stats)>(*this, lib,
+          "get_sound_stream_stats", SideEffects::modifyArgumentAndAccessExternal, "sound::get_sound_stream_stats")
+          ->args({"handle", "stats"});
+
+        addExtern<DAS_BIND_FUN(sound::play_sound_opl3_0)>(*this, lib,
+          "play_sound_opl3", SideEffects::modifyExternal, "sound::play_sound_opl3_0");
+
+        addExtern<DAS_BIND_FUN(sound::play_sound_opl3_1)>(*this, lib,
+          "play_sound_opl3", SideEffects::modifyExternal, "sound::play_sound_opl3_1")
+          ->args({"volume"});
+
+        addExtern<DAS_BIND_FUN(sound::play_sound_opl3_2)>(*this, lib,
+          "play_sound_opl3", SideEffects::modifyExternal, "sound::play_sound_opl3_2")
+          ->args({"volume", "pan"});
+
+        addExtern<DAS_BIND_FUN(sound::write_opl3_reg)>(*this, lib,
+          "write_opl3_reg", SideEffects::modifyExternal, "sound::write_opl3_reg")
+          ->args({"handle", "reg", "value"});
+
+        addExtern<DAS_BIND_FUN(sound::write_opl3_reg_at)>(*this, lib,
+          "write_opl3_reg", SideEffects::modifyExternal, "sound::write_opl3_reg_at")
+          ->args({"handle", "frame", "reg", "value"});
+
+        addExtern<DAS_BIND_FUN(sound::get_opl3_time)>(*this, lib,
+          "get_opl3_time", SideEffects::accessExternal, "sound::get_opl3_time")
+          ->args({"handle"});
+
+        addExtern<DAS_BIND_FUN(sound::set_opl3_fast_mode)>(*this, lib,
+          "set_opl3_fast_mode", SideEffects::modifyExternal, "sound::set_opl3_fast_mode")
+          ->args({"handle", "enable"});
+
+        // float output of the chip through the band-limited resampler, the uint16 overloads of medialib/opl3 keep the linear one
+        addExtern<DAS_BIND_FUN(sound::opl3_generate_stereo)>(*this, lib,
+          "OPL3_GenerateStream", SideEffects::modifyArgument, "sound::opl3_generate_stereo")
+          ->args({"chip", "data"});
+
+        addExtern<DAS_BIND_FUN(sound::opl3_generate_4ch)>(*this, lib,
+          "OPL3_GenerateStream4Ch", SideEffects::modifyArgument, "sound::opl3_generate_4ch")
+          ->args({"chip", "data"});
+
+        // (left + right) / 2 of the resampled stereo, averaged with SSE2
+        addExtern<DAS_BIND_FUN(sound::opl3_generate_mono)>(*this, lib,
+          "OPL3_GenerateStreamMono", SideEffects::modifyArgument, "sound::opl3_generate_mono")
+          ->args({"chip", "data"});
+
+        // left channel only, without a temporary stereo buffer
+        addExtern<DAS_BIND_FUN(sound::opl3_generate_mono_s16)>(*this, lib,
+          "OPL3_GenerateStreamMono", SideEffects::modifyArgument, "sound::opl3_generate_mono_s16")
+          ->args({"chip", "data"});
+
+        // renders into the samples of a PcmSound, the whole sound or frames from frame_offset
+        addExtern<DAS_BIND_FUN(sound::opl3_generate_sound)>(*this, lib,
+          "OPL3_GenerateSound", SideEffects::modifyArgumentAndExternal, "sound::opl3_generate_sound")
+          ->args({"chip", "sound"});
+
+        addExtern<DAS_BIND_FUN(sound::opl3_generate_sound_range)>(*this, lib,
+          "OPL3_GenerateSound", SideEffects::modifyArgumentAndExternal, "sound::opl3_generate_sound_range")
+          ->args({"chip", "sound", "frame_offset", "frames"});
+
+        addExtern<DAS_BIND_FUN(sound::opl3_write_regs)>(*this, lib,
+          "OPL3_WriteRegs", SideEffects::modifyArgument, "sound::opl3_write_regs")
+          ->args({"chip", "writes"});
+
+        // chip snapshots, OPL3_SaveState fills data when it has at least OPL3_GetStateSize bytes and returns that size,
+        // OPL3_RestoreState returns false and leaves the chip untouched when data is not a valid snapshot
+        addExtern<DAS_BIND_FUN(sound::opl3_state_size)>(*this, lib,
+          "OPL3_GetStateSize", SideEffects::none, "sound::opl3_state_size")
+          ->args({"chip"});
+
+        addExtern<DAS_BIND_FUN(sound::opl3_save_state)>(*this, lib,
+          "OPL3_SaveState", SideEffects::modifyArgument, "sound::opl3_save_state")
+          ->args({"chip", "data"});
+
+        addExtern<DAS_BIND_FUN(sound::opl3_restore_state)>(*this, lib,
+          "OPL3_RestoreState", SideEffects::modifyArgument, "sound::opl3_restore_state")
+          ->args({"chip", "data"});
+
+        addExtern<DAS_BIND_FUN(sound::opl3_write_regs_buffered)>(*this, lib,
+          "OPL3_WriteRegsBuffered", SideEffects::modifyArgument, "sound::opl3_write_regs_buffered")
+          ->args({"chip", "writes"});
+
+        addExtern<DAS_BIND_FUN(sound::write_opl3_regs)>(*this, lib,
+          "write_opl3_regs", SideEffects::modifyExternal, "sound::write_opl3_regs")
+          ->args({"handle", "writes"});
+
+        addExtern<DAS_BIND_FUN(sound::write_opl3_regs_at)>(*this, lib,
+          "write_opl3_regs", SideEffects::modifyExternal, "sound::write_opl3_regs_at")
+          ->args({"handle", "frame", "writes"});
+
+
+        addExtern<DAS_BIND_FUN(sound::opl3_generate_group)>(*this, lib,
+          "OPL3_GenerateStreamGroup", SideEffects::modifyArgumentAndExternal, "sound::opl3_generate_group")
+          ->args({"chips", "data"});
+
+        addExtern<DAS_BIND_FUN(sound::opl3_generate_group_gains)>(*this, lib,
+          "OPL3_GenerateStreamGroup", SideEffects::modifyArgumentAndExternal, "sound::opl3_generate_group_gains")
+          ->args({"chips", "gains", "data"});
+
+        addExtern<DAS_BIND_FUN(sound::set_opl3_render_threads)>(*this, lib,
+          "set_opl3_render_threads", SideEffects::modifyExternal, "sound::set_opl3_render_threads")
+          ->args({"count"});
+
+        addExtern<DAS_BIND_FUN(sound::play_sound_opl_music_1)>(*this, lib,
+          "play_sound_opl_music", SideEffects::modifyExternal, "sound::play_sound_opl_music_1")
+          ->args({"file_name"});
+
+        addExtern<DAS_BIND_FUN(sound::play_sound_opl_music_2)>(*this, lib,
+          "play_sound_opl_music", SideEffects::modifyExternal, "sound::play_sound_opl_music_2")
+          ->args({"file_name", "volume"});
+
+        addExtern<DAS_BIND_FUN(sound::play_sound_opl_music_3)>(*this, lib,
+          "play_sound_opl_music", SideEffects::modifyExternal, "sound::play_sound_opl_music_3")
+          ->args({"file_name", "volume", "pitch"});
+
+        addExtern<DAS_BIND_FUN(sound::play_sound_opl_music_4)>(*this, lib,
+          "play_sound_opl_music", SideEffects::modifyExternal, "sound::play_sound_opl_music_4")
+          ->args({"file_name", "volume", "pitch", "pan"});
+
+        addExtern<DAS_BIND_FUN(sound::play_sound_opl_music_loop_1)>(*this, lib,
+          "play_sound_opl_music_loop", SideEffects::modifyExternal, "sound::play_sound_opl_music_loop_1")
+          ->args({"file_name"});
+
+        addExtern<DAS_BIND_FUN(sound::play_sound_opl_music_loop_2)>(*this, lib,
+          "play_sound_opl_music_loop", SideEffects::modifyExternal, "sound::play_sound_opl_music_loop_2")
+          ->args({"file_name", "volume"});
+
+        addExtern<DAS_BIND_FUN(sound::play_sound_opl_music_loop_3)>(*this, lib,
+          "play_sound_opl_music_loop", SideEffects::modifyExternal, "sound::play_sound_opl_music_loop_3")
+          ->args({"file_name", "volume", "pitch"});
+
+        addExtern<DAS_BIND_FUN(sound::play_sound_opl_music_loop_4)>(*this, lib,
+          "play_sound_opl_music_loop", SideEffects::modifyExternal, "sound::play_sound_opl_music_loop_4")
+          ->args({"file_name", "volume", "pitch", "pan"});
+
+        addExtern<DAS_BIND_FUN(sound::set_opl_music_tempo)>(*this, lib,
+          "set_opl_music_tempo", SideEffects::modifyExternal, "sound::set_opl_music_tempo")
+          ->args({"handle", "tempo"});
+
+        addExtern<DAS_BIND_FUN(sound::bake_opl_music_1), SimNode_ExtFuncCallAndCopyOrMove>(*this, lib,
+          "bake_opl_music", SideEffects::modifyExternal, "sound::bake_opl_music_1")
+          ->args({"file_name"});
+
+        addExtern<DAS_BIND_FUN(sound::bake_opl_music_3), SimNode_ExtFuncCallAndCopyOrMove>(*this, lib,
+          "bake_opl_music", SideEffects::modifyExternal, "sound::bake_opl_music_3")
+          ->args({"file_name", "loops", "tempo"});
+
+        addExtern<DAS_BIND_FUN(sound::seek_opl_music)>(*this, lib,
+          "seek_opl_music", SideEffects::modifyExternal, "sound::seek_opl_music")
+          ->args({"handle", "seconds"});
+
+        addExtern<DAS_BIND_FUN(sound::load_opl_midi_bank)>(*this, lib,
+          "load_opl_midi_bank", SideEffects::modifyExternal, "sound::load_opl_midi_bank")
+          ->args({"file_name"});
+
+        addExtern<DAS_BIND_FUN(sound::load_opl_midi_instrument)>(*this, lib,
+          "load_opl_midi_instrument", SideEffects::modifyExternal, "sound::load_opl_midi_instrument")
+          ->args({"program", "file_name"});
+
+        addExtern<DAS_BIND_FUN(sound::reset_opl_midi_bank)>(*this, lib,
+          "reset_opl_midi_bank", SideEffects::modifyExternal, "sound::reset_opl_midi_bank");
+
+        addExtern<DAS_BIND_FUN(sound::send_opl3_midi)>(*this, lib,
+          "send_opl3_midi", SideEffects::modifyExternal, "sound::send_opl3_midi")
+          ->args({"handle", "status", "data1", "data2"});
+
+        addExtern<DAS_BIND_FUN(sound::send_opl3_midi_at)>(*this, lib,
+          "send_opl3_midi", SideEffects::modifyExternal, "sound::send_opl3_midi_at")
+          ->args({"handle", "frame", "status", "data1", "data2"});
+
+        addExtern<DAS_BIND_FUN(sound::play_fm_note_2)>(*this, lib,
+          "play_fm_note", SideEffects::modifyExternal, "sound::play_fm_note_2")
+          ->args({"program", "note"});
+
+        addExtern<DAS_BIND_FUN(sound::play_fm_note_3)>(*this, lib,
+          "play_fm_note", SideEffects::modifyExternal, "sound::play_fm_note_3")
+          ->args({"program", "note", "volume"});
+
+        addExtern<DAS_BIND_FUN(sound::play_fm_note_4)>(*this, lib,
+          "play_fm_note", SideEffects::modifyExternal, "sound::play_fm_note_4")
+          ->args({"program", "note", "volume", "duration"});
+
+        addExtern<DAS_BIND_FUN(sound::stop_fm_note)>(*this, lib,
+          "stop_fm_note", SideEffects::modifyExternal, "sound::stop_fm_note")
+          ->args({"note"});
+
+        addExtern<DAS_BIND_FUN(sound::stop_all_fm_notes)>(*this, lib,
+          "stop_all_fm_notes", SideEffects::modifyExternal, "sound::stop_all_fm_notes");
+
+        addExtern<DAS_BIND_FUN(sound::set_fm_note_pitch)>(*this, lib,
+          "set_fm_note_pitch", SideEffects::modifyExternal, "sound::set_fm_note_pitch")
+          ->args({"note", "pitch"});
+
+        addExtern<DAS_BIND_FUN(sound::set_fm_note_volume)>(*this, lib,
+          "set_fm_note_volume", SideEffects::modifyExternal, "sound::set_fm_note_volume")
+          ->args({"note", "volume"});
+
+        addExtern<DAS_BIND_FUN(sound::is_fm_note_playing)>(*this, lib,
+          "is_fm_note_playing", SideEffects::accessExternal, "sound::is_fm_note_playing")
+          ->args({"note"});
+
+        addExtern<DAS_BIND_FUN(sound::set_fm_pool_chips)>(*this, lib,
+          "set_fm_pool_chips", SideEffects::modifyExternal, "sound::set_fm_pool_chips")
+          ->args({"count"});
+
+        addExtern<DAS_BIND_FUN(sound::get_fm_pool_active_chips)>(*this, lib,
+          "get_fm_pool_active_chips", SideEffects::accessExternal, "sound::get_fm_pool_active_chips");
 
         addExtern<DAS_BIND_FUN(sound::set_sound_pitch)>(*this, lib,
           "set_sound_pitch", SideEffects::modifyExternal, "sound::set_sound_pitch")
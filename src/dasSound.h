@@ -1,21 +1,37 @@
 #include <daScript/daScript.h>
 
+typedef struct _opl3_chip opl3_chip;
+
 namespace das
 {
 
 namespace sound
 {
   struct DasboxDebugInfo;
+  struct SampleBuffer;
+
+  enum class SampleFormat
+  {
+    f32,
+    ima_adpcm,  // 4 bits per sample, decoded by the mixer block by block
+    s16,        // 16-bit signed integer
+    f16,        // IEEE half float
+  };
+
+  #define SOUND_ADPCM_BLOCK_FRAMES 256 // power of 2
+  #define SOUND_ADPCM_BLOCK_BYTES (4 + SOUND_ADPCM_BLOCK_FRAMES / 2) // per channel: predictor, step index, nibbles
 
   struct PcmSound
   {
   private:
     float * data;
+    SampleBuffer * buffer;  // reference counted storage of data, shared between copies until written
   public:
     DasboxDebugInfo * dbg;
     int frequency;
     int samples;
     int channels;
+    SampleFormat format;
     unsigned memoryUsed;
 
     float * getData() const
@@ -23,16 +39,37 @@ namespace sound
       return data;
     }
 
-    void newData(size_t size);
+    SampleBuffer * getBuffer() const
+    {
+      return buffer;
+    }
+
+    bool newData(size_t size);  // replaces current data, false when the sound memory budget is exhausted
     void deleteData();
     bool isValid() const
     {
       return !!data;
     }
 
+    bool isMapped() const;
+    bool isShared() const;
+    bool makeDataUnique();  // call before writing to getData()
+
+    inline int getAdpcmBlockCount() const
+    {
+      return (samples + 1 + SOUND_ADPCM_BLOCK_FRAMES - 1) / SOUND_ADPCM_BLOCK_FRAMES; // + wrap-around guard frame
+    }
+
+    inline int getBytesPerSample() const
+    {
+      return (format == SampleFormat::s16 || format == SampleFormat::f16) ? 2 : int(sizeof(float));
+    }
+
     inline int getDataMemorySize() const
     {
-      return channels * (samples + 4) * sizeof(float);
+      if (format == SampleFormat::ima_adpcm)
+        return getAdpcmBlockCount() * channels * SOUND_ADPCM_BLOCK_BYTES;
+      return channels * (samples + 4) * getBytesPerSample();
     }
 
     float getDuration() const
@@ -55,6 +92,11 @@ namespace sound
       return channels;
     }
 
+    SampleFormat getFormat() const
+    {
+      return format;
+    }
+
     PcmSound();
     PcmSound(const PcmSound & b);
     PcmSound& operator=(const PcmSound & b);
@@ -63,6 +105,36 @@ namespace sound
     ~PcmSound();
 
     friend void delete_sound(PcmSound * sound);
+    friend PcmSound open_sound_cache_checked(const char * cache_file_name, const char * source_file_name);
+  };
+
+  #define SOUND_SOURCE_WINDOW_FRAMES 2048
+
+  // Producer of frames for voices that are not backed by PcmSound data (streams, generators).
+  // read() is called from the audio thread while the sound critical section is held.
+  struct SoundSource
+  {
+    int frequency = 44100;
+    int channels = 1;
+    int windowFrames = 0;  // frames already pulled into window
+    int endFrame = 0;      // valid when ended, index of the first frame past the end of data in window
+    bool ended = false;
+    int64_t underruns = 0;
+    SoundSource * nextRetired = nullptr;  // retired sources list, see retire_source()
+    float window[(SOUND_SOURCE_WINDOW_FRAMES + 2) * 2];
+
+    virtual ~SoundSource() {}
+    virtual int read(float * dst, int frames) = 0;
+    virtual bool isFinished() const = 0;
+    virtual bool isSeeking() const { return false; }
+    virtual void seek(int64_t frame) { (void)frame; }
+    virtual double tell(double frames_behind) const = 0;  // position in frames of the frame frames_behind before the read cursor
+    // called by the mixer once per block with the frames left in window, multiplies the playback rate
+    virtual double rateScale(double window_frames, double seconds) { (void)window_frames; (void)seconds; return 1.0; }
+
+    void fillWindow(int frames);
+    void consumeWindow(int frames);
+    void resetWindow();
   };
 
   struct PlayingSoundHandle
@@ -70,17 +142,98 @@ namespace sound
     unsigned handle = 0;
   };
 
+  struct SoundLoadHandle
+  {
+    unsigned handle = 0;
+  };
+
+  struct FmNoteHandle
+  {
+    unsigned handle = 0;
+  };
+
+  struct Opl3RegWrite
+  {
+    uint32_t reg = 0;
+    uint8_t value = 0;
+    int32_t delay = 0;  // output samples after the previous write of the batch
+  };
+
+  struct SoundStreamStats
+  {
+    float latency = 0.0f;          // seconds buffered in the ring and the mixer window
+    float targetLatency = 0.0f;    // 0 for streams without drift control
+    float averageLatency = 0.0f;   // smoothed value the drift control works with
+    float correction = 0.0f;       // current playback rate correction, 0.001 = 0.1% faster
+    float minCorrection = 0.0f;
+    float maxCorrection = 0.0f;
+    int64_t underruns = 0;
+    int64_t droppedFrames = 0;     // pushed into a full ring
+  };
+
+  struct SoundMemoryPoolStats
+  {
+    int blockSize = 0;        // 0 for the large block arena
+    int blocksUsed = 0;
+    int blocksReserved = 0;   // arena: number of regions
+    int64_t bytesUsed = 0;
+    int64_t bytesReserved = 0;
+    int64_t allocations = 0;
+    int64_t failures = 0;     // allocations refused by the budget
+  };
+
+  struct SoundLoadStats
+  {
+    int files = 0;
+    int failed = 0;
+    double seconds = 0.0;
+    double sourceMegabytes = 0.0;   // encoded file sizes
+    double decodedMegabytes = 0.0;  // resulting sample data
+    double decodedMegabytesPerSecond = 0.0;
+    double filesPerSecond = 0.0;
+  };
+
+
+  // reads up to 'bytes' bytes at 'offset' into 'dst', returns the number of bytes read (0 at the end of data)
+  typedef int64_t (*SoundReadCallback)(void * user, int64_t offset, void * dst, int64_t bytes);
 
   void initialize();
   void finalize();
 
   PcmSound create_sound(int frequency, const das::TArray<float> & data);
   PcmSound create_sound_stereo(int frequency, const das::TArray<das::float2> & data);
+  PcmSound create_sound_uninitialized(int frequency, int frames, int channels);
   PcmSound create_sound_from_file(const char * file_name);
+  PcmSound create_sound_from_file_format(const char * file_name, SampleFormat format);
+  PcmSound create_sound_from_memory(const void * data, size_t size, const char * format_hint);
+  PcmSound create_sound_from_memory_array(const das::TArray<uint8_t> & bytes, const char * format_hint);
+  PcmSound create_sound_from_reader(SoundReadCallback read, void * user, const char * format_hint);
+  PcmSound create_sound_from_reader_block(const char * format_hint,
+    const das::TBlock<int64_t, int64_t, das::TArray<uint8_t>> & block, das::Context * context, das::LineInfoArg * at);
+  bool convert_sound_format(PcmSound & sound, SampleFormat format);
+  PcmSound open_sound_cache(const char * cache_file_name);
+  PcmSound open_sound_cache_checked(const char * cache_file_name, const char * source_file_name);
+  bool save_sound_cache(const PcmSound & sound, const char * cache_file_name, const char * source_file_name);
+  PcmSound create_sound_cached(const char * file_name, const char * cache_file_name);
+  PcmSound create_sound_cached_format(const char * file_name, const char * cache_file_name, SampleFormat format);
+  SoundLoadHandle create_sound_async(const char * file_name);
+  SoundLoadHandle create_sound_async_format(const char * file_name, SampleFormat format);
+  bool is_sound_loaded(SoundLoadHandle handle);
+  void wait_sound_loaded(SoundLoadHandle handle);
+  PcmSound take_loaded_sound(SoundLoadHandle handle);
+  void create_sounds_bulk(const das::TArray<char *> & file_names, das::TArray<PcmSound> & out_sounds, SoundLoadStats & stats);
   void get_sound_data(const PcmSound & sound, das::TArray<float> & out_data);
   void get_sound_data_stereo(const PcmSound & sound, das::TArray<das::float2> & out_data);
   void set_sound_data(PcmSound & sound, const das::TArray<float> & in_data);
   void set_sound_data_stereo(PcmSound & sound, const das::TArray<das::float2> & in_data);
+  void get_sound_data_range(const PcmSound & sound, int frame_offset, das::TArray<float> & out_data);
+  void get_sound_data_range_stereo(const PcmSound & sound, int frame_offset, das::TArray<das::float2> & out_data);
+  void set_sound_data_range(PcmSound & sound, int frame_offset, const das::TArray<float> & in_data);
+  void set_sound_data_range_stereo(PcmSound & sound, int frame_offset, const das::TArray<das::float2> & in_data);
+  void with_sound_data(PcmSound & sound, const das::TBlock<void, das::TTemporary<das::TArray<float>>> & block,
+    das::Context * context, das::LineInfoArg * at);
+  void with_sound_data_stereo(PcmSound & sound, const das::TBlock<void, das::TTemporary<das::TArray<das::float2>>> & block,
+    das::Context * context, das::LineInfoArg * at);
   void delete_sound(PcmSound * sound);
   void delete_allocated_sounds();
 
@@ -100,6 +253,77 @@ namespace sound
   PlayingSoundHandle play_sound_deferred_4(const PcmSound & sound, float defer_seconds, float volume, float pitch, float pan);
   PlayingSoundHandle play_sound_deferred_5(const PcmSound & sound, float defer_seconds, float volume, float pitch, float pan,
     float start_time, float end_time);
+  PlayingSoundHandle play_sound_stream_1(const char * file_name);
+  PlayingSoundHandle play_sound_stream_2(const char * file_name, float volume);
+  PlayingSoundHandle play_sound_stream_3(const char * file_name, float volume, float pitch);
+  PlayingSoundHandle play_sound_stream_4(const char * file_name, float volume, float pitch, float pan);
+  PlayingSoundHandle play_sound_stream_loop_1(const char * file_name);
+  PlayingSoundHandle play_sound_stream_loop_2(const char * file_name, float volume);
+  PlayingSoundHandle play_sound_stream_loop_3(const char * file_name, float volume, float pitch);
+  PlayingSoundHandle play_sound_stream_loop_4(const char * file_name, float volume, float pitch, float pan);
+  PlayingSoundHandle play_sound_push_stream_2(int frequency, int channels);
+  PlayingSoundHandle play_sound_push_stream_3(int frequency, int channels, float buffer_seconds);
+  PlayingSoundHandle play_sound_push_stream_4(int frequency, int channels, float buffer_seconds, float volume);
+  int push_sound_stream(PlayingSoundHandle handle, const das::TArray<float> & data);
+  int push_sound_stream_stereo(PlayingSoundHandle handle, const das::TArray<das::float2> & data);
+  void finish_sound_stream(PlayingSoundHandle handle);
+  float get_sound_stream_latency(PlayingSoundHandle handle);
+  int get_sound_stream_space(PlayingSoundHandle handle);
+  int64_t get_sound_stream_underruns(PlayingSoundHandle handle);
+  PlayingSoundHandle play_sound_input_stream_3(int frequency, int channels, float target_latency);
+  PlayingSoundHandle play_sound_input_stream_4(int frequency, int channels, float target_latency, float volume);
+  bool get_sound_stream_stats(PlayingSoundHandle handle, SoundStreamStats & stats);
+  PlayingSoundHandle play_sound_opl3_0();
+  PlayingSoundHandle play_sound_opl3_1(float volume);
+  PlayingSoundHandle play_sound_opl3_2(float volume, float pan);
+  bool write_opl3_reg(PlayingSoundHandle handle, uint32_t reg, uint8_t value);
+  bool write_opl3_reg_at(PlayingSoundHandle handle, int64_t frame, uint32_t reg, uint8_t value);
+  int64_t get_opl3_time(PlayingSoundHandle handle);
+  bool set_opl3_fast_mode(PlayingSoundHandle handle, bool enable);
+  void opl3_generate_stereo(opl3_chip & chip, das::TArray<das::float2> & data);
+  void opl3_generate_4ch(opl3_chip & chip, das::TArray<das::float4> & data);
+  void opl3_generate_mono(opl3_chip & chip, das::TArray<float> & data);
+  void opl3_generate_mono_s16(opl3_chip & chip, das::TArray<uint16_t> & data);
+  void opl3_generate_sound(opl3_chip & chip, PcmSound & sound);
+  void opl3_generate_sound_range(opl3_chip & chip, PcmSound & sound, int frame_offset, int frames);
+  void opl3_write_regs(opl3_chip & chip, const das::TArray<Opl3RegWrite> & writes);
+  void opl3_write_regs_buffered(opl3_chip & chip, const das::TArray<Opl3RegWrite> & writes);
+  int write_opl3_regs(PlayingSoundHandle handle, const das::TArray<Opl3RegWrite> & writes);
+  int write_opl3_regs_at(PlayingSoundHandle handle, int64_t frame, const das::TArray<Opl3RegWrite> & writes);
+  void opl3_generate_group(const das::TArray<opl3_chip *> & chips, das::TArray<das::float2> & data);
+  void opl3_generate_group_gains(const das::TArray<opl3_chip *> & chips, const das::TArray<float> & gains,
+    das::TArray<das::float2> & data);
+  int opl3_state_size(const opl3_chip & chip);
+  int opl3_save_state(const opl3_chip & chip, das::TArray<uint8_t> & data);
+  bool opl3_restore_state(opl3_chip & chip, const das::TArray<uint8_t> & data);
+  void set_opl3_render_threads(int count);
+  PlayingSoundHandle play_sound_opl_music_1(const char * file_name);
+  PlayingSoundHandle play_sound_opl_music_2(const char * file_name, float volume);
+  PlayingSoundHandle play_sound_opl_music_3(const char * file_name, float volume, float pitch);
+  PlayingSoundHandle play_sound_opl_music_4(const char * file_name, float volume, float pitch, float pan);
+  PlayingSoundHandle play_sound_opl_music_loop_1(const char * file_name);
+  PlayingSoundHandle play_sound_opl_music_loop_2(const char * file_name, float volume);
+  PlayingSoundHandle play_sound_opl_music_loop_3(const char * file_name, float volume, float pitch);
+  PlayingSoundHandle play_sound_opl_music_loop_4(const char * file_name, float volume, float pitch, float pan);
+  bool set_opl_music_tempo(PlayingSoundHandle handle, float tempo);
+  bool seek_opl_music(PlayingSoundHandle handle, float seconds);
+  PcmSound bake_opl_music_1(const char * file_name);
+  PcmSound bake_opl_music_3(const char * file_name, int loops, float tempo);
+  bool load_opl_midi_bank(const char * file_name);
+  bool load_opl_midi_instrument(int program, const char * file_name);
+  void reset_opl_midi_bank();
+  bool send_opl3_midi(PlayingSoundHandle handle, uint8_t status, uint8_t data1, uint8_t data2);
+  bool send_opl3_midi_at(PlayingSoundHandle handle, int64_t frame, uint8_t status, uint8_t data1, uint8_t data2);
+  FmNoteHandle play_fm_note_2(int program, float note);
+  FmNoteHandle play_fm_note_3(int program, float note, float volume);
+  FmNoteHandle play_fm_note_4(int program, float note, float volume, float duration);
+  bool stop_fm_note(FmNoteHandle handle);
+  void stop_all_fm_notes();
+  bool set_fm_note_pitch(FmNoteHandle handle, float note);
+  bool set_fm_note_volume(FmNoteHandle handle, float volume);
+  bool is_fm_note_playing(FmNoteHandle handle);
+  void set_fm_pool_chips(int count);
+  int get_fm_pool_active_chips();
 
   bool is_playing(PlayingSoundHandle handle);
   void set_sound_pitch(PlayingSoundHandle handle, float pitch);
@@ -117,11 +341,19 @@ namespace sound
   int64_t get_total_samples_played();
   double get_total_time_played();
   double get_memory_used();
+  double get_mapped_memory_used();
+  void set_sound_memory_budget(int64_t bytes);  // 0 - unlimited
+  int64_t get_sound_memory_budget();
+  int64_t get_sound_memory_reserved();
+  int get_sound_memory_pool_count();
+  bool get_sound_memory_pool_stats(int index, SoundMemoryPoolStats & stats);
   int get_total_sound_count();
   int get_playing_sound_count();
   void print_debug_infos(int from_frame);
 }
 
 template <> struct WrapType<sound::PlayingSoundHandle> { enum { value = false }; typedef uint32_t type; };
+template <> struct WrapType<sound::SoundLoadHandle> { enum { value = false }; typedef uint32_t type; };
+template <> struct WrapType<sound::FmNoteHandle> { enum { value = false }; typedef uint32_t type; };
 
 }